@@ -0,0 +1,250 @@
+#include "checkpoint.h"
+#include "snapshot.h"
+#include "util.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static char *checkpoint_dir;
+
+void dcfs_checkpoint_init(const char *guild_id) {
+  free(checkpoint_dir);
+  checkpoint_dir = dcfs_cache_path(guild_id, "uploads");
+  if (!checkpoint_dir)
+    return;
+
+  if (mkdir(checkpoint_dir, 0700) != 0 && errno != EEXIST) {
+    print_warn("failed to create %s: %s\n", checkpoint_dir, strerror(errno));
+    free(checkpoint_dir);
+    checkpoint_dir = NULL;
+  }
+}
+
+static void checkpoint_file(const struct dcfs_checkpoint *checkpoint,
+                            const char *suffix, char *out, size_t size) {
+  snprintf(out, size, "%s.%s", checkpoint->path, suffix);
+}
+
+/* writes the content of the file next to its progress. returns 1 if
+ * there's nowhere to keep it, the upload then can't outlive a failure */
+int dcfs_checkpoint_new(struct dcfs_checkpoint *checkpoint,
+                        const char *channel_id, struct dcfs_file *file) {
+  memset(checkpoint, 0, sizeof(struct dcfs_checkpoint));
+  if (!checkpoint_dir)
+    return 1;
+
+  snprintf(checkpoint->channel_id, sizeof(checkpoint->channel_id), "%s",
+           channel_id);
+  snprintf(checkpoint->filename, sizeof(checkpoint->filename), "%s",
+           file->filename);
+  checkpoint->size = file->size;
+  checkpoint->mode = file->mode;
+  checkpoint->uid = file->uid;
+  checkpoint->gid = file->gid;
+  checkpoint->ctime = file->ctime;
+  checkpoint->hash = file->hash;
+  snprintf(checkpoint->path, sizeof(checkpoint->path), "%s/%s-%08x-%016llx",
+           checkpoint_dir, channel_id, string_hash(file->filename),
+           (unsigned long long)file->hash);
+
+  char path[4096 + 16];
+  char tmp_path[sizeof(path) + 4];
+  checkpoint_file(checkpoint, "data", path, sizeof(path));
+
+  FILE *fp = fopen(path, "w");
+  if (!fp)
+    goto err;
+
+  size_t written = fwrite(file->content, 1, file->size, fp);
+  if (fclose(fp) != 0 || written != file->size)
+    goto err;
+
+  /* the state shows up whole or not at all, a load drops data without one */
+  checkpoint_file(checkpoint, "state", path, sizeof(path));
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  if (!(fp = fopen(tmp_path, "w")))
+    goto err;
+
+  char encoded[512];
+  b64encode(encoded, file->filename, sizeof(encoded));
+  fprintf(fp, "%s %s %zu %o %u %u %lld %016llx\n", channel_id, encoded,
+          file->size, (unsigned int)file->mode, (unsigned int)file->uid,
+          (unsigned int)file->gid, (long long)file->ctime,
+          (unsigned long long)file->hash);
+  if (fclose(fp) != 0 || rename(tmp_path, path) != 0)
+    goto err;
+
+  if (!(checkpoint->fp = fopen(path, "a")))
+    goto err;
+
+  return 0;
+
+err:
+  print_warn("failed to checkpoint the upload of %s: %s\n", file->filename,
+             strerror(errno));
+  dcfs_checkpoint_remove(checkpoint);
+  return 1;
+}
+
+/* records the message holding the next batch of parts */
+int dcfs_checkpoint_add(struct dcfs_checkpoint *checkpoint,
+                        const char *message_id) {
+  if (checkpoint->ids_n ==
+      sizeof(checkpoint->ids) / sizeof(checkpoint->ids[0]))
+    return 1;
+
+  snprintf(checkpoint->ids[checkpoint->ids_n++], sizeof(checkpoint->ids[0]),
+           "%s", message_id);
+
+  if (!checkpoint->fp || fprintf(checkpoint->fp, "%s\n", message_id) < 0 ||
+      fflush(checkpoint->fp) != 0) {
+    print_warn("failed to checkpoint the upload of %s\n",
+               checkpoint->filename);
+    return 1;
+  }
+  return 0;
+}
+
+/* returns the content kept for the upload, or NULL if it's gone or no
+ * longer matches */
+char *dcfs_checkpoint_content(struct dcfs_checkpoint *checkpoint) {
+  char path[4096 + 16];
+  checkpoint_file(checkpoint, "data", path, sizeof(path));
+
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return NULL;
+
+  char *content = malloc(checkpoint->size);
+  size_t read = content ? fread(content, 1, checkpoint->size, fp) : 0;
+  int extra = fgetc(fp) != EOF;
+  fclose(fp);
+
+  if (!content || read != checkpoint->size || extra ||
+      content_hash(content, checkpoint->size) != checkpoint->hash) {
+    print_warn("the content kept for %s is damaged\n", checkpoint->filename);
+    free(content);
+    return NULL;
+  }
+  return content;
+}
+
+/* lets go of the checkpoint, its files stay for the next mount */
+void dcfs_checkpoint_close(struct dcfs_checkpoint *checkpoint) {
+  if (checkpoint->fp)
+    fclose(checkpoint->fp);
+  checkpoint->fp = NULL;
+}
+
+/* drops the files of the checkpoint once the upload is over */
+void dcfs_checkpoint_remove(struct dcfs_checkpoint *checkpoint) {
+  dcfs_checkpoint_close(checkpoint);
+
+  char path[4096 + 16];
+  checkpoint_file(checkpoint, "state", path, sizeof(path));
+  unlink(path);
+  checkpoint_file(checkpoint, "data", path, sizeof(path));
+  unlink(path);
+}
+
+static int load_checkpoint(struct dcfs_checkpoint *checkpoint,
+                           const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return 1;
+
+  char line[1024];
+  char encoded[512];
+  unsigned int mode, uid, gid;
+  long long ctime;
+  unsigned long long hash;
+  memset(encoded, 0, sizeof(encoded));
+
+  if (!fgets(line, sizeof(line), fp) ||
+      sscanf(line, "%63s %511s %zu %o %u %u %lld %llx",
+             checkpoint->channel_id, encoded, &checkpoint->size, &mode, &uid,
+             &gid, &ctime, &hash) != 8 ||
+      b64decode(checkpoint->filename, encoded,
+                sizeof(checkpoint->filename) - 1) != 0 ||
+      !*checkpoint->filename) {
+    fclose(fp);
+    return 1;
+  }
+
+  checkpoint->mode = mode;
+  checkpoint->uid = uid;
+  checkpoint->gid = gid;
+  checkpoint->ctime = ctime;
+  checkpoint->hash = hash;
+
+  /* a line cut short by a crash isn't a message id */
+  while (fgets(line, sizeof(line), fp) && strchr(line, '\n') &&
+         checkpoint->ids_n <
+             sizeof(checkpoint->ids) / sizeof(checkpoint->ids[0])) {
+    if (sscanf(line, "%63s", checkpoint->ids[checkpoint->ids_n]) != 1)
+      break;
+    checkpoint->ids_n++;
+  }
+
+  fclose(fp);
+  return 0;
+}
+
+/* returns the checkpoints of the uploads the last mount didn't finish.
+ * leftovers of checkpoints that never got a state are removed */
+json_array *dcfs_checkpoint_load() {
+  json_array *checkpoints = json_array_new();
+  assert(checkpoints);
+
+  DIR *dir = checkpoint_dir ? opendir(checkpoint_dir) : NULL;
+  if (!dir)
+    return checkpoints;
+
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    char *suffix = strrchr(entry->d_name, '.');
+    if (*entry->d_name == '.' || !suffix)
+      continue;
+
+    struct dcfs_checkpoint checkpoint;
+    memset(&checkpoint, 0, sizeof(struct dcfs_checkpoint));
+    snprintf(checkpoint.path, sizeof(checkpoint.path), "%s/%.*s",
+             checkpoint_dir, (int)(suffix - entry->d_name), entry->d_name);
+
+    char path[4096 + 16];
+    if (STREQ(suffix, ".tmp")) {
+      snprintf(path, sizeof(path), "%s/%s", checkpoint_dir, entry->d_name);
+      unlink(path);
+      continue;
+    }
+
+    if (STREQ(suffix, ".data")) {
+      checkpoint_file(&checkpoint, "state", path, sizeof(path));
+      if (access(path, F_OK) != 0) {
+        checkpoint_file(&checkpoint, "data", path, sizeof(path));
+        unlink(path);
+      }
+      continue;
+    }
+
+    if (!STREQ(suffix, ".state"))
+      continue;
+
+    checkpoint_file(&checkpoint, "state", path, sizeof(path));
+    if (load_checkpoint(&checkpoint, path) != 0) {
+      print_warn("failed to read %s\n", path);
+      continue;
+    }
+
+    checkpoint.fp = fopen(path, "a");
+    json_array_push(checkpoints, &checkpoint, sizeof(struct dcfs_checkpoint),
+                    JSON_UNKNOWN);
+  }
+
+  closedir(dir);
+  return checkpoints;
+}
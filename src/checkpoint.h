@@ -0,0 +1,40 @@
+#ifndef DCFS_CHECKPOINT_H
+#define DCFS_CHECKPOINT_H
+
+#include "fs.h"
+
+/* an upload of more than one message is checkpointed, so one cut short by a
+ * failure or a restart resumes from the first message that didn't make it.
+ * <cache>/<guild id>.uploads/ holds the content of every such upload in
+ * <key>.data and its progress in <key>.state
+ *
+ *   <channel id> <base64 filename> <size> <mode> <uid> <gid> <ctime> <hash>
+ *   <message id>...
+ *
+ * with a line for every message posted so far, in order */
+struct dcfs_checkpoint {
+  char path[4096];
+  char channel_id[64];
+  char filename[256];
+  size_t size;
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+  time_t ctime;
+  uint64_t hash;
+  char ids[DISCORD_MAX_PARTS / DISCORD_PARTS_PER_MESSAGE + 1][64];
+  unsigned int ids_n;
+  FILE *fp;
+};
+
+void dcfs_checkpoint_init(const char *guild_id);
+int dcfs_checkpoint_new(struct dcfs_checkpoint *checkpoint,
+                        const char *channel_id, struct dcfs_file *file);
+int dcfs_checkpoint_add(struct dcfs_checkpoint *checkpoint,
+                        const char *message_id);
+char *dcfs_checkpoint_content(struct dcfs_checkpoint *checkpoint);
+void dcfs_checkpoint_close(struct dcfs_checkpoint *checkpoint);
+void dcfs_checkpoint_remove(struct dcfs_checkpoint *checkpoint);
+json_array *dcfs_checkpoint_load();
+
+#endif
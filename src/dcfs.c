@@ -1,5 +1,9 @@
+#include "checkpoint.h"
+#include "deleter.h"
 #include "discord/discord.h"
 #include "fs.h"
+#include "manifest.h"
+#include "snapshot.h"
 #include "util.h"
 
 #if __APPLE__
@@ -7,16 +11,14 @@
 #endif
 
 #define FUSE_USE_VERSION FUSE_MAKE_VERSION(3, 18)
-#include <fuse3/fuse.h>
 #include <fuse3/fuse_lowlevel.h>
 
 #include <curl/curl.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
 
 #define DCFS_UNUSED __attribute__((unused))
-#define CHECK_NULL(o, code)                                                    \
-  if (!(o))                                                                    \
-    return -(code);
 
 #ifndef MAX_FILESIZE
 #define MAX_FILESIZE 10485760
@@ -25,59 +27,359 @@
 static const char *program_name;
 static const char *GUILD_ID;
 
+/* bits in the filter over the names of the dirs. a guild has at most 500
+ * channels, which this keeps under 3% false positives */
+#define DIR_FILTER_BITS 4096
+
 struct dcfs_state {
+  pthread_rwlock_t lock;
   json_array *dirs;
+  struct fuse_session *se;
+  /* a bloom filter over the names in dirs, so the lookups of names that
+   * aren't there, which tools probe for all the time, skip the scan. built
+   * by index_dirs */
+  uint64_t dir_filter[DIR_FILTER_BITS / 64];
+
+  /* set with -o, see dcfs_opts */
+  double attr_timeout;
+  double entry_timeout;
+  double negative_timeout;
+  unsigned int max_write;
+  unsigned int max_readahead;
+  int writeback_cache;
+  int splice;
+  int kernel_cache;
+  size_t direct_io_size;
+  char *snapshot;
+  int no_snapshot;
+  int no_manifest;
+  unsigned int snapshot_interval;
+  unsigned int prune_interval;
+  unsigned int refresh_ttl;
+  unsigned int refresh_max_ttl;
+  int warm_all;
+  char *warm;
+  unsigned int warm_threads;
+  unsigned int crawl_threads;
+  unsigned int batch_window;
+  unsigned int inline_size;
+  unsigned int connect_timeout;
+  unsigned int stall_timeout;
+  unsigned int request_timeout;
+  unsigned int hedge;
+
+  /* the background sync, see sync_run. stale is set when the dirs came from
+   * the snapshot and haven't been checked against the server yet */
+  pthread_t sync_thread;
+  pthread_mutex_t sync_lock;
+  pthread_cond_t sync_cond;
+  char sync_started;
+  char sync_stop;
+  char stale;
+
+  /* the crawl started by -o warm, see warm_start */
+  pthread_t *warm_pool;
+  size_t warm_pool_n;
+  json_array *warm_queue;
+  pthread_mutex_t warm_lock;
+  char warm_stop;
+
+  /* small files waiting to share a message, see batch_add. posting counts
+   * the batches sent but not answered yet */
+  json_array *batches;
+  size_t batches_posting;
+  pthread_t batch_thread;
+  pthread_mutex_t batch_lock;
+  pthread_cond_t batch_cond;
+  char batch_stop;
+
+  /* uploads that failed partway, posted from their checkpoint in the
+   * background, see resume_run */
+  json_array *resumes;
+  pthread_t resume_thread;
+  pthread_mutex_t resume_lock;
+  pthread_cond_t resume_cond;
+  char resume_started;
+  char resume_stop;
 };
 
-static inline struct dcfs_state *get_state() {
-  return (fuse_get_context())->private_data;
+#define DCFS_OPT(t, p, v) {t, offsetof(struct dcfs_state, p), v}
+
+static const struct fuse_opt dcfs_opts[] = {
+    DCFS_OPT("attr_timeout=%lf", attr_timeout, 0),
+    DCFS_OPT("entry_timeout=%lf", entry_timeout, 0),
+    DCFS_OPT("negative_timeout=%lf", negative_timeout, 0),
+    DCFS_OPT("max_write=%u", max_write, 0),
+    DCFS_OPT("max_readahead=%u", max_readahead, 0),
+    DCFS_OPT("writeback_cache", writeback_cache, 1),
+    DCFS_OPT("no_writeback_cache", writeback_cache, 0),
+    DCFS_OPT("splice", splice, 1),
+    DCFS_OPT("no_splice", splice, 0),
+    DCFS_OPT("kernel_cache", kernel_cache, 1),
+    DCFS_OPT("no_kernel_cache", kernel_cache, 0),
+    DCFS_OPT("direct_io_size=%zu", direct_io_size, 0),
+    DCFS_OPT("snapshot=%s", snapshot, 0),
+    DCFS_OPT("no_snapshot", no_snapshot, 1),
+    DCFS_OPT("no_manifest", no_manifest, 1),
+    DCFS_OPT("snapshot_interval=%u", snapshot_interval, 0),
+    DCFS_OPT("prune_interval=%u", prune_interval, 0),
+    DCFS_OPT("refresh_ttl=%u", refresh_ttl, 0),
+    DCFS_OPT("refresh_max_ttl=%u", refresh_max_ttl, 0),
+    DCFS_OPT("warm", warm_all, 1),
+    DCFS_OPT("warm=%s", warm, 0),
+    DCFS_OPT("warm_threads=%u", warm_threads, 0),
+    DCFS_OPT("crawl_threads=%u", crawl_threads, 0),
+    DCFS_OPT("batch_window=%u", batch_window, 0),
+    DCFS_OPT("inline_size=%u", inline_size, 0),
+    DCFS_OPT("connect_timeout=%u", connect_timeout, 0),
+    DCFS_OPT("stall_timeout=%u", stall_timeout, 0),
+    DCFS_OPT("request_timeout=%u", request_timeout, 0),
+    DCFS_OPT("hedge=%u", hedge, 0),
+    FUSE_OPT_END,
 };
 
-static inline struct dcfs_dir *get_dir(json_array *dirs,
-                                       struct dcfs_path *path) {
+static void dcfs_opts_help() {
+  printf("dcfs options:\n"
+         "    -o attr_timeout=T      cache attributes for T seconds (1.0)\n"
+         "    -o entry_timeout=T     cache names for T seconds (1.0)\n"
+         "    -o negative_timeout=T  cache missing names for T seconds (1.0)\n"
+         "    -o max_write=N         largest write request in bytes (1M)\n"
+         "    -o max_readahead=N     largest readahead in bytes\n"
+         "    -o no_writeback_cache  don't buffer writes in the kernel\n"
+         "    -o no_splice           don't move data through pipes\n"
+         "    -o no_kernel_cache     don't keep uploaded files in the page "
+         "cache across opens\n"
+         "    -o direct_io_size=N    bypass the page cache for files of N "
+         "bytes and more\n"
+         "    -o snapshot=PATH       where to keep the metadata snapshot\n"
+         "                           (~/.cache/dcfs/<guild id>.snapshot)\n"
+         "    -o no_snapshot         always list channels from the server\n"
+         "    -o no_manifest         crawl channels instead of reading and "
+         "pinning manifests\n"
+         "    -o snapshot_interval=T save the snapshot every T seconds (300)\n"
+         "    -o refresh_ttl=T       look for new files every T seconds (30)\n"
+         "    -o refresh_max_ttl=T   back off to every T seconds in quiet "
+         "dirs (600)\n"
+         "    -o warm[=A:B:...]      list every channel, or the ones named, "
+         "right after mounting\n"
+         "    -o warm_threads=N      list N channels at a time (4)\n"
+         "    -o crawl_threads=N     crawl a long channel N stretches of "
+         "history at a time (4)\n"
+         "    -o batch_window=MS     post small files closed within MS "
+         "milliseconds\n"
+         "                           of each other together, 0 to post "
+         "each alone (100)\n"
+         "    -o inline_size=N       keep files of up to N bytes in the "
+         "message itself,\n"
+         "                           at most 1024, 0 to always attach them "
+         "(512)\n"
+         "    -o connect_timeout=T   give up connecting after T seconds "
+         "(10)\n"
+         "    -o stall_timeout=T     give up on transfers stalled for T "
+         "seconds (30)\n"
+         "    -o request_timeout=T   give up on requests other than uploads "
+         "after T\n"
+         "                           seconds, 0 to wait forever (300)\n"
+         "    -o hedge=P             download a part again when it takes "
+         "longer than P\n"
+         "                           percent of recent ones, 0 to never "
+         "(95)\n"
+         "    -o prune_interval=T    look for deleted files every T seconds "
+         "(3600)\n\n");
+}
+
+static void dir_filter_bits(const char *name, size_t bits[3]) {
+  uint64_t hash = content_hash(name, strlen(name));
+  uint64_t step = string_hash(name) | 1;
+  for (size_t i = 0; i < 3; i++)
+    bits[i] = (hash + i * step) % DIR_FILTER_BITS;
+}
+
+/* rebuilds the filter after dirs were added, removed or renamed. the caller
+ * holds state->lock for writing */
+static void index_dirs(struct dcfs_state *state) {
+  memset(state->dir_filter, 0, sizeof(state->dir_filter));
+
   struct dcfs_dir *dir;
-  json_array_for_each(dirs, dir) {
-    if (STREQ(dir->channel.name, path->dir)) {
+  json_array_for_each(state->dirs, dir) {
+    size_t bits[3];
+    dir_filter_bits(dir->channel.name, bits);
+    for (size_t i = 0; i < 3; i++)
+      state->dir_filter[bits[i] / 64] |= 1ULL << (bits[i] % 64);
+  }
+}
+
+/* the caller holds state->lock */
+static inline struct dcfs_dir *get_dir(struct dcfs_state *state,
+                                       const char *name) {
+  size_t bits[3];
+  dir_filter_bits(name, bits);
+  for (size_t i = 0; i < 3; i++) {
+    if (!(state->dir_filter[bits[i] / 64] & (1ULL << (bits[i] % 64))))
+      return NULL;
+  }
+
+  struct dcfs_dir *dir;
+  json_array_for_each(state->dirs, dir) {
+    if (STREQ(dir->channel.name, name)) {
       return dir;
     }
   }
   return NULL;
 }
 
-static inline struct dcfs_file *get_file(json_array *messages,
-                                         struct dcfs_path *path) {
-  struct dcfs_file *_f;
-  json_array_for_each(messages, _f) {
-    if (STREQ(_f->filename, path->filename)) {
-      return _f;
-    }
+/* returns the dir or file behind an inode with a reference held, which the
+ * caller drops with dcfs_node_put */
+static inline struct dcfs_dir *get_dir_ino(fuse_ino_t ino) {
+  struct dcfs_node *node = dcfs_node_get(ino);
+  if (node && node->type != DCFS_NODE_DIR) {
+    dcfs_node_put(node);
+    return NULL;
   }
-  return NULL;
+  return (struct dcfs_dir *)node;
 }
 
-static int process_files(struct dcfs_dir *dir, struct dcfs_file *dcfs_file,
-                         struct file *files, size_t files_n) {
-  struct response resp = {0};
-  discord_create_attachments(dir->channel.id, files, files_n, &resp);
+static inline struct dcfs_file *get_file_ino(fuse_ino_t ino) {
+  struct dcfs_node *node = dcfs_node_get(ino);
+  if (node && node->type != DCFS_NODE_FILE) {
+    dcfs_node_put(node);
+    return NULL;
+  }
+  return (struct dcfs_file *)node;
+}
 
-  if (resp.http_code != 200) {
-    print_err("failed to upload file %s. error code: %d\n", dcfs_file->filename,
-              resp.http_code);
-    json_array_remove_ptr(&dir->files, dcfs_file);
-    free(resp.raw);
+static void fill_root_stat(struct stat *stbuf) {
+  memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_ino = DCFS_ROOT_INO;
+  stbuf->st_mode = S_IFDIR | 0755;
+  stbuf->st_nlink = 2;
+  stbuf->st_gid = getgid();
+  stbuf->st_uid = getuid();
+  id_to_ctime(&stbuf->st_ctime, GUILD_ID);
+  id_to_ctime(&stbuf->st_mtime, GUILD_ID);
+  stbuf->st_atime = stbuf->st_mtime;
+}
 
-    return -EAGAIN;
+/* the caller holds dir->lock */
+static void fill_dir_stat(struct dcfs_dir *dir, struct stat *stbuf) {
+  memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_ino = dir->node.ino;
+  stbuf->st_mode = dir->mode;
+  stbuf->st_nlink = 2;
+  stbuf->st_gid = dir->gid;
+  stbuf->st_uid = dir->uid;
+  stbuf->st_ctime = dir->ctime;
+  stbuf->st_mtime = dir->mtime;
+  stbuf->st_atime = dir->mtime;
+}
+
+/* the caller holds file->lock */
+static void fill_file_stat(struct dcfs_file *file, struct stat *stbuf) {
+  memset(stbuf, 0, sizeof(struct stat));
+  stbuf->st_ino = file->node.ino;
+  stbuf->st_mode = file->mode;
+  stbuf->st_nlink = 1;
+  stbuf->st_gid = file->gid;
+  stbuf->st_uid = file->uid;
+  stbuf->st_size = file->size;
+  stbuf->st_ctime = file->ctime;
+  stbuf->st_mtime = file->ctime;
+  stbuf->st_atime = file->ctime;
+}
+
+/* a zero inode makes the kernel cache the miss for negative_timeout */
+static void reply_enoent(struct dcfs_state *state, fuse_req_t req) {
+  if (state->negative_timeout <= 0) {
+    fuse_reply_err(req, ENOENT);
+    return;
   }
 
-  json_object *json;
-  json_load(resp.raw, (void **)&json);
-  free(resp.raw);
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof(struct fuse_entry_param));
+  e.entry_timeout = state->negative_timeout;
+  fuse_reply_entry(req, &e);
+}
 
-  json_string message_id = json_object_get(json, "id");
-  id_to_ctime(&dcfs_file->ctime, message_id);
+static void init_entry(struct dcfs_state *state, struct fuse_entry_param *e) {
+  memset(e, 0, sizeof(struct fuse_entry_param));
+  e->attr_timeout = state->attr_timeout;
+  e->entry_timeout = state->entry_timeout;
+}
+
+/* node is NULL for "." and "..", otherwise the entry holds a reference */
+struct dcfs_dirent {
+  char *name;
+  struct dcfs_node *node;
+  fuse_ino_t ino;
+  mode_t mode;
+};
+
+/* resolved once by open, opendir and create and kept in fi->fh. it holds a
+ * reference on its node, which is NULL for the root, so a file stays
+ * readable after it's renamed or unlinked */
+struct dcfs_handle {
+  struct dcfs_node *node;
+  int flags;
+  /* the listing readdir serves from, taken when reading from offset 0 and
+   * extended as more of the channel is crawled. seq is the newest file it
+   * has seen */
+  struct dcfs_dirent *entries;
+  size_t entries_n;
+  size_t entries_capacity;
+  unsigned long seq;
+  /* the head messages of the file copy_file_range last copied whole into
+   * this one and of the copy, so the rest of the range can be answered */
+  char copied_from[64];
+  char copied_to[64];
+};
+
+static inline struct dcfs_handle *get_handle(struct fuse_file_info *fi) {
+  return (struct dcfs_handle *)(uintptr_t)fi->fh;
+}
+
+/* takes over the caller's reference on node */
+static struct dcfs_handle *new_handle(struct dcfs_node *node, int flags) {
+  struct dcfs_handle *fh = calloc(1, sizeof(struct dcfs_handle));
+  if (!fh)
+    return NULL;
+
+  fh->node = node;
+  fh->flags = flags;
+  return fh;
+}
+
+static void free_entries(struct dcfs_handle *fh) {
+  for (size_t i = 0; i < fh->entries_n; i++) {
+    free(fh->entries[i].name);
+    if (fh->entries[i].node)
+      dcfs_node_put(fh->entries[i].node);
+  }
+
+  free(fh->entries);
+  fh->entries = NULL;
+  fh->entries_n = 0;
+  fh->entries_capacity = 0;
+  fh->seq = 0;
+}
+
+static void free_handle(struct dcfs_handle *fh) {
+  free_entries(fh);
+  if (fh->node)
+    dcfs_node_put(fh->node);
+  free(fh);
+}
+
+static void close_handle(fuse_req_t req, struct dcfs_handle *fh);
+static void delete_messages(struct dcfs_dir *dir, struct dcfs_file *file);
+static void free_parts(struct dcfs_file *file, size_t part_n);
+static void unlink_file(fuse_req_t req, struct dcfs_file *file);
 
-  struct dcfs_message *message;
-  int part_n = 0;
+/* records the attachments of a posted message that belong to the file in
+ * dcfs_file->messages. a batch posts several files in one message. the
+ * caller holds dcfs_file->lock */
+static void add_attachments(struct dcfs_file *dcfs_file, json_object *json) {
+  json_string message_id = json_object_get(json, "id");
+  size_t name_len = strlen(dcfs_file->filename);
 
   json_object *attachment;
   json_array *attachments = json_object_get(json, "attachments");
@@ -88,652 +390,3206 @@ static int process_files(struct dcfs_dir *dir, struct dcfs_file *dcfs_file,
     json_string filename = json_object_get(attachment, "filename");
     json_number *size = json_object_get(attachment, "size");
     json_string url = json_object_get(attachment, "url");
+    if (!filename || !size || !url)
+      continue;
 
     b64decode(decoded_filename, filename, sizeof(decoded_filename));
 
-    message = calloc(1, sizeof(struct dcfs_message));
+    int part_n = 0;
+    if (!STREQ(decoded_filename, dcfs_file->filename)) {
+      if (strncmp(decoded_filename, dcfs_file->filename, name_len) != 0 ||
+          strncmp(decoded_filename + name_len, ".PART", 5) != 0)
+        continue;
+
+      part_n = strtol(decoded_filename + name_len + 5, NULL, 10);
+      if (part_n <= 0 || part_n >= DISCORD_MAX_PARTS)
+        continue;
+    }
+
+    if (dcfs_file->messages[part_n])
+      continue;
+
+    struct dcfs_message *message = calloc(1, sizeof(struct dcfs_message));
     assert(message);
 
     snprintf(message->id, sizeof(message->id), "%s", message_id);
-    snprintf(message->filename, sizeof(message->filename), "%s", filename);
+    snprintf(message->filename, sizeof(message->filename), "%s",
+             decoded_filename);
     message->size = *size;
     message->url = strdup(url);
 
-    if (!STREQ(decoded_filename, dcfs_file->filename)) {
-      int part_n_start = last_index(decoded_filename, 'T');
-      part_n = strtol(decoded_filename + part_n_start + 1, NULL, 10);
-    }
     dcfs_file->messages[part_n] = message;
     dcfs_file->messages_n++;
   }
 
+  /* an inline file is in the content rather than attached */
+  json_string content = json_object_get_type(json, "content", JSON_STRING);
+  char *url = content && !dcfs_file->messages[0]
+                  ? discord_inline_url(content, dcfs_file->filename)
+                  : NULL;
+  if (url) {
+    struct dcfs_message *message = calloc(1, sizeof(struct dcfs_message));
+    assert(message);
+
+    snprintf(message->id, sizeof(message->id), "%s", message_id);
+    snprintf(message->filename, sizeof(message->filename), "%s",
+             dcfs_file->filename);
+    message->size = dcfs_file->size;
+    message->url = url;
+
+    dcfs_file->messages[0] = message;
+    dcfs_file->messages_n++;
+  }
+}
+
+/* records the parts of an upload response in dcfs_file->messages. the caller
+ * holds dcfs_file->lock */
+static int add_parts(struct dcfs_file *dcfs_file, struct response *resp) {
+  if (resp->http_code != 200) {
+    print_err("failed to upload file %s. error code: %d\n", dcfs_file->filename,
+              resp->http_code);
+    free(resp->raw);
+
+    return -EAGAIN;
+  }
+
+  json_object *json = NULL;
+  json_load(resp->raw, (void **)&json);
+  free(resp->raw);
+
+  if (!json)
+    return -EAGAIN;
+
+  add_attachments(dcfs_file, json);
   json_object_destroy(json);
+  return dcfs_file->messages[0] ? 0 : -EAGAIN;
+}
+
+/* the attachment name of part part_n of the file */
+static void part_filename(struct dcfs_file *dcfs_file, int part_n,
+                          struct file *file) {
+  if (part_n == 0) {
+    b64encode(file->filename, dcfs_file->filename, sizeof(file->filename));
+  } else {
+    char tmp_filename[512];
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.PART%d",
+             dcfs_file->filename, part_n);
+    b64encode(file->filename, tmp_filename, sizeof(file->filename));
+  }
+}
+
+/* fills files with the next message worth of parts, up to 10, starting at
+ * part part_n. returns how many were filled */
+static int next_parts(struct dcfs_file *dcfs_file, struct file *files,
+                      int part_n) {
+  int files_n = 0;
+  memset(files, 0, sizeof(struct file) * 10);
+
+  for (size_t offset = (size_t)part_n * MAX_FILESIZE;
+       offset < dcfs_file->size && files_n < 10;
+       offset += MAX_FILESIZE, files_n++, part_n++) {
+
+    struct file *file = &files[files_n];
+    part_filename(dcfs_file, part_n, file);
+    file->buffer = dcfs_file->content + offset;
+    size_t remaining = dcfs_file->size - offset;
+    file->buffer_size = remaining < MAX_FILESIZE ? remaining : MAX_FILESIZE;
+  }
+
+  return files_n;
+}
+
+/* whether the file goes in the content of its message */
+static inline int inlined(struct dcfs_state *state, struct dcfs_file *file) {
+  return file->size && file->size <= state->inline_size;
+}
+
+/* writes the metadata the head message of the file carries, with the ids
+ * of the messages posted after the head's so far, or the inline record with
+ * the data when in_content is set. returns whether the record is inline.
+ * the caller holds file->lock */
+static int file_meta(struct dcfs_file *file, int in_content, char *out,
+                     size_t out_size) {
+  struct discord_meta meta;
+  memset(&meta, 0, sizeof(struct discord_meta));
+
+  meta.size = file->size;
+  meta.parts_n = (file->size + MAX_FILESIZE - 1) / MAX_FILESIZE;
+  meta.part_size = MAX_FILESIZE;
+  meta.mode = file->mode & 07777;
+  meta.uid = file->uid;
+  meta.gid = file->gid;
+  meta.mtime = file->ctime;
+  meta.hash = file->hash;
+
+  for (size_t i = DISCORD_PARTS_PER_MESSAGE;
+       i < meta.parts_n && file->messages[i]; i += DISCORD_PARTS_PER_MESSAGE)
+    snprintf(meta.ids[meta.ids_n++], sizeof(meta.ids[0]), "%s",
+             file->messages[i]->id);
+
+  /* a name too long to fit along with the data gets attached after all */
+  if (in_content && discord_format_inline(out, out_size, file->filename,
+                                          file->content, &meta) == 0)
+    return 1;
+
+  discord_format_meta(out, out_size, &meta);
   return 0;
 }
 
-static int upload_file(struct dcfs_dir *dir, struct dcfs_path *p) {
-  struct dcfs_file *dcfs_file = get_file(dir->files, p);
-  CHECK_NULL(dcfs_file, ENOENT);
+/* the caller holds file->lock */
+static void start_upload(struct dcfs_file *file) {
+  if (!file->ctime)
+    file->ctime = time(NULL);
+  file->hash = content_hash(file->content, file->size);
+}
 
-  int ret = -ENODATA;
-  if (!*dcfs_file->messages) {
+struct upload {
+  fuse_req_t req;
+  struct dcfs_state *state;
+  struct dcfs_dir *dir;
+  struct dcfs_file *file;
+  int part_n;
+  char inlined;
+  char meta[DISCORD_META_SIZE];
+  /* set for uploads of more than one message, see checkpoint.h */
+  struct dcfs_checkpoint *checkpoint;
+};
+
+static void resume_later(struct upload *upload);
+
+static void upload_cb(struct response *resp, void *data);
+
+/* sends the next batch of parts. returns 1 once everything has been sent.
+ * the caller holds file->lock */
+static int upload_next(struct upload *upload) {
+  struct file files[10];
+  int files_n =
+      upload->inlined ? 0 : next_parts(upload->file, files, upload->part_n);
+
+  /* an inline file is a single message without attachments */
+  if (upload->inlined ? upload->part_n != 0 : !files_n)
+    return 1;
+
+  const char *meta = upload->part_n == 0 ? upload->meta : NULL;
+  upload->part_n += upload->inlined ? 1 : files_n;
+  if (discord_create_attachments_async(upload->dir->channel.id, files, files_n,
+                                       meta, upload_cb, upload) != 0)
+    return -EAGAIN;
+
+  return 0;
+}
+
+/* the caller doesn't hold any lock */
+static void upload_done(struct upload *upload, int ret) {
+  struct dcfs_file *file = upload->file;
+
+  fuse_reply_err(upload->req, ret == -ENODATA ? 0 : -ret);
+
+  if (upload->checkpoint) {
+    dcfs_checkpoint_remove(upload->checkpoint);
+    free(upload->checkpoint);
+  }
+
+  dcfs_node_put(&file->node);
+  free(upload);
+}
+
+static void upload_meta_cb(struct response *resp, void *data) {
+  struct upload *upload = data;
+  struct dcfs_file *file = upload->file;
+
+  if (resp->http_code != 200)
+    print_warn("failed to describe the parts of %s. http code: %ld\n",
+               file->filename, resp->http_code);
+  free(resp->raw);
+
+  pthread_mutex_lock(&file->lock);
+  free(file->content);
+  file->content = NULL;
+  file->uploading = 0;
+  pthread_mutex_unlock(&file->lock);
+
+  upload_done(upload, 0);
+}
+
+/* drops the content of a file that made it, it's read back from the
+ * messages from now on. a failed upload keeps the file listed with its
+ * content instead, and the next close of a handle opened for writing tries
+ * again. what was posted of it goes. the caller holds file->lock */
+static void upload_end(struct upload *upload, int ret) {
+  struct dcfs_file *file = upload->file;
+
+  if (ret == 0) {
+    free(file->content);
+    file->content = NULL;
+  } else if (file->messages_n) {
+    delete_messages(upload->dir, file);
+    free_parts(file, 0);
+  }
+}
+
+static void upload_cb(struct response *resp, void *data) {
+  struct upload *upload = data;
+  struct dcfs_file *file = upload->file;
+
+  pthread_mutex_lock(&file->lock);
+
+  int ret = add_parts(file, resp);
+  if (ret == 0 && upload->checkpoint) {
+    struct dcfs_message *first =
+        file->messages[(upload->part_n - 1) / DISCORD_PARTS_PER_MESSAGE *
+                       DISCORD_PARTS_PER_MESSAGE];
+    if (first)
+      dcfs_checkpoint_add(upload->checkpoint, first->id);
+    else
+      ret = -EAGAIN;
+  }
+
+  if (ret == 0 && (ret = upload_next(upload)) == 0) {
+    pthread_mutex_unlock(&file->lock);
+    return;
+  }
+
+  /* the messages posted so far stay, the rest goes out in the background */
+  if (ret == -EAGAIN && upload->checkpoint) {
+    resume_later(upload);
+    pthread_mutex_unlock(&file->lock);
+    upload_done(upload, 0);
+    return;
+  }
+
+  /* the head went out before the ids of the other messages were known. a
+   * listing without them still finds the parts by crawling */
+  if (ret == 1 && upload->part_n > DISCORD_PARTS_PER_MESSAGE) {
+    file_meta(file, 0, upload->meta, sizeof(upload->meta));
+    if (discord_edit_message_async(upload->dir->channel.id,
+                                   file->messages[0]->id, upload->meta,
+                                   upload_meta_cb, upload) == 0) {
+      pthread_mutex_unlock(&file->lock);
+      return;
+    }
+  }
+
+  if (ret == 1)
     ret = 0;
-    int files_n = 0;
-    struct file files[10];
-    memset(&files, 0, sizeof(files));
 
-    if (dcfs_file->size / MAX_FILESIZE >= DISCORD_MAX_PARTS) {
-      ret = -EFBIG;
-      goto out;
-    }
+  upload_end(upload, ret);
+  file->uploading = 0;
+  pthread_mutex_unlock(&file->lock);
+
+  upload_done(upload, ret);
+}
+
+/* small files closed in a dir within batch_window of the first one share a
+ * message, up to DISCORD_PARTS_PER_MESSAGE of them. each gets a record in
+ * the content, content_len long so far */
+struct batch {
+  struct dcfs_state *state;
+  struct dcfs_dir *dir;
+  struct upload *uploads[DISCORD_PARTS_PER_MESSAGE];
+  size_t uploads_n;
+  size_t content_len;
+  struct timespec deadline;
+};
+
+static void batch_done(struct batch *batch) {
+  struct dcfs_state *state = batch->state;
+
+  pthread_mutex_lock(&state->batch_lock);
+  state->batches_posting--;
+  pthread_cond_broadcast(&state->batch_cond);
+  pthread_mutex_unlock(&state->batch_lock);
+
+  free(batch);
+}
+
+static void batch_cb(struct response *resp, void *data) {
+  struct batch *batch = data;
+
+  json_object *json = NULL;
+  if (resp->http_code == 200)
+    json_load(resp->raw, (void **)&json);
+  else
+    print_err("failed to upload %zu files to %s. http code: %ld\n",
+              batch->uploads_n, batch->dir->channel.name, resp->http_code);
+  free(resp->raw);
+
+  for (size_t i = 0; i < batch->uploads_n; i++) {
+    struct upload *upload = batch->uploads[i];
+    struct dcfs_file *file = upload->file;
+
+    pthread_mutex_lock(&file->lock);
+    if (json)
+      add_attachments(file, json);
+
+    int ret = file->messages[0] ? 0 : -EAGAIN;
+    upload_end(upload, ret);
+    file->uploading = 0;
+    pthread_mutex_unlock(&file->lock);
+
+    upload_done(upload, ret);
+  }
+
+  if (json)
+    json_object_destroy(json);
+  batch_done(batch);
+}
+
+/* the caller doesn't hold any lock */
+static void batch_post(struct batch *batch) {
+  struct file files[DISCORD_PARTS_PER_MESSAGE];
+  memset(files, 0, sizeof(files));
+
+  char content[DISCORD_META_SIZE];
+  size_t uploads_n = 0, files_n = 0, content_len = 0;
+
+  for (size_t i = 0; i < batch->uploads_n; i++) {
+    struct upload *upload = batch->uploads[i];
+    struct dcfs_file *file = upload->file;
+
+    pthread_mutex_lock(&file->lock);
+    char unlinked = file->unlinked;
+    if (unlinked) {
+      free(file->content);
+      file->content = NULL;
+      file->uploading = 0;
+    } else {
+      batch->uploads[uploads_n++] = upload;
+    }
+    pthread_mutex_unlock(&file->lock);
+
+    /* deleted before it was ever posted */
+    if (unlinked)
+      upload_done(upload, -ENODATA);
+  }
+
+  batch->uploads_n = uploads_n;
+  if (!uploads_n) {
+    batch_done(batch);
+    return;
+  }
+
+  /* the records of inline files come first. the content and name can't
+   * change while uploading is set, so they're read without the lock */
+  for (int in_content = 1; in_content >= 0; in_content--) {
+    for (size_t i = 0; i < uploads_n; i++) {
+      struct upload *upload = batch->uploads[i];
+      struct dcfs_file *file = upload->file;
+      if (upload->inlined != in_content)
+        continue;
+
+      content_len +=
+          snprintf(content + content_len, sizeof(content) - content_len,
+                   "%s%s", content_len ? ";" : "", upload->meta);
+      if (in_content)
+        continue;
+
+      struct file *part = &files[files_n++];
+      b64encode(part->filename, file->filename, sizeof(part->filename));
+      part->buffer = file->content;
+      part->buffer_size = file->size;
+    }
+  }
+
+  if (discord_create_attachments_async(batch->dir->channel.id, files, files_n,
+                                       content, batch_cb, batch) != 0) {
+    struct response resp = {0};
+    batch_cb(&resp, batch);
+  }
+}
+
+/* queues a small file that's ready to upload. the batch is posted once it's
+ * full, or by batch_run once its window is over. the caller doesn't hold
+ * any lock */
+static void batch_add(struct dcfs_state *state, struct upload *upload) {
+  struct batch *batch = NULL, *pos, *crowded = NULL, *full = NULL;
+  size_t record_len = strlen(upload->meta) + 1;
+
+  pthread_mutex_lock(&state->batch_lock);
+  json_array_for_each(state->batches, pos) {
+    if (pos->dir == upload->dir) {
+      batch = pos;
+      break;
+    }
+  }
+
+  /* inline records are long, one that doesn't fit starts the next batch */
+  if (batch && batch->content_len + record_len > DISCORD_META_SIZE) {
+    json_array_detach_ptr(&state->batches, batch);
+    state->batches_posting++;
+    crowded = batch;
+    batch = NULL;
+  }
+
+  if (!batch) {
+    batch = calloc(1, sizeof(struct batch));
+    assert(batch);
+
+    batch->state = state;
+    batch->dir = upload->dir;
+    clock_gettime(CLOCK_REALTIME, &batch->deadline);
+    batch->deadline.tv_sec += state->batch_window / 1000;
+    batch->deadline.tv_nsec += (state->batch_window % 1000) * 1000000L;
+    if (batch->deadline.tv_nsec >= 1000000000L) {
+      batch->deadline.tv_sec++;
+      batch->deadline.tv_nsec -= 1000000000L;
+    }
+
+    json_array_push(state->batches, batch, 0, JSON_UNKNOWN);
+    pthread_cond_broadcast(&state->batch_cond);
+  }
+
+  batch->uploads[batch->uploads_n++] = upload;
+  batch->content_len += record_len;
+  if (batch->uploads_n == DISCORD_PARTS_PER_MESSAGE) {
+    json_array_detach_ptr(&state->batches, batch);
+    state->batches_posting++;
+    full = batch;
+  }
+  pthread_mutex_unlock(&state->batch_lock);
+
+  if (crowded)
+    batch_post(crowded);
+  if (full)
+    batch_post(full);
+}
+
+static inline int deadline_passed(const struct timespec *now,
+                                  const struct timespec *deadline) {
+  return now->tv_sec > deadline->tv_sec ||
+         (now->tv_sec == deadline->tv_sec && now->tv_nsec >= deadline->tv_nsec);
+}
+
+/* posts the batches whose window is over. on stop, everything left is
+ * posted and waited for, the request loop goes down next */
+static void *batch_run(void *data) {
+  struct dcfs_state *state = data;
+
+  pthread_mutex_lock(&state->batch_lock);
+  for (;;) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    struct batch *batch, *due = NULL, *next = NULL;
+    json_array_for_each(state->batches, batch) {
+      if (state->batch_stop || deadline_passed(&now, &batch->deadline)) {
+        due = batch;
+        break;
+      }
+      if (!next || deadline_passed(&next->deadline, &batch->deadline))
+        next = batch;
+    }
+
+    if (due) {
+      json_array_detach_ptr(&state->batches, due);
+      state->batches_posting++;
+      pthread_mutex_unlock(&state->batch_lock);
+      batch_post(due);
+      pthread_mutex_lock(&state->batch_lock);
+      continue;
+    }
+
+    if (state->batch_stop)
+      break;
+
+    if (next)
+      pthread_cond_timedwait(&state->batch_cond, &state->batch_lock,
+                             &next->deadline);
+    else
+      pthread_cond_wait(&state->batch_cond, &state->batch_lock);
+  }
+
+  while (state->batches_posting)
+    pthread_cond_wait(&state->batch_cond, &state->batch_lock);
+  pthread_mutex_unlock(&state->batch_lock);
+
+  return NULL;
+}
+
+static void batch_start(struct dcfs_state *state) {
+  if (!state->batch_window)
+    return;
+
+  state->batches = json_array_new();
+  assert(state->batches);
+
+  if (pthread_create(&state->batch_thread, NULL, batch_run, state) != 0) {
+    print_warn("failed to start batching uploads\n");
+    json_array_destroy(state->batches);
+    state->batches = NULL;
+  }
+}
+
+static void batch_stop(struct dcfs_state *state) {
+  if (!state->batches)
+    return;
+
+  pthread_mutex_lock(&state->batch_lock);
+  state->batch_stop = 1;
+  pthread_cond_broadcast(&state->batch_cond);
+  pthread_mutex_unlock(&state->batch_lock);
+
+  pthread_join(state->batch_thread, NULL);
+  json_array_destroy(state->batches);
+  state->batches = NULL;
+}
+
+/* starts uploading the file in the background and replies to req once it's
+ * done */
+static void upload_file_async(fuse_req_t req, struct dcfs_file *file) {
+  struct dcfs_state *state = fuse_req_userdata(req);
+
+  struct upload *upload = calloc(1, sizeof(struct upload));
+  if (!upload) {
+    fuse_reply_err(req, ENOBUFS);
+    return;
+  }
+
+  upload->req = req;
+  upload->state = state;
+  upload->file = file;
+  dcfs_node_ref(&file->node);
+
+  pthread_mutex_lock(&file->lock);
+  upload->dir = file->parent;
+
+  int ret = -ENODATA;
+  int batched = 0;
+  if (!*file->messages && !file->uploading) {
+    if (file->size / MAX_FILESIZE >= DISCORD_MAX_PARTS) {
+      ret = -EFBIG;
+    } else {
+      start_upload(file);
+      upload->inlined = file_meta(file, inlined(state, file), upload->meta,
+                                  sizeof(upload->meta));
+
+      /* files of a single part can share a message with others */
+      batched = state->batches && file->size && file->size <= MAX_FILESIZE;
+
+      /* one that takes several messages can fail partway */
+      if (file->size > (size_t)DISCORD_PARTS_PER_MESSAGE * MAX_FILESIZE) {
+        upload->checkpoint = malloc(sizeof(struct dcfs_checkpoint));
+        assert(upload->checkpoint);
+        if (dcfs_checkpoint_new(upload->checkpoint, upload->dir->channel.id,
+                                file) != 0) {
+          free(upload->checkpoint);
+          upload->checkpoint = NULL;
+        }
+      }
+
+      if (batched || (ret = upload_next(upload)) == 0) {
+        file->uploading = 1;
+        ret = 0;
+      } else if (ret == -EAGAIN && upload->checkpoint) {
+        file->uploading = 1;
+        resume_later(upload);
+        pthread_mutex_unlock(&file->lock);
+        upload_done(upload, 0);
+        return;
+      }
+    }
+  }
+
+  if (ret != 0) {
+    if (ret != -ENODATA)
+      upload_end(upload, ret == 1 ? 0 : ret);
+    pthread_mutex_unlock(&file->lock);
+    upload_done(upload, ret == 1 ? 0 : ret);
+    return;
+  }
+
+  pthread_mutex_unlock(&file->lock);
+
+  if (batched)
+    batch_add(state, upload);
+}
+
+/* how long the resumer waits after a round that didn't get everything
+ * through, doubling up to the max */
+#define RESUME_DELAY 30
+#define RESUME_MAX_DELAY 600
+
+/* an upload cut short. file is NULL for one left by the last mount until
+ * resume_file finds it, and holds a reference otherwise */
+struct resume {
+  struct dcfs_checkpoint checkpoint;
+  struct dcfs_file *file;
+};
+
+/* queues resume, or leaves its checkpoint for the next mount once the
+ * resumer is gone */
+static void push_resume(struct dcfs_state *state, struct resume *resume) {
+  pthread_mutex_lock(&state->resume_lock);
+  if (state->resumes && !state->resume_stop) {
+    json_array_push(state->resumes, resume, sizeof(struct resume),
+                    JSON_UNKNOWN);
+    pthread_cond_signal(&state->resume_cond);
+    resume = NULL;
+  }
+  pthread_mutex_unlock(&state->resume_lock);
+
+  if (resume) {
+    dcfs_checkpoint_close(&resume->checkpoint);
+    if (resume->file)
+      dcfs_node_put(&resume->file->node);
+  }
+}
+
+/* forgets the parts of the file from part_n on. the caller holds
+ * file->lock */
+static void free_parts(struct dcfs_file *file, size_t part_n) {
+  for (size_t i = part_n; i < DISCORD_MAX_PARTS; i++) {
+    if (file->messages[i]) {
+      discord_free_message(file->messages[i]);
+      free(file->messages[i]);
+      file->messages[i] = NULL;
+      file->messages_n--;
+    }
+  }
+}
+
+/* gives up on an upload, what was posted of it goes */
+static void resume_drop(struct dcfs_checkpoint *checkpoint) {
+  for (unsigned int i = 0; i < checkpoint->ids_n; i++)
+    dcfs_deleter_add(checkpoint->channel_id, checkpoint->ids[i], NULL);
+  dcfs_checkpoint_remove(checkpoint);
+}
+
+/* lists the parts the checkpoint has posted that the file doesn't know
+ * of, they get their urls on first read. parts past the checkpoint belong
+ * to a message posted just before a crash, it's posted again. the caller
+ * holds file->lock */
+static void checkpoint_parts(struct dcfs_file *file,
+                             const struct dcfs_checkpoint *checkpoint) {
+  size_t posted = checkpoint->ids_n * DISCORD_PARTS_PER_MESSAGE;
+  const char *last_dropped = "";
+
+  for (size_t i = 0; i < DISCORD_MAX_PARTS; i++) {
+    struct dcfs_message *part = file->messages[i];
+    if (i < posted || !part)
+      continue;
+
+    if (!STREQ(part->id, last_dropped))
+      dcfs_deleter_add(checkpoint->channel_id, part->id, NULL);
+    last_dropped = part->id;
+  }
+
+  free_parts(file, posted);
+
+  for (size_t i = 0; i < posted && i * MAX_FILESIZE < checkpoint->size; i++) {
+    if (file->messages[i])
+      continue;
+
+    struct dcfs_message *part = calloc(1, sizeof(struct dcfs_message));
+    assert(part);
+
+    /* a name that leaves no room for the suffix of a part can't have been
+     * uploaded in parts */
+    int len =
+        i == 0 ? snprintf(part->filename, sizeof(part->filename), "%s",
+                          file->filename)
+               : snprintf(part->filename, sizeof(part->filename), "%s.PART%zu",
+                          file->filename, i);
+    if (len < 0 || len >= (int)sizeof(part->filename)) {
+      free(part);
+      continue;
+    }
+
+    snprintf(part->id, sizeof(part->id), "%s",
+             checkpoint->ids[i / DISCORD_PARTS_PER_MESSAGE]);
+
+    size_t remaining = checkpoint->size - i * MAX_FILESIZE;
+    part->size = remaining < MAX_FILESIZE ? remaining : MAX_FILESIZE;
+
+    file->messages[i] = part;
+    file->messages_n++;
+  }
+}
+
+/* hands an upload that failed partway over to the resumer. the file stays
+ * listed with its content until the rest is posted. the caller holds
+ * file->lock */
+static void resume_later(struct upload *upload) {
+  checkpoint_parts(upload->file, upload->checkpoint);
+
+  struct resume resume;
+  memcpy(&resume.checkpoint, upload->checkpoint,
+         sizeof(struct dcfs_checkpoint));
+  resume.file = upload->file;
+  dcfs_node_ref(&upload->file->node);
+
+  free(upload->checkpoint);
+  upload->checkpoint = NULL;
+
+  print_warn("the upload of %s will resume in the background\n",
+             upload->file->filename);
+  push_resume(upload->state, &resume);
+}
+
+/* picks a name for an upload whose own was taken by another file. the
+ * caller holds dir->lock */
+static int resume_name(struct dcfs_dir *dir, const char *name, char *out,
+                       size_t out_size) {
+  for (unsigned int i = 1; i < 100; i++) {
+    int len = i == 1 ? snprintf(out, out_size, "%s.resumed", name)
+                     : snprintf(out, out_size, "%s.resumed%u", name, i);
+    if (len < 0 || len >= (int)out_size)
+      return 1;
+    if (!dcfs_dir_find(dir, out))
+      return 0;
+  }
+  return 1;
+}
+
+/* moves the checkpoint of an upload that starts over to the new name of its
+ * file. what the old one posted goes, it never got to be a file. the caller
+ * holds file->lock */
+static int restart_checkpoint(struct dcfs_checkpoint *checkpoint,
+                              struct dcfs_file *file) {
+  struct dcfs_checkpoint old;
+  memcpy(&old, checkpoint, sizeof(struct dcfs_checkpoint));
+
+  if (dcfs_checkpoint_new(checkpoint, old.channel_id, file) != 0) {
+    memcpy(checkpoint, &old, sizeof(struct dcfs_checkpoint));
+    return 1;
+  }
+
+  resume_drop(&old);
+  return 0;
+}
+
+/* finds the file of an upload left by the last mount, or lists it again if
+ * it's gone. a different file that took the name since is left alone: the
+ * upload is dropped if that file is newer and starts over under a name of
+ * its own otherwise. returns 1 to try again later and -1 if the upload was
+ * given up on */
+static int resume_file(struct resume *resume) {
+  struct dcfs_checkpoint *checkpoint = &resume->checkpoint;
+  struct dcfs_dir *dir =
+      get_dir_ino(strtoull(checkpoint->channel_id, NULL, 10));
+  if (!dir) {
+    print_warn("the channel of %s is gone, dropping its upload\n",
+               checkpoint->filename);
+    resume_drop(checkpoint);
+    return -1;
+  }
+
+  char *content = dcfs_checkpoint_content(checkpoint);
+  if (!content) {
+    dcfs_node_put(&dir->node);
+    resume_drop(checkpoint);
+    return -1;
+  }
+
+  if (dcfs_dir_lock(dir, 1) != 0) {
+    dcfs_node_put(&dir->node);
+    free(content);
+    return 1;
+  }
+
+  const char *head = checkpoint->ids_n ? checkpoint->ids[0] : NULL;
+  struct dcfs_file *file = dcfs_dir_find(dir, checkpoint->filename);
+  char filename[sizeof(checkpoint->filename)];
+  snprintf(filename, sizeof(filename), "%s", checkpoint->filename);
+  int renamed = 0;
+
+  if (file) {
+    pthread_mutex_lock(&file->lock);
+    int same = head && file->messages[0] && STREQ(file->messages[0]->id, head);
+    int newer = !same && (file->uploading || file->ctime > checkpoint->ctime);
+    pthread_mutex_unlock(&file->lock);
+
+    if (same) {
+      dcfs_node_ref(&file->node);
+    } else if (newer || resume_name(dir, checkpoint->filename, filename,
+                                    sizeof(filename)) != 0) {
+      dcfs_dir_unlock(dir);
+      dcfs_node_put(&dir->node);
+      free(content);
+      print_warn("%s was replaced, dropping its upload\n",
+                 checkpoint->filename);
+      resume_drop(checkpoint);
+      return -1;
+    } else {
+      print_warn("%s was taken, its upload starts over as %s\n",
+                 checkpoint->filename, filename);
+      file = NULL;
+      renamed = 1;
+    }
+  }
+
+  if (!file) {
+    file = dcfs_new_file(dir, filename);
+    assert(file);
+    dcfs_dir_add_file(dir, file);
+  }
+
+  pthread_mutex_lock(&file->lock);
+  free(file->content);
+  file->content = content;
+  file->size = checkpoint->size;
+  file->mode = checkpoint->mode;
+  file->uid = checkpoint->uid;
+  file->gid = checkpoint->gid;
+  file->ctime = checkpoint->ctime;
+  file->hash = checkpoint->hash;
+  file->uploading = 1;
+  if (!renamed)
+    checkpoint_parts(file, checkpoint);
+  pthread_mutex_unlock(&file->lock);
+
+  dcfs_dir_unlock(dir);
+
+  /* the messages posted so far carry the old name in their attachments */
+  pthread_mutex_lock(&file->lock);
+  int ret = renamed ? restart_checkpoint(checkpoint, file) : 0;
+  if (ret != 0) {
+    free(file->content);
+    file->content = NULL;
+    file->uploading = 0;
+  }
+  pthread_mutex_unlock(&file->lock);
+
+  if (ret != 0) {
+    pthread_rwlock_wrlock(&dir->lock);
+    if (dcfs_dir_find(dir, file->filename) == file)
+      dcfs_dir_remove_file(dir, file);
+    dcfs_dir_unlock(dir);
+    dcfs_node_put(&file->node);
+    dcfs_node_put(&dir->node);
+    return 1;
+  }
+
+  dcfs_node_put(&dir->node);
+
+  print_inf("resuming the upload of %s\n", checkpoint->filename);
+  resume->file = file;
+  return 0;
+}
+
+/* posts the messages of the upload after the last one checkpointed, then
+ * describes them in the head. returns 1 if it has to be tried again, 0
+ * once the upload is done with */
+static int resume_upload(struct resume *resume) {
+  struct dcfs_checkpoint *checkpoint = &resume->checkpoint;
+  if (!resume->file) {
+    int ret = resume_file(resume);
+    if (ret != 0)
+      return ret > 0;
+  }
+
+  struct dcfs_file *file = resume->file;
+  struct dcfs_dir *dir = file->parent;
+  char meta[DISCORD_META_SIZE];
+  struct file files[DISCORD_PARTS_PER_MESSAGE];
+  int part_n = checkpoint->ids_n * DISCORD_PARTS_PER_MESSAGE;
+  int ret = 0;
+
+  pthread_mutex_lock(&file->lock);
+  file_meta(file, 0, meta, sizeof(meta));
+  char unlinked = file->unlinked;
+  pthread_mutex_unlock(&file->lock);
+
+  /* the content can't change while uploading is set */
+  for (int files_n;
+       !unlinked && (files_n = next_parts(file, files, part_n));
+       part_n += files_n) {
+    struct response resp = {0};
+    discord_create_attachments(dir->channel.id, files, files_n,
+                               part_n == 0 ? meta : NULL, &resp);
+
+    pthread_mutex_lock(&file->lock);
+    ret = add_parts(file, &resp);
+    if (ret == 0 && file->messages[part_n])
+      dcfs_checkpoint_add(checkpoint, file->messages[part_n]->id);
+    else
+      ret = -EAGAIN;
+    unlinked = file->unlinked;
+    pthread_mutex_unlock(&file->lock);
+
+    if (ret != 0)
+      return 1;
+  }
+
+  /* deleted while resuming, the messages posted since go too */
+  pthread_mutex_lock(&file->lock);
+  if ((unlinked = file->unlinked))
+    delete_messages(dir, file);
+  else
+    file_meta(file, 0, meta, sizeof(meta));
+  pthread_mutex_unlock(&file->lock);
+
+  if (!unlinked) {
+    struct response resp = {0};
+    discord_edit_message(dir->channel.id, checkpoint->ids[0], meta, &resp);
+    if (resp.http_code != 200)
+      print_warn("failed to describe the parts of %s. http code: %ld\n",
+                 file->filename, resp.http_code);
+    else
+      print_inf("resumed the upload of %s\n", file->filename);
+  }
+
+  pthread_mutex_lock(&file->lock);
+  free(file->content);
+  file->content = NULL;
+  file->uploading = 0;
+  pthread_mutex_unlock(&file->lock);
+
+  dcfs_checkpoint_remove(checkpoint);
+  dcfs_node_put(&file->node);
+  resume->file = NULL;
+  return 0;
+}
+
+/* waits on resume_cond until stop or seconds have passed. the caller holds
+ * state->resume_lock */
+static void resume_wait(struct dcfs_state *state, unsigned int seconds) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += seconds;
+
+  while (!state->resume_stop &&
+         pthread_cond_timedwait(&state->resume_cond, &state->resume_lock,
+                                &deadline) != ETIMEDOUT)
+    ;
+}
+
+/* posts the rest of the uploads that failed partway, the ones the last
+ * mount left first. a round that doesn't get everything through backs off
+ * before the next */
+static void *resume_run(void *data) {
+  struct dcfs_state *state = data;
+  unsigned int delay = RESUME_DELAY;
+
+  json_array *loaded = dcfs_checkpoint_load();
+  struct dcfs_checkpoint *checkpoint;
+  json_array_for_each(loaded, checkpoint) {
+    struct resume resume = {.file = NULL};
+    memcpy(&resume.checkpoint, checkpoint, sizeof(struct dcfs_checkpoint));
+    push_resume(state, &resume);
+  }
+  json_array_destroy(loaded);
+
+  pthread_mutex_lock(&state->resume_lock);
+  for (;;) {
+    while (!state->resume_stop && !state->resumes->data)
+      pthread_cond_wait(&state->resume_cond, &state->resume_lock);
+    if (state->resume_stop)
+      break;
+
+    json_array *pending = state->resumes;
+    state->resumes = json_array_new();
+    pthread_mutex_unlock(&state->resume_lock);
+
+    int failed = 0;
+    struct resume *resume;
+    json_array_for_each(pending, resume) {
+      if (!__atomic_load_n(&state->resume_stop, __ATOMIC_RELAXED) &&
+          resume_upload(resume) == 0)
+        continue;
+
+      failed = 1;
+      push_resume(state, resume);
+    }
+    json_array_destroy(pending);
+
+    pthread_mutex_lock(&state->resume_lock);
+    if (failed) {
+      resume_wait(state, delay);
+      delay = delay * 2 < RESUME_MAX_DELAY ? delay * 2 : RESUME_MAX_DELAY;
+    } else {
+      delay = RESUME_DELAY;
+    }
+  }
+
+  /* the checkpoints stay for the next mount */
+  json_array *left = state->resumes;
+  state->resumes = NULL;
+  pthread_mutex_unlock(&state->resume_lock);
+
+  struct resume *resume;
+  json_array_for_each(left, resume) push_resume(state, resume);
+  json_array_destroy(left);
+
+  return NULL;
+}
+
+static void resume_start(struct dcfs_state *state) {
+  dcfs_checkpoint_init(GUILD_ID);
+
+  state->resumes = json_array_new();
+  assert(state->resumes);
+
+  if (pthread_create(&state->resume_thread, NULL, resume_run, state) != 0) {
+    print_warn("failed to start resuming uploads\n");
+    json_array_destroy(state->resumes);
+    state->resumes = NULL;
+    return;
+  }
+
+  state->resume_started = 1;
+}
+
+static void resume_stop(struct dcfs_state *state) {
+  if (!state->resume_started)
+    return;
+
+  pthread_mutex_lock(&state->resume_lock);
+  state->resume_stop = 1;
+  pthread_cond_signal(&state->resume_cond);
+  pthread_mutex_unlock(&state->resume_lock);
+
+  pthread_join(state->resume_thread, NULL);
+  state->resume_started = 0;
+}
+
+/* attachment urls are signed and stop working after a while. urls loaded
+ * from a snapshot are the likeliest to have expired */
+static inline int url_expired(long http_code) {
+  return http_code == 403 || http_code == 404 || http_code == 410;
+}
+
+static int refresh_url(const char *channel_id, struct dcfs_message *part) {
+  char *url = discord_get_attachment_url(channel_id, part->id, part->filename);
+  if (!url)
+    return 1;
+
+  free(part->url);
+  part->url = url;
+  return 0;
+}
+
+/* downloads a part, or decodes it right away if its data is inline */
+static void get_part(struct dcfs_message *part, struct response *resp) {
+  if (discord_inline_content(part->url, resp) != 0)
+    request_get(part->url, resp, 0);
+}
+
+/* checks downloaded content against the hash from the metadata of the
+ * head message. the caller holds file->lock */
+static int content_intact(struct dcfs_file *file, const char *content,
+                          size_t size) {
+  if (!file->hash ||
+      (size == file->size && content_hash(content, size) == file->hash))
+    return 1;
+
+  print_err("%s doesn't match its metadata, not reading it\n", file->filename);
+  return 0;
+}
+
+/* downloads a part of a file in the channel, again with a fresh url if its
+ * own expired */
+static int fetch_part(const char *channel_id, struct dcfs_message *part,
+                      struct response *resp) {
+  /* parts listed from a manifest have no url yet */
+  if (part->url || refresh_url(channel_id, part) == 0)
+    get_part(part, resp);
+
+  if (url_expired(resp->http_code) && refresh_url(channel_id, part) == 0) {
+    free(resp->raw);
+    memset(resp, 0, sizeof(struct response));
+    get_part(part, resp);
+  }
+
+  if (resp->http_code != 200) {
+    print_err("failed to download %s. http code: %ld\n", part->filename,
+              resp->http_code);
+    free(resp->raw);
+    resp->raw = NULL;
+    return -EIO;
+  }
+  return 0;
+}
+
+/* posts the data of file to dir as copy, whose name and attributes are
+ * set by the caller. it goes a message at a time, taking the parts from the
+ * content when it's loaded and downloading them otherwise, so no more than
+ * a message worth of parts is held however large the file. file->lock is
+ * only held to pick up the next parts, the caller marks the file as
+ * uploading meanwhile so its messages stay put. copy gets the new
+ * messages, which are deleted again if it fails */
+static int copy_parts(struct dcfs_state *state, struct dcfs_file *file,
+                      struct dcfs_dir *dir, struct dcfs_file *copy) {
+  char channel_id[64], filename[sizeof(file->filename)];
+  pthread_mutex_lock(&file->lock);
+  snprintf(channel_id, sizeof(channel_id), "%s", file->parent->channel.id);
+  snprintf(filename, sizeof(filename), "%s", file->filename);
+  size_t size = file->size;
+  uint64_t expected = file->hash;
+  pthread_mutex_unlock(&file->lock);
+
+  if (size / MAX_FILESIZE >= DISCORD_MAX_PARTS)
+    return -EFBIG;
+
+  size_t parts_n = (size + MAX_FILESIZE - 1) / MAX_FILESIZE;
+  copy->size = size;
+  copy->hash = expected;
+
+  int ret = 0;
+  uint64_t hash = content_hash(NULL, 0);
+  char meta[DISCORD_META_SIZE];
+
+  for (size_t part_n = 0; part_n < parts_n;
+       part_n += DISCORD_PARTS_PER_MESSAGE) {
+    struct file files[DISCORD_PARTS_PER_MESSAGE];
+    struct dcfs_message parts[DISCORD_PARTS_PER_MESSAGE];
+    char *raw[DISCORD_PARTS_PER_MESSAGE] = {0};
+    memset(files, 0, sizeof(files));
+    memset(parts, 0, sizeof(parts));
+
+    /* the parts are copied out, the lock isn't held while they transfer */
+    int files_n = 0;
+    pthread_mutex_lock(&file->lock);
+    for (size_t i = part_n; i < parts_n && files_n < DISCORD_PARTS_PER_MESSAGE;
+         i++, files_n++) {
+      size_t offset = i * MAX_FILESIZE;
+      files[files_n].buffer_size =
+          size - offset < MAX_FILESIZE ? size - offset : MAX_FILESIZE;
+      part_filename(copy, i, &files[files_n]);
+
+      if (file->content) {
+        raw[files_n] = malloc(files[files_n].buffer_size);
+        if (!raw[files_n]) {
+          ret = -ENOBUFS;
+          break;
+        }
+        memcpy(raw[files_n], file->content + offset,
+               files[files_n].buffer_size);
+      } else if (file->messages[i]) {
+        parts[files_n] = *file->messages[i];
+        parts[files_n].url =
+            file->messages[i]->url ? strdup(file->messages[i]->url) : NULL;
+        parts[files_n].content = NULL;
+      } else {
+        ret = -EIO;
+        break;
+      }
+    }
+    pthread_mutex_unlock(&file->lock);
+
+    for (int i = 0; ret == 0 && i < files_n; i++) {
+      if (!raw[i]) {
+        struct response resp = {0};
+        if (fetch_part(channel_id, &parts[i], &resp) != 0) {
+          ret = -EIO;
+          break;
+        }
+
+        raw[i] = resp.raw;
+        if (resp.size != files[i].buffer_size) {
+          print_err("%s doesn't match its metadata, not copying it\n",
+                    filename);
+          ret = -EIO;
+          break;
+        }
+      }
+      files[i].buffer = raw[i];
+    }
+
+    for (int i = 0; ret == 0 && i < files_n; i++)
+      hash = content_hash_more(hash, files[i].buffer, files[i].buffer_size);
+
+    /* a file of one message is whole by now, its head can say so */
+    if (ret == 0 && part_n == 0) {
+      if (parts_n <= DISCORD_PARTS_PER_MESSAGE)
+        copy->hash = hash;
+
+      copy->content = files[0].buffer;
+      int in_content = file_meta(copy, inlined(state, copy), meta,
+                                 sizeof(meta));
+      copy->content = NULL;
+      if (in_content)
+        files_n = 0;
+    }
+
+    if (ret == 0) {
+      struct response resp = {0};
+      discord_create_attachments(dir->channel.id, files, files_n,
+                                 part_n == 0 ? meta : NULL, &resp);
+      ret = add_parts(copy, &resp);
+    }
+
+    for (int i = 0; i < DISCORD_PARTS_PER_MESSAGE; i++) {
+      free(raw[i]);
+      free(parts[i].url);
+    }
+    if (ret != 0)
+      goto err;
+  }
+
+  if (expected && hash != expected) {
+    print_err("%s doesn't match its metadata, not copying it\n", filename);
+    ret = -EIO;
+    goto err;
+  }
+
+  /* the head went out before the ids of the other messages were known */
+  if (parts_n > DISCORD_PARTS_PER_MESSAGE) {
+    struct response resp = {0};
+    copy->hash = hash;
+    file_meta(copy, 0, meta, sizeof(meta));
+    discord_edit_message(dir->channel.id, copy->messages[0]->id, meta, &resp);
+    if (resp.http_code != 200)
+      print_warn("failed to describe the parts of %s. http code: %ld\n",
+                 copy->filename, resp.http_code);
+  }
+
+  return 0;
+
+err:
+  /* what went out before the failure would be left behind */
+  delete_messages(dir, copy);
+  free_parts(copy, 0);
+  return ret;
+}
+
+/* renames the attachments of file to copy->filename by editing each of its
+ * messages, so the data stays where it is. copy gets the messages under
+ * their new names. if a message can't be edited the ones before it are
+ * renamed back, the caller copies the file instead then. the caller marks
+ * the file as uploading meanwhile so its messages stay put */
+static int rename_parts(struct dcfs_file *file, struct dcfs_file *copy) {
+  char ids[DISCORD_MAX_PARTS / DISCORD_PARTS_PER_MESSAGE + 1][64];
+  char channel_id[64], filename[sizeof(file->filename)];
+  size_t ids_n = 0;
+
+  pthread_mutex_lock(&file->lock);
+  snprintf(channel_id, sizeof(channel_id), "%s", file->parent->channel.id);
+  snprintf(filename, sizeof(filename), "%s", file->filename);
+  copy->size = file->size;
+  copy->hash = file->hash;
+  size_t messages_n = file->messages_n;
+
+  for (size_t i = 0; i < file->messages_n; i++) {
+    struct dcfs_message *message = file->messages[i];
+    if (!message || ids_n == sizeof(ids) / sizeof(ids[0])) {
+      ids_n = 0;
+      break;
+    }
+    if (!ids_n || !STREQ(ids[ids_n - 1], message->id))
+      snprintf(ids[ids_n++], sizeof(ids[0]), "%s", message->id);
+  }
+  pthread_mutex_unlock(&file->lock);
+
+  if (!ids_n)
+    return -EIO;
+
+  int ret = 0;
+  size_t renamed_n = 0;
+  for (; renamed_n < ids_n; renamed_n++) {
+    struct response resp = {0};
+    json_object *json = NULL;
+    if (discord_rename_attachments(channel_id, ids[renamed_n], filename,
+                                   copy->filename, &resp) == 0)
+      json_load(resp.raw, (void **)&json);
+    free(resp.raw);
+
+    if (!json) {
+      ret = -EAGAIN;
+      break;
+    }
+    add_attachments(copy, json);
+    json_object_destroy(json);
+  }
+
+  if (ret == 0 && copy->messages_n != messages_n)
+    ret = -EIO;
+  if (ret == 0)
+    return 0;
+
+  /* the edit that failed may have gone through in part */
+  for (size_t i = 0; i <= renamed_n && i < ids_n; i++) {
+    struct response resp = {0};
+    if (discord_rename_attachments(channel_id, ids[i], copy->filename,
+                                   filename, &resp) != 0 &&
+        i < renamed_n)
+      print_warn("failed to rename %s back to %s\n", copy->filename,
+                 filename);
+    free(resp.raw);
+  }
+
+  free_parts(copy, 0);
+  return ret;
+}
+
+struct pending_read {
+  fuse_req_t req;
+  size_t size;
+  off_t offset;
+};
+
+struct content_part {
+  struct content_load *load;
+  struct response resp;
+  size_t part_n;
+  char refreshed;
+};
+
+struct content_load {
+  struct dcfs_file *file;
+  struct content_part *parts;
+  size_t parts_n;
+  size_t pending;
+  int err;
+  /* set once no read waits for the content, the transfers stop */
+  char cancelled;
+};
+
+/* the caller holds file->lock */
+static void reply_read(struct dcfs_file *file, fuse_req_t req, size_t size,
+                       off_t offset) {
+  if ((size_t)offset < file->size) {
+    if (offset + size > file->size)
+      size = file->size - offset;
+
+    /* spliced into the fuse device when the splice option is on */
+    struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+    bufv.buf[0].mem = file->content + offset;
+    fuse_reply_data(req, &bufv, 0);
+
+  } else {
+    fuse_reply_buf(req, NULL, 0);
+  }
+}
+
+/* drops one pending part, or the submitter's hold on the load. the last one
+ * stores the content and answers every waiting read */
+static void content_load_put(struct content_load *load) {
+  if (__atomic_sub_fetch(&load->pending, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+
+  struct dcfs_file *file = load->file;
+  pthread_mutex_lock(&file->lock);
+
+  /* a read after the cancel started another load, which answers it */
+  if (file->load != load)
+    load->err = -EINTR;
+
+  size_t size = 0;
+  for (size_t i = 0; i < load->parts_n; i++)
+    size += load->parts[i].resp.size;
+
+  /* parts were added by dcfs_dir_refresh while this was loading */
+  if (!load->err && size != file->size)
+    load->err = -EAGAIN;
+
+  /* a synchronous load_content may have won the race */
+  if (!load->err && !file->content) {
+    file->content = malloc(size ? size : 1);
+    if (!file->content) {
+      load->err = -ENOBUFS;
+    } else {
+      size_t offset = 0;
+      for (size_t i = 0; i < load->parts_n; i++) {
+        memcpy(file->content + offset, load->parts[i].resp.raw,
+               load->parts[i].resp.size);
+        offset += load->parts[i].resp.size;
+      }
+
+      if (!content_intact(file, file->content, size)) {
+        free(file->content);
+        file->content = NULL;
+        load->err = -EIO;
+      }
+    }
+  }
+
+  if (file->load == load) {
+    struct pending_read *read;
+    json_array_for_each(file->readers, read) {
+      if (load->err)
+        fuse_reply_err(read->req, -load->err);
+      else
+        reply_read(file, read->req, read->size, read->offset);
+    }
+
+    json_array_destroy(file->readers);
+    file->readers = NULL;
+    file->load = NULL;
+  }
+  pthread_mutex_unlock(&file->lock);
+
+  for (size_t i = 0; i < load->parts_n; i++)
+    free(load->parts[i].resp.raw);
+
+  dcfs_node_put(&file->node);
+  free(load->parts);
+  free(load);
+}
+
+static void content_part_cb(struct response *resp, void *data);
+
+/* looks the message up again for a fresh url and retries the download */
+static void content_url_cb(struct response *resp, void *data) {
+  struct content_part *part = data;
+  struct dcfs_file *file = part->load->file;
+
+  pthread_mutex_lock(&file->lock);
+  struct dcfs_message *message = file->messages[part->part_n];
+  char *url = NULL;
+  if (resp->http_code == 200)
+    url = discord_attachment_url(resp->raw, message->filename);
+
+  /* the data of an inline file was in the message, the part is handed
+   * over once the lock is dropped */
+  struct response inline_resp = {0};
+  int ret = 1, in_content = 0;
+  if (url) {
+    free(message->url);
+    message->url = url;
+    in_content = discord_inline_content(url, &inline_resp) == 0;
+    ret = in_content ? 0
+                     : request_download_async(url, &part->load->cancelled,
+                                              content_part_cb, part);
+  }
+  pthread_mutex_unlock(&file->lock);
+  free(resp->raw);
+
+  if (in_content)
+    content_part_cb(&inline_resp, part);
+
+  if (ret != 0) {
+    print_err("failed to refresh the url of %s\n", file->filename);
+    part->load->err = -EIO;
+    content_load_put(part->load);
+  }
+}
+
+static void content_part_cb(struct response *resp, void *data) {
+  struct content_part *part = data;
+
+  if (url_expired(resp->http_code) && !part->refreshed) {
+    struct dcfs_file *file = part->load->file;
+    part->refreshed = 1;
+    free(resp->raw);
+
+    pthread_mutex_lock(&file->lock);
+    struct dcfs_message *message = file->messages[part->part_n];
+    int ret = discord_get_message_async(file->parent->channel.id, message->id,
+                                        content_url_cb, part);
+    pthread_mutex_unlock(&file->lock);
+
+    if (ret == 0)
+      return;
+
+    part->load->err = -EIO;
+    content_load_put(part->load);
+    return;
+  }
+
+  part->resp = *resp;
+
+  if (resp->http_code != 200 &&
+      __atomic_load_n(&part->load->cancelled, __ATOMIC_RELAXED)) {
+    part->load->err = -EINTR;
+  } else if (resp->http_code != 200) {
+    print_err("failed to download part of %s. http code: %ld\n",
+              part->load->file->filename, resp->http_code);
+    part->load->err = -EIO;
+  }
+
+  content_load_put(part->load);
+}
+
+/* downloads every part of the file in the background. returns the load,
+ * which the caller releases with content_load_put after dropping
+ * file->lock, or NULL if nothing could be started. the caller holds
+ * file->lock */
+static struct content_load *load_content_async(struct dcfs_file *file) {
+  struct content_load *load = calloc(1, sizeof(struct content_load));
+  if (!load)
+    return NULL;
+
+  load->parts = calloc(file->messages_n, sizeof(struct content_part));
+  if (!load->parts) {
+    free(load);
+    return NULL;
+  }
+
+  load->file = file;
+  load->parts_n = file->messages_n;
+  load->pending = file->messages_n + 1;
+  dcfs_node_ref(&file->node);
+  file->load = load;
+
+  for (size_t i = 0; i < load->parts_n; i++) {
+    struct dcfs_message *message = file->messages[i];
+    load->parts[i].load = load;
+    load->parts[i].part_n = i;
+
+    int ret = 1;
+    struct response resp = {0};
+    if (message && message->url &&
+        discord_inline_content(message->url, &resp) == 0) {
+      /* the submitter's hold keeps this from finishing the load */
+      content_part_cb(&resp, &load->parts[i]);
+      ret = 0;
+    } else if (message && message->url) {
+      ret = request_download_async(message->url, &load->cancelled,
+                                   content_part_cb, &load->parts[i]);
+    } else if (message) {
+      /* listed from a manifest, look the url up first */
+      load->parts[i].refreshed = 1;
+      ret = discord_get_message_async(file->parent->channel.id, message->id,
+                                      content_url_cb, &load->parts[i]);
+    }
+
+    if (ret != 0) {
+      load->err = -EIO;
+      content_load_put(load);
+    }
+  }
+
+  return load;
+}
+
+/* queues the messages of the file for the deleter. the caller holds
+ * file->lock */
+static void delete_messages(struct dcfs_dir *dir, struct dcfs_file *file) {
+  dcfs_hash last_deleted_message_id = 0;
+
+  /* a file of a single part may share its message with other files */
+  if (file->messages_n == 1 && file->messages[0]) {
+    dcfs_deleter_add(dir->channel.id, file->messages[0]->id, file->filename);
+    dcfs_dir_changed(dir);
+    return;
+  }
+
+  for (size_t i = 0; i < file->messages_n; i++) {
+    struct dcfs_message *message = file->messages[i];
+    if (message && string_hash(message->id) != last_deleted_message_id) {
+      dcfs_deleter_add(dir->channel.id, message->id, NULL);
+      last_deleted_message_id = string_hash(message->id);
+    }
+  }
+
+  dcfs_dir_changed(dir);
+}
+
+static void dcfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  struct dcfs_state *state = fuse_req_userdata(req);
+
+  char filename[256];
+  string_normalize(filename, name, sizeof(filename));
+
+  struct fuse_entry_param e;
+  init_entry(state, &e);
+
+  if (parent == DCFS_ROOT_INO) {
+    print_op("dcfs_lookup", filename, NULL);
+    pthread_rwlock_rdlock(&state->lock);
+
+    struct dcfs_dir *dir = get_dir(state, filename);
+    if (dir) {
+      pthread_rwlock_rdlock(&dir->lock);
+      fill_dir_stat(dir, &e.attr);
+      pthread_rwlock_unlock(&dir->lock);
+
+      dcfs_node_lookup(&dir->node);
+      e.ino = dir->node.ino;
+    }
+
+    pthread_rwlock_unlock(&state->lock);
+
+    if (!dir)
+      reply_enoent(state, req);
+    else
+      fuse_reply_entry(req, &e);
+    return;
+  }
+
+  struct dcfs_dir *dir = get_dir_ino(parent);
+  if (!dir) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+
+  print_op("dcfs_lookup", dir->channel.name, filename);
+
+  if (dcfs_dir_lock(dir, 0) != 0) {
+    dcfs_node_put(&dir->node);
+    fuse_reply_err(req, EIO);
+    return;
+  }
+
+  struct dcfs_file *file = dcfs_dir_find(dir, filename);
+  if (file) {
+    pthread_mutex_lock(&file->lock);
+    fill_file_stat(file, &e.attr);
+    pthread_mutex_unlock(&file->lock);
+
+    dcfs_node_lookup(&file->node);
+    e.ino = file->node.ino;
+  }
+
+  dcfs_dir_unlock(dir);
+  dcfs_node_put(&dir->node);
+
+  if (!file)
+    reply_enoent(state, req);
+  else
+    fuse_reply_entry(req, &e);
+}
+
+static void dcfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+  dcfs_node_forget(ino, nlookup);
+  fuse_reply_none(req);
+}
+
+static void dcfs_forget_multi(fuse_req_t req, size_t count,
+                              struct fuse_forget_data *forgets) {
+  for (size_t i = 0; i < count; i++)
+    dcfs_node_forget(forgets[i].ino, forgets[i].nlookup);
+  fuse_reply_none(req);
+}
+
+static void dcfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  if (parent != DCFS_ROOT_INO) {
+    fuse_reply_err(req, EPERM);
+    return;
+  }
+  struct dcfs_state *state = fuse_req_userdata(req);
+
+  char dirname[128];
+  string_normalize(dirname, name, sizeof(dirname));
+  print_op("dcfs_rmdir", dirname, NULL);
+
+  pthread_rwlock_rdlock(&state->lock);
+  struct dcfs_dir *dir = get_dir(state, dirname);
+  if (dir)
+    dcfs_node_ref(&dir->node);
+  pthread_rwlock_unlock(&state->lock);
+
+  if (!dir) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+
+  struct response resp = {0};
+  discord_delete_channel(dir->channel.id, &resp);
+
+  if (resp.http_code != 200) {
+    print_err("failed to delete %s channel. http code: %ld\n",
+              dir->channel.name, resp.http_code);
+    dcfs_node_put(&dir->node);
+    fuse_reply_err(req, EAGAIN);
+    return;
+  }
+
+  pthread_rwlock_wrlock(&state->lock);
+  json_array_detach_ptr(&state->dirs, dir);
+  index_dirs(state);
+  pthread_rwlock_unlock(&state->lock);
+
+  pthread_rwlock_wrlock(&dir->lock);
+  while (dir->files && dir->files->data)
+    dcfs_dir_remove_file(dir, dir->files->data);
+  dcfs_dir_unlock(dir);
+
+  /* the reference held by state->dirs, then ours */
+  dcfs_node_put(&dir->node);
+  dcfs_node_put(&dir->node);
+  fuse_reply_err(req, 0);
+}
+
+static void dcfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                       mode_t mode) {
+  if (parent != DCFS_ROOT_INO) {
+    fuse_reply_err(req, EPERM);
+    return;
+  }
+
+  struct dcfs_state *state = fuse_req_userdata(req);
+
+  char dirname[128];
+  string_normalize(dirname, name, sizeof(dirname));
+  print_op("dcfs_mkdir", dirname, NULL);
+
+  struct response resp = {0};
+  discord_create_channel(GUILD_ID, dirname, &resp);
+
+  if (resp.http_code != 201) {
+    print_err("failed to create a new channel. http_code: %ld\n",
+              resp.http_code);
+    free(resp.raw);
+    fuse_reply_err(req, EAGAIN);
+    return;
+  }
+
+  json_object *json;
+  json_load(resp.raw, (void **)&json);
+  free(resp.raw);
+
+  json_string id = json_object_get(json, "id");
+  json_string channel_name = json_object_get(json, "name");
+  json_number *type = json_object_get(json, "type");
+
+  struct dcfs_channel channel;
+  memset(&channel, 0, sizeof(struct dcfs_channel));
+
+  snprintf(channel.id, sizeof(channel.id), "%s", id);
+  snprintf(channel.name, sizeof(channel.name), "%s", channel_name);
+  channel.type = *type;
+  channel.has_parent = 0;
+  json_object_destroy(json);
+
+  pthread_rwlock_wrlock(&state->lock);
+  struct dcfs_dir *dir = dcfs_new_dir(state->dirs, &channel);
+  index_dirs(state);
+  pthread_rwlock_unlock(&state->lock);
+
+  if (!dir) {
+    fuse_reply_err(req, ENOBUFS);
+    return;
+  }
+
+  struct fuse_entry_param e;
+  init_entry(state, &e);
+
+  pthread_rwlock_wrlock(&dir->lock);
+  dir->mode = S_IFDIR | (mode & 07777);
+  dir->files = json_array_new();
+  dir->loaded = 1;
+  fill_dir_stat(dir, &e.attr);
+  dcfs_dir_unlock(dir);
+
+  dcfs_node_lookup(&dir->node);
+  e.ino = dir->node.ino;
+  fuse_reply_entry(req, &e);
+};
+
+#ifdef __APPLE__
+static void dcfs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                          size_t size, uint32_t position) {
+  if (size == 0)
+    fuse_reply_xattr(req, 0);
+  else
+    fuse_reply_buf(req, NULL, 0);
+}
+
+static void dcfs_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                          const char *value, size_t size, int flags,
+                          uint32_t position) {
+  fuse_reply_err(req, 0);
+}
+#endif /* __APPLE__ */
+
+static void dcfs_getattr(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_file_info *_) {
+  struct dcfs_state *state = fuse_req_userdata(req);
+  struct stat stbuf;
+
+  if (ino == DCFS_ROOT_INO) {
+    print_op("dcfs_getattr", NULL, NULL);
+    fill_root_stat(&stbuf);
+    fuse_reply_attr(req, &stbuf, state->attr_timeout);
+    return;
+  }
+
+  struct dcfs_node *node = dcfs_node_get(ino);
+  if (!node) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+
+  if (node->type == DCFS_NODE_DIR) {
+    struct dcfs_dir *dir = (struct dcfs_dir *)node;
+    print_op("dcfs_getattr", dir->channel.name, NULL);
+
+    /* served from channel metadata, the listing is only fetched once a
+     * child is looked up or the dir is read */
+    pthread_rwlock_rdlock(&dir->lock);
+    fill_dir_stat(dir, &stbuf);
+    dcfs_dir_unlock(dir);
+
+  } else {
+    struct dcfs_file *file = (struct dcfs_file *)node;
+    print_op("dcfs_getattr", file->parent->channel.name, file->filename);
+
+    pthread_mutex_lock(&file->lock);
+    fill_file_stat(file, &stbuf);
+    pthread_mutex_unlock(&file->lock);
+  }
+
+  dcfs_node_put(node);
+  fuse_reply_attr(req, &stbuf, state->attr_timeout);
+}
+
+static void dcfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                         int to_set, struct fuse_file_info *_) {
+  struct dcfs_state *state = fuse_req_userdata(req);
+  struct stat stbuf;
+
+  if (ino == DCFS_ROOT_INO) {
+    fill_root_stat(&stbuf);
+    fuse_reply_attr(req, &stbuf, state->attr_timeout);
+    return;
+  }
+
+  struct dcfs_node *node = dcfs_node_get(ino);
+  if (!node) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+
+  int ret = 0;
+  if (node->type == DCFS_NODE_DIR) {
+    struct dcfs_dir *dir = (struct dcfs_dir *)node;
+    print_op("dcfs_setattr", dir->channel.name, NULL);
+
+    pthread_rwlock_wrlock(&dir->lock);
+    if (to_set & FUSE_SET_ATTR_MODE)
+      dir->mode = S_IFDIR | (attr->st_mode & 07777);
+    if (to_set & FUSE_SET_ATTR_UID)
+      dir->uid = attr->st_uid;
+    if (to_set & FUSE_SET_ATTR_GID)
+      dir->gid = attr->st_gid;
+
+    fill_dir_stat(dir, &stbuf);
+    dcfs_dir_unlock(dir);
+
+  } else {
+    struct dcfs_file *file = (struct dcfs_file *)node;
+    print_op("dcfs_setattr", file->parent->channel.name, file->filename);
+
+    pthread_mutex_lock(&file->lock);
+    if (to_set & FUSE_SET_ATTR_MODE)
+      file->mode = S_IFREG | (attr->st_mode & 07777);
+    if (to_set & FUSE_SET_ATTR_UID)
+      file->uid = attr->st_uid;
+    if (to_set & FUSE_SET_ATTR_GID)
+      file->gid = attr->st_gid;
+
+    /* the manifest keeps the attributes of uploaded files */
+    if (file->messages_n &&
+        to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+      dcfs_dir_changed(file->parent);
+
+    /* only files that haven't been uploaded yet live in memory and can be
+     * resized */
+    if (to_set & FUSE_SET_ATTR_SIZE && (size_t)attr->st_size != file->size) {
+      if (file->messages_n || file->uploading) {
+        ret = ENOTSUP;
+      } else {
+        char *content = realloc(file->content, attr->st_size);
+        if (!content && attr->st_size) {
+          ret = ENOBUFS;
+        } else {
+          if ((size_t)attr->st_size > file->size)
+            memset(content + file->size, 0, attr->st_size - file->size);
+          file->content = content;
+          file->size = attr->st_size;
+        }
+      }
+    }
+
+    fill_file_stat(file, &stbuf);
+    pthread_mutex_unlock(&file->lock);
+  }
+
+  dcfs_node_put(node);
+
+  if (ret)
+    fuse_reply_err(req, ret);
+  else
+    fuse_reply_attr(req, &stbuf, state->attr_timeout);
+}
+
+/* the caller holds the lock guarding the listing the entry comes from */
+static int add_dirent(struct dcfs_handle *fh, const char *name,
+                      struct dcfs_node *node, fuse_ino_t ino, mode_t mode) {
+  if (fh->entries_n == fh->entries_capacity) {
+    size_t capacity = fh->entries_capacity ? fh->entries_capacity * 2 : 16;
+    struct dcfs_dirent *entries =
+        realloc(fh->entries, capacity * sizeof(struct dcfs_dirent));
+    if (!entries)
+      return -ENOBUFS;
+
+    fh->entries = entries;
+    fh->entries_capacity = capacity;
+  }
+
+  struct dcfs_dirent *entry = &fh->entries[fh->entries_n];
+  if (!(entry->name = strdup(name)))
+    return -ENOBUFS;
+
+  entry->node = node;
+  entry->ino = ino;
+  entry->mode = mode;
+  if (node)
+    dcfs_node_ref(node);
+
+  fh->entries_n++;
+  return 0;
+}
+
+/* appends the files added to the listing since the snapshot last looked.
+ * the caller holds dir->lock */
+static int add_new_files(struct dcfs_handle *fh, struct dcfs_dir *dir) {
+  int ret;
+
+  struct dcfs_file *file;
+  json_array_for_each(dir->files, file) {
+    if (file->seq <= fh->seq)
+      continue;
+
+    if ((ret = add_dirent(fh, file->filename, &file->node, file->node.ino,
+                          S_IFREG)) != 0)
+      return ret;
+  }
+
+  fh->seq = dir->seq;
+  return 0;
+}
+
+/* takes a snapshot of the listing, so a directory read in several calls
+ * stays consistent while files are created or removed. a channel that
+ * hasn't been fully crawled yet only contributes the pages fetched so far,
+ * see extend_snapshot */
+static int snapshot_dir(struct dcfs_state *state, struct dcfs_handle *fh) {
+  free_entries(fh);
+
+  if (!fh->node) {
+    int ret = add_dirent(fh, ".", NULL, DCFS_ROOT_INO, S_IFDIR);
+    if (ret == 0)
+      ret = add_dirent(fh, "..", NULL, DCFS_ROOT_INO, S_IFDIR);
+
+    pthread_rwlock_rdlock(&state->lock);
+
+    struct dcfs_dir *dir;
+    json_array_for_each(state->dirs, dir) {
+      if (ret != 0)
+        break;
+      if (dir->channel.type == GUILD_TEXT && !dir->channel.has_parent)
+        ret = add_dirent(fh, dir->channel.name, &dir->node, dir->node.ino,
+                         S_IFDIR);
+    }
+
+    pthread_rwlock_unlock(&state->lock);
+    return ret;
+  }
+
+  struct dcfs_dir *dir = (struct dcfs_dir *)fh->node;
+  pthread_rwlock_rdlock(&dir->lock);
+
+  int ret = add_dirent(fh, ".", NULL, dir->node.ino, S_IFDIR);
+  if (ret == 0)
+    ret = add_dirent(fh, "..", NULL, DCFS_ROOT_INO, S_IFDIR);
+  if (ret == 0)
+    ret = add_new_files(fh, dir);
+
+  dcfs_dir_unlock(dir);
+  return ret;
+}
+
+/* crawls the next pages of the channel until the snapshot has entries past
+ * offset or the whole channel is in, so the first entries of a huge
+ * channel are returned after a single request */
+static int extend_snapshot(struct dcfs_handle *fh, off_t offset) {
+  if (!fh->node)
+    return 0;
+
+  struct dcfs_dir *dir = (struct dcfs_dir *)fh->node;
+  int ret = 0;
+
+  while (ret == 0 && (size_t)offset >= fh->entries_n) {
+    pthread_rwlock_wrlock(&dir->lock);
+
+    /* another reader may have fetched the page already */
+    if (dir->seq == fh->seq && !dir->loaded && dcfs_dir_load_page(dir) != 0)
+      ret = -EIO;
+    else if (dir->seq == fh->seq && dir->loaded)
+      ret = 1;
+    else
+      ret = add_new_files(fh, dir);
+
+    dcfs_dir_unlock(dir);
+  }
+
+  return ret < 0 ? ret : 0;
+}
+
+static void dcfs_opendir(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_file_info *fi) {
+  struct dcfs_node *node = NULL;
+  if (ino != DCFS_ROOT_INO) {
+    if (!(node = dcfs_node_get(ino))) {
+      fuse_reply_err(req, ENOENT);
+      return;
+    }
+
+    if (node->type != DCFS_NODE_DIR) {
+      dcfs_node_put(node);
+      fuse_reply_err(req, ENOTDIR);
+      return;
+    }
+  }
+
+  struct dcfs_handle *fh = new_handle(node, fi->flags);
+  if (!fh) {
+    if (node)
+      dcfs_node_put(node);
+    fuse_reply_err(req, ENOBUFS);
+    return;
+  }
+
+  fi->fh = (uintptr_t)fh;
+  if (fuse_reply_open(req, fi) != 0)
+    free_handle(fh);
+}
+
+static void fill_dirent_stat(struct dcfs_dirent *entry, struct stat *stbuf) {
+  struct dcfs_node *node = entry->node;
+
+  if (!node) {
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = entry->ino;
+    stbuf->st_mode = entry->mode;
+
+  } else if (node->type == DCFS_NODE_DIR) {
+    struct dcfs_dir *dir = (struct dcfs_dir *)node;
+    pthread_rwlock_rdlock(&dir->lock);
+    fill_dir_stat(dir, stbuf);
+    dcfs_dir_unlock(dir);
+
+  } else {
+    struct dcfs_file *file = (struct dcfs_file *)node;
+    pthread_mutex_lock(&file->lock);
+    fill_file_stat(file, stbuf);
+    pthread_mutex_unlock(&file->lock);
+  }
+}
+
+/* readdirplus also returns full attributes and counts as a lookup of every
+ * entry but "." and "..", so ls -l and find don't stat each file */
+static void reply_dir(fuse_req_t req, size_t size, off_t offset,
+                      struct fuse_file_info *fi, int plus) {
+  struct dcfs_state *state = fuse_req_userdata(req);
+  struct dcfs_handle *fh = get_handle(fi);
+
+  if (fh->node)
+    print_op(plus ? "dcfs_readdirplus" : "dcfs_readdir",
+             ((struct dcfs_dir *)fh->node)->channel.name, NULL);
+  else
+    print_op(plus ? "dcfs_readdirplus" : "dcfs_readdir", NULL, NULL);
+
+  int ret = 0;
+  if (offset == 0 || !fh->entries)
+    ret = snapshot_dir(state, fh);
+
+  /* "." and ".." alone aren't worth a reply */
+  if (ret == 0)
+    ret = extend_snapshot(fh, offset < 2 ? 2 : offset);
+
+  if (ret != 0) {
+    fuse_reply_err(req, -ret);
+    return;
+  }
+
+  char *buf = malloc(size);
+  if (!buf) {
+    fuse_reply_err(req, ENOBUFS);
+    return;
+  }
+
+  size_t pos = 0;
+  for (size_t i = offset; i < fh->entries_n; i++) {
+    struct dcfs_dirent *entry = &fh->entries[i];
+    size_t len;
+
+    if (plus) {
+      struct fuse_entry_param e;
+      init_entry(state, &e);
+      fill_dirent_stat(entry, &e.attr);
+      e.ino = entry->ino;
+
+      len = fuse_add_direntry_plus(req, buf + pos, size - pos, entry->name,
+                                   &e, i + 1);
+      if (len > size - pos)
+        break;
+
+      if (entry->node)
+        dcfs_node_lookup(entry->node);
+
+    } else {
+      struct stat stbuf;
+      memset(&stbuf, 0, sizeof(struct stat));
+      stbuf.st_ino = entry->ino;
+      stbuf.st_mode = entry->mode;
+
+      len = fuse_add_direntry(req, buf + pos, size - pos, entry->name,
+                              &stbuf, i + 1);
+      if (len > size - pos)
+        break;
+    }
+
+    pos += len;
+  }
+
+  fuse_reply_buf(req, buf, pos);
+  free(buf);
+}
+
+static void dcfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                         off_t offset, struct fuse_file_info *fi) {
+  reply_dir(req, size, offset, fi, 0);
+}
+
+static void dcfs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+                             off_t offset, struct fuse_file_info *fi) {
+  reply_dir(req, size, offset, fi, 1);
+}
+
+static void dcfs_releasedir(fuse_req_t req, fuse_ino_t ino,
+                            struct fuse_file_info *fi) {
+  free_handle(get_handle(fi));
+  fuse_reply_err(req, 0);
+}
+
+static void dcfs_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                        mode_t mode, struct fuse_file_info *fi) {
+  struct dcfs_state *state = fuse_req_userdata(req);
+
+  struct dcfs_dir *dir = get_dir_ino(parent);
+  if (!dir) {
+    fuse_reply_err(req, parent == DCFS_ROOT_INO ? EPERM : ENOENT);
+    return;
+  }
+
+  char filename[256];
+  string_normalize(filename, name, sizeof(filename));
+  print_op("dcfs_create", dir->channel.name, filename);
+
+  if (dcfs_dir_lock(dir, 1) != 0) {
+    dcfs_node_put(&dir->node);
+    fuse_reply_err(req, EIO);
+    return;
+  }
+
+  struct dcfs_file *file = dcfs_dir_find(dir, filename);
+  if (file) {
+    dcfs_node_ref(&file->node);
+
+  } else if ((file = dcfs_new_file(dir, filename))) {
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    file->mode = S_IFREG | (mode & 07777);
+    file->uid = ctx->uid;
+    file->gid = ctx->gid;
+    file->ctime = time(NULL);
+    dcfs_dir_add_file(dir, file);
+  }
+
+  dcfs_dir_unlock(dir);
+  dcfs_node_put(&dir->node);
+
+  if (!file) {
+    fuse_reply_err(req, ENOBUFS);
+    return;
+  }
+
+  struct fuse_entry_param e;
+  init_entry(state, &e);
+
+  pthread_mutex_lock(&file->lock);
+  fill_file_stat(file, &e.attr);
+  pthread_mutex_unlock(&file->lock);
+
+  struct dcfs_handle *fh = new_handle(&file->node, fi->flags);
+  if (!fh) {
+    dcfs_node_put(&file->node);
+    fuse_reply_err(req, ENOBUFS);
+    return;
+  }
+
+  pthread_mutex_lock(&file->lock);
+  file->opened++;
+  pthread_mutex_unlock(&file->lock);
+
+  dcfs_node_lookup(&file->node);
+  e.ino = file->node.ino;
+  fi->fh = (uintptr_t)fh;
+
+  /* an interrupted create never gets a release */
+  if (fuse_reply_create(req, &e, fi) != 0) {
+    dcfs_node_forget(e.ino, 1);
+    close_handle(NULL, fh);
+  }
+}
+
+static void dcfs_open(fuse_req_t req, fuse_ino_t ino,
+                      struct fuse_file_info *fi) {
+  struct dcfs_file *file = get_file_ino(ino);
+  if (!file) {
+    fuse_reply_err(req, ino == DCFS_ROOT_INO ? EISDIR : ENOENT);
+    return;
+  }
+
+  print_op("dcfs_open", file->parent->channel.name, file->filename);
 
-    for (size_t offset = 0; offset < dcfs_file->size;
-         offset += MAX_FILESIZE, files_n++) {
+  struct dcfs_handle *fh = new_handle(&file->node, fi->flags);
+  if (!fh) {
+    dcfs_node_put(&file->node);
+    fuse_reply_err(req, ENOBUFS);
+    return;
+  }
 
-      if (files_n > 0 && files_n % 10 == 0) {
-        if ((ret = process_files(dir, dcfs_file, files, 10)) != 0)
-          goto out;
-        memset(&files, 0, sizeof(files));
-      }
+  struct dcfs_state *state = fuse_req_userdata(req);
 
-      struct file *file = &files[files_n % 10];
-      if (offset == 0) {
-        b64encode(file->filename, p->filename, sizeof(file->filename));
-      } else {
-        char tmp_filename[512];
-        snprintf(tmp_filename, sizeof(tmp_filename), "%s.PART%d", p->filename,
-                 files_n);
-        b64encode(file->filename, tmp_filename, sizeof(file->filename));
-      }
+  pthread_mutex_lock(&file->lock);
+  file->opened++;
 
-      file->buffer = dcfs_file->content + offset;
-      size_t remaining = dcfs_file->size - offset;
-      file->buffer_size = remaining < MAX_FILESIZE ? remaining : MAX_FILESIZE;
-    }
+  /* uploaded files never change, so their pages stay valid across opens */
+  fi->keep_cache = state->kernel_cache && file->messages_n;
+  fi->direct_io = state->direct_io_size && file->size >= state->direct_io_size;
+  pthread_mutex_unlock(&file->lock);
 
-    if (files_n > 0) {
-      ret = process_files(dir, dcfs_file, files, files_n % 10);
-    }
-  }
-out:
-  free(dcfs_file->content);
-  dcfs_file->content = NULL;
-  return ret;
+  fi->fh = (uintptr_t)fh;
+  if (fuse_reply_open(req, fi) != 0)
+    close_handle(NULL, fh);
 }
 
-static int delete_file(struct dcfs_dir *dir, struct dcfs_path *p) {
-  struct dcfs_file *file = get_file(dir->files, p);
-  CHECK_NULL(file, ENOENT);
+static void dcfs_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                       size_t size, off_t offset, struct fuse_file_info *fi) {
+  struct dcfs_file *file = (struct dcfs_file *)get_handle(fi)->node;
 
-  struct response resp = {0};
-  dcfs_hash last_deleted_message_id = 0;
+  print_op("dcfs_write", file->parent->channel.name, file->filename);
+  pthread_mutex_lock(&file->lock);
 
-  for (size_t i = 0; i < file->messages_n; i++) {
-    struct dcfs_message *message = file->messages[i];
-    if (string_hash(message->id) != last_deleted_message_id) {
-      discord_delete_messsage(dir->channel.id, message->id, &resp);
-      last_deleted_message_id = string_hash(message->id);
-    }
+  /* uploaded files are immutable, their data would never be sent again */
+  int ret = 0;
+  if (file->messages_n || file->uploading) {
+    ret = EPERM;
+    goto out;
   }
 
-  dcfs_free_file(file);
-  json_array_remove_ptr(&dir->files, file);
+  size_t end = offset + size;
+  if (size && (end > file->size || !file->content)) {
+    size_t new_size = end > file->size ? end : file->size;
+    char *content = realloc(file->content, new_size);
 
-  return 0;
-};
+    if (!content) {
+      print_err("dcfs_write: failed to malloc\n");
+      ret = ENOBUFS;
+      goto out;
+    }
 
-int dcfs_rmdir(const char *path) {
-  if (count_char(path, '/') != 1) {
-    return -EPERM;
-  }
-  struct dcfs_state *state = get_state();
+    if ((size_t)offset > file->size)
+      memset(content + file->size, 0, offset - file->size);
 
-  struct dcfs_path p;
-  dcfs_path_init(path, &p);
-  print_op("dcfs_rmdir", &p);
+    file->content = content;
+    file->size = new_size;
+  }
 
-  struct dcfs_dir *dir;
-  json_array_for_each(state->dirs, dir) {
-    if (STREQ(path + 1, dir->channel.name)) {
-      struct response resp = {0};
-      discord_delete_channel(dir->channel.id, &resp);
+  if (size)
+    memcpy(file->content + offset, buf, size);
 
-      if (resp.http_code != 200) {
-        print_err("failed to delete %s channel. http code: %ld\n",
-                  dir->channel.name, resp.http_code);
-        return -EAGAIN;
-      }
+out:
+  pthread_mutex_unlock(&file->lock);
 
-      discord_free_messages(dir->files);
-      json_array_remove_ptr(&state->dirs, dir);
+  if (ret)
+    fuse_reply_err(req, ret);
+  else
+    fuse_reply_write(req, size);
+}
 
-      return 0;
+/* answers a read the kernel gave up on, a ctrl-c on cat. once no read
+ * waits for the content any more its download stops */
+static void read_interrupted(fuse_req_t req, void *data) {
+  struct dcfs_file *file = data;
+
+  pthread_mutex_lock(&file->lock);
+  struct pending_read *read, *found = NULL;
+  json_array_for_each(file->readers, read) {
+    if (read->req == req) {
+      found = read;
+      break;
     }
   }
-  return -ENOENT;
-}
 
-int dcfs_mkdir(const char *path, mode_t mode) {
-  if (count_char(path, '/') != 1) {
-    return -EPERM;
+  /* otherwise it's been answered already */
+  if (found) {
+    json_array_remove_ptr(&file->readers, found);
+    fuse_reply_err(req, EINTR);
   }
 
-  struct dcfs_state *state = get_state();
+  if (found && file->load && !(file->readers && file->readers->data))
+    request_cancel(&file->load->cancelled);
+  pthread_mutex_unlock(&file->lock);
+}
 
-  struct dcfs_path p;
-  dcfs_path_init(path, &p);
-  print_op("dcfs_mkdir", &p);
+static void dcfs_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                      off_t offset, struct fuse_file_info *fi) {
+  struct dcfs_file *file = (struct dcfs_file *)get_handle(fi)->node;
 
-  struct response resp = {0};
-  discord_create_channel(GUILD_ID, path + 1, &resp);
+  print_op("dcfs_read", file->parent->channel.name, file->filename);
 
-  if (resp.http_code != 201) {
-    print_err("failed to create a new channel. http_code: %ld\n",
-              resp.http_code);
-    return -EAGAIN;
+  /* called right away if the interrupt came first, fuse_req_interrupted
+   * catches that once the lock is held */
+  fuse_req_interrupt_func(req, read_interrupted, file);
+  pthread_mutex_lock(&file->lock);
+
+  if (file->content || !file->messages_n) {
+    reply_read(file, req, size, offset);
+    pthread_mutex_unlock(&file->lock);
+    return;
   }
 
-  json_object *json;
-  json_load(resp.raw, (void **)&json);
-  free(resp.raw);
+  if (fuse_req_interrupted(req)) {
+    pthread_mutex_unlock(&file->lock);
+    fuse_reply_err(req, EINTR);
+    return;
+  }
 
-  json_string id = json_object_get(json, "id");
-  json_string name = json_object_get(json, "name");
-  json_number *type = json_object_get(json, "type");
+  /* wait for the content without holding a worker thread */
+  if (!file->readers)
+    file->readers = json_array_new();
+
+  struct pending_read read = {.req = req, .size = size, .offset = offset};
+  json_array_push(file->readers, &read, sizeof(struct pending_read),
+                  JSON_UNKNOWN);
+
+  /* a cancelled load is on its way out, the read gets a fresh one */
+  struct content_load *load = NULL;
+  if ((!file->load || file->load->cancelled) &&
+      !(load = load_content_async(file))) {
+    json_array_destroy(file->readers);
+    file->readers = NULL;
+    pthread_mutex_unlock(&file->lock);
+    fuse_reply_err(req, ENOBUFS);
+    return;
+  }
 
-  struct dcfs_dir new_dir;
-  memset(&new_dir, 0, sizeof(struct dcfs_dir));
+  pthread_mutex_unlock(&file->lock);
 
-  id_to_ctime(&new_dir.ctime, id);
-  new_dir.mode = mode;
-  new_dir.gid = getgid();
-  new_dir.uid = getuid();
+  if (load)
+    content_load_put(load);
+}
 
-  snprintf(new_dir.channel.id, sizeof(new_dir.channel.id), "%s", id);
-  snprintf(new_dir.channel.name, sizeof(new_dir.channel.name), "%s", name);
-  new_dir.channel.type = *type;
-  new_dir.channel.has_parent = 0;
+/* queues the messages of a file that's no longer listed for deletion. req,
+ * if any, is answered right away, see deleter.h */
+static void delete_file(fuse_req_t req, struct dcfs_file *file) {
+  pthread_mutex_lock(&file->lock);
+  delete_messages(file->parent, file);
+  pthread_mutex_unlock(&file->lock);
 
-  json_array_push(state->dirs, &new_dir, sizeof(struct dcfs_dir), JSON_UNKNOWN);
-  json_object_destroy(json);
+  if (req)
+    fuse_reply_err(req, 0);
+}
 
-  return 0;
-};
+/* drops a file handle. the last close of an unlinked file deletes its
+ * messages and closing a handle opened for writing uploads the file. req,
+ * if any, is answered once that's done */
+static void close_handle(fuse_req_t req, struct dcfs_handle *fh) {
+  struct dcfs_file *file = (struct dcfs_file *)fh->node;
+
+  pthread_mutex_lock(&file->lock);
+  int last = --file->opened == 0;
+  char unlinked = file->unlinked;
+  pthread_mutex_unlock(&file->lock);
+
+  if (unlinked && last)
+    delete_file(req, file);
+  else if (!unlinked && req && (fh->flags & O_ACCMODE) != O_RDONLY)
+    upload_file_async(req, file);
+  else if (req)
+    fuse_reply_err(req, 0);
+
+  free_handle(fh);
+}
 
-#ifdef __APPLE__
-int dcfs_getxattr(const char *path, const char *name, char *value, size_t size,
-                  uint32_t flags) {
-  (void)path;
-  (void)name;
-  (void)value;
-  (void)size;
-  (void)flags;
-  return 0;
+static void dcfs_release(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_file_info *fi) {
+  struct dcfs_handle *fh = get_handle(fi);
+  struct dcfs_file *file = (struct dcfs_file *)fh->node;
+
+  print_op("dcfs_release", file->parent->channel.name, file->filename);
+  close_handle(req, fh);
 }
 
-int dcfs_setxattr(const char *path, const char *name, const char *value,
-                  size_t size, int flags, uint32_t position) {
-  (void)path;
-  (void)name;
-  (void)value;
-  (void)size;
-  (void)flags;
-  (void)position;
-  return 0;
+/* marks a file that just left its listing as unlinked. its messages are
+ * queued for deletion right away unless it's still open, in which case the
+ * last close does it */
+static void unlink_file(fuse_req_t req, struct dcfs_file *file) {
+  pthread_mutex_lock(&file->lock);
+  file->unlinked = 1;
+  int opened = file->opened;
+  pthread_mutex_unlock(&file->lock);
+
+  if (!opened)
+    delete_file(req, file);
+  else if (req)
+    fuse_reply_err(req, 0);
 }
 
-int dcfs_setattr(const char *path, struct fuse_darwin_attr *attr, int to_set,
-                 struct fuse_file_info *_) {
+static void dcfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  struct dcfs_dir *dir = get_dir_ino(parent);
+  if (!dir) {
+    fuse_reply_err(req, parent == DCFS_ROOT_INO ? EPERM : ENOENT);
+    return;
+  }
 
-  struct dcfs_state *state = get_state();
+  char filename[256];
+  string_normalize(filename, name, sizeof(filename));
+  print_op("dcfs_unlink", dir->channel.name, filename);
 
-  struct dcfs_path p;
-  dcfs_path_init(path, &p);
-  print_op("dcfs_chown", &p);
+  if (dcfs_dir_lock(dir, 1) != 0) {
+    dcfs_node_put(&dir->node);
+    fuse_reply_err(req, EIO);
+    return;
+  }
 
-  struct dcfs_dir *dir;
-  struct dcfs_file *file;
+  struct dcfs_file *file = dcfs_dir_find(dir, filename);
+  if (file) {
+    dcfs_node_ref(&file->node);
+    dcfs_dir_remove_file(dir, file);
+  }
+  dcfs_dir_unlock(dir);
+  dcfs_node_put(&dir->node);
 
-  if (*p.dir && !*p.filename) {
-    dir = get_dir(state->dirs, &p);
-    CHECK_NULL(dir, ENOENT);
+  if (!file) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
 
-    dir->gid = attr->gid & to_set ? attr->gid : dir->gid;
-    dir->uid = attr->uid & to_set ? attr->uid : dir->uid;
+  unlink_file(req, file);
+  dcfs_node_put(&file->node);
+}
 
-    if (attr->mode & to_set && S_ISDIR(attr->mode))
-      dir->mode = attr->mode;
+static int rename_dir(struct dcfs_state *state, const char *name,
+                      const char *new_name) {
+  struct dcfs_dir *dir;
+  if (strlen(new_name) >= sizeof(dir->channel.name))
+    return -ENAMETOOLONG;
 
-  } else if (*p.dir && *p.filename) {
-    dir = get_dir(state->dirs, &p);
-    CHECK_NULL(dir, ENOENT);
-    file = get_file(dir->files, &p);
-    CHECK_NULL(file, ENOENT);
+  int ret = 0;
+  pthread_rwlock_wrlock(&state->lock);
 
-    file->gid = attr->gid & to_set ? attr->gid : dir->gid;
-    file->uid = attr->uid & to_set ? attr->uid : dir->uid;
-    if (attr->mode & to_set && S_ISREG(attr->mode))
-      file->mode = attr->mode;
+  dir = get_dir(state, name);
+  if (!dir) {
+    ret = -ENOENT;
+    goto out;
   }
 
-  return 0;
-}
-
-#endif /* __APPLE__ */
+  struct response resp = {0};
+  discord_rename_channel(dir->channel.id, new_name, &resp);
+  if (resp.http_code != 200) {
+    ret = -EAGAIN;
+    goto out;
+  }
 
-#ifdef __APPLE__
-int dcfs_getattr(const char *path, struct fuse_darwin_attr *stbuf,
-                 struct fuse_file_info *_)
-#else
-int dcfs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *_)
-#endif
-{
+  snprintf(dir->channel.name, sizeof(dir->channel.name), "%s", new_name);
+  index_dirs(state);
 
-  struct dcfs_state *state = get_state();
+out:
+  pthread_rwlock_unlock(&state->lock);
+  return ret;
+}
 
-  struct dcfs_path p;
-  dcfs_path_init(path, &p);
-  print_op("dcfs_getattr", &p);
+/* moves the file object itself, so the kernel's inode for it stays valid.
+ * the name of a file is the name of its attachments. within a channel they
+ * are renamed in place, see rename_parts. otherwise, or if that fails, the
+ * data of an uploaded file is copied to messages under the new name before
+ * the old ones are deleted, see copy_parts. the file stays listed under its
+ * old name, and a file it replaces under the new one, until that's done */
+static int rename_file(struct dcfs_state *state, struct dcfs_dir *old_dir,
+                       const char *name, struct dcfs_dir *new_dir,
+                       const char *new_name) {
+  if (old_dir == new_dir && STREQ(name, new_name))
+    return 0;
 
-  memset(stbuf, 0, sizeof(struct stat));
+  /* the target has to be listed before it can be replaced */
+  if (dcfs_dir_lock(new_dir, 0) != 0)
+    return -EIO;
+  dcfs_dir_unlock(new_dir);
+
+  if (dcfs_dir_lock(old_dir, 0) != 0)
+    return -EIO;
+
+  /* a target sharing a message with the file would end up with two
+   * attachments of its name there, its removal would take both */
+  struct dcfs_file *file = dcfs_dir_find(old_dir, name);
+  int in_place = old_dir == new_dir && !dcfs_dir_find(old_dir, new_name);
+  if (file)
+    dcfs_node_ref(&file->node);
+  dcfs_dir_unlock(old_dir);
+
+  if (!file)
+    return -ENOENT;
+
+  struct dcfs_file copy;
+  memset(&copy, 0, sizeof(struct dcfs_file));
+  snprintf(copy.filename, sizeof(copy.filename), "%s", new_name);
+
+  /* a file that isn't uploaded yet only lives here, its upload takes the
+   * new name */
+  int ret = 0, uploaded = 0;
+  pthread_mutex_lock(&file->lock);
+  if (file->uploading)
+    ret = -EBUSY;
+  else if (file->messages_n)
+    file->uploading = uploaded = 1;
+  copy.mode = file->mode;
+  copy.uid = file->uid;
+  copy.gid = file->gid;
+  copy.ctime = file->ctime ? file->ctime : time(NULL);
+  pthread_mutex_unlock(&file->lock);
+
+  int renamed = 0;
+  if (ret == 0 && uploaded) {
+    renamed = in_place && rename_parts(file, &copy) == 0;
+    if (!renamed)
+      ret = copy_parts(state, file, new_dir, &copy);
+  }
 
-  if (STREQ(path, "/")) {
-#ifdef __APPLE__
-    stbuf->mode = S_IFDIR | 0755;
-    stbuf->gid = getgid();
-    stbuf->uid = getuid();
-    id_to_ctime(&stbuf->ctimespec.tv_sec, GUILD_ID);
-    id_to_ctime(&stbuf->mtimespec.tv_sec, GUILD_ID);
-#else
-    stbuf->st_mode = S_IFDIR | 0755;
-    stbuf->st_gid = getgid();
-    stbuf->st_uid = getuid();
-    id_to_ctime(&stbuf->st_ctim.tv_sec, GUILD_ID);
-    id_to_ctime(&stbuf->st_mtim.tv_sec, GUILD_ID);
-#endif /* __APPLE__ */
+  /* it may have been unlinked while the copy went out. within a channel
+   * the lock is held on until the file is listed under the new name */
+  if (ret == 0) {
+    pthread_rwlock_wrlock(&old_dir->lock);
+    if (dcfs_dir_find(old_dir, name) == file)
+      dcfs_dir_remove_file(old_dir, file);
+    else
+      ret = -ENOENT;
+
+    if (ret != 0 || old_dir != new_dir)
+      dcfs_dir_unlock(old_dir);
+  }
 
-  } else if (count_char(path, '/') == 1) {
-    struct dcfs_dir *dir = get_dir(state->dirs, &p);
-    CHECK_NULL(dir, ENOENT);
+  struct dcfs_file *target = NULL;
+  if (ret == 0) {
+    if (old_dir != new_dir)
+      pthread_rwlock_wrlock(&new_dir->lock);
 
-    if (!dir->files)
-      dir->files = dcfs_get_files(dir->channel.id);
+    target = dcfs_dir_find(new_dir, new_name);
+    if (target) {
+      dcfs_node_ref(&target->node);
+      dcfs_dir_remove_file(new_dir, target);
+    }
 
-#ifdef __APPLE__
-    stbuf->mode = dir->mode;
-    stbuf->gid = dir->gid;
-    stbuf->uid = dir->uid;
-    stbuf->ctimespec.tv_sec = dir->ctime;
-    stbuf->mtimespec.tv_sec = dir->ctime;
-    stbuf->atimespec.tv_sec = dir->ctime;
-#else
-    stbuf->st_mode = dir->mode;
-    stbuf->st_gid = dir->gid;
-    stbuf->st_uid = dir->uid;
-    stbuf->st_ctim.tv_sec = dir->ctime;
-    stbuf->st_mtim.tv_sec = dir->ctime;
-    stbuf->st_atim.tv_sec = dir->ctime;
-#endif /* __APPLE__ */
+    pthread_mutex_lock(&file->lock);
+    if (uploaded) {
+      if (renamed)
+        dcfs_dir_changed(new_dir);
+      else
+        delete_messages(old_dir, file);
+      free_parts(file, 0);
+      memcpy(file->messages, copy.messages, sizeof(file->messages));
+      file->messages_n = copy.messages_n;
+      file->ctime = copy.ctime;
+      file->hash = copy.hash;
+      file->uploading = 0;
+    }
+    snprintf(file->filename, sizeof(file->filename), "%s", new_name);
 
-  } else if (count_char(path, '/') == 2) {
-    struct dcfs_dir *dir = get_dir(state->dirs, &p);
-    CHECK_NULL(dir, ENOENT);
-    struct dcfs_file *file = get_file(dir->files, &p);
-    CHECK_NULL(file, ENOENT);
+    if (old_dir != new_dir) {
+      file->parent = new_dir;
+      dcfs_node_ref(&new_dir->node);
+    }
+    pthread_mutex_unlock(&file->lock);
+
+    dcfs_dir_add_file(new_dir, file);
+    dcfs_dir_unlock(new_dir);
+
+    if (old_dir != new_dir)
+      dcfs_node_put(&old_dir->node);
+  } else if (uploaded) {
+    /* the copy of a file unlinked meanwhile goes with it */
+    if (copy.messages_n)
+      delete_messages(new_dir, &copy);
+    free_parts(&copy, 0);
+
+    pthread_mutex_lock(&file->lock);
+    file->uploading = 0;
+    pthread_mutex_unlock(&file->lock);
+  }
 
-#ifdef __APPLE__
-    stbuf->mode = file->mode;
-    stbuf->gid = file->gid;
-    stbuf->uid = file->uid;
-    stbuf->size = file->size;
-    stbuf->ctimespec.tv_sec = file->ctime;
-    stbuf->mtimespec.tv_sec = file->ctime;
-    stbuf->atimespec.tv_sec = file->ctime;
-#else
-    stbuf->st_mode = file->mode;
-    stbuf->st_gid = file->gid;
-    stbuf->st_uid = file->uid;
-    stbuf->st_size = file->size;
-    stbuf->st_ctim.tv_sec = file->ctime;
-    stbuf->st_mtim.tv_sec = file->ctime;
-    stbuf->st_atim.tv_sec = file->ctime;
-#endif /* __APPLE__ */
+  if (target) {
+    unlink_file(NULL, target);
+    dcfs_node_put(&target->node);
   }
 
-  return 0;
+  dcfs_node_put(&file->node);
+  return ret;
 }
 
-#ifdef __APPLE__
-int dcfs_readdir(const char *path, void *buf, fuse_darwin_fill_dir_t filler,
-                 off_t offset, struct fuse_file_info *_,
-                 enum fuse_readdir_flags flags)
-
-#else
-int dcfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                 off_t offset, struct fuse_file_info *_,
-                 enum fuse_readdir_flags flags)
-#endif /* __APPLE__ */
-{
+static void dcfs_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                        fuse_ino_t new_parent, const char *new_name,
+                        unsigned int flags) {
+  if (flags) {
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
 
-  (void)offset;
-  (void)flags;
-  struct dcfs_state *state = get_state();
+  struct dcfs_state *state = fuse_req_userdata(req);
 
-  struct dcfs_path p;
-  dcfs_path_init(path, &p);
-  print_op("dcfs_readdir", &p);
+  char from[256], to[256];
+  string_normalize(from, name, sizeof(from));
+  string_normalize(to, new_name, sizeof(to));
 
-  filler(buf, ".", NULL, 0, FUSE_FILL_DIR_DEFAULTS);
-  filler(buf, "..", NULL, 0, FUSE_FILL_DIR_DEFAULTS);
+  int ret;
+  if (parent == DCFS_ROOT_INO && new_parent == DCFS_ROOT_INO) {
+    print_op("dcfs_rename", from, NULL);
+    print_op("dcfs_rename", to, NULL);
+    ret = rename_dir(state, from, to);
 
-  if (STREQ(path, "/")) {
-    struct dcfs_dir *dir;
-    json_array_for_each(state->dirs, dir) {
-      if (dir->channel.type == GUILD_TEXT && !dir->channel.has_parent) {
-        filler(buf, dir->channel.name, NULL, 0, FUSE_FILL_DIR_DEFAULTS);
-      }
-    }
-  } else {
-    struct dcfs_dir *dir = get_dir(state->dirs, &p);
-    CHECK_NULL(dir, ENOENT);
+  } else if (parent != DCFS_ROOT_INO && new_parent != DCFS_ROOT_INO) {
+    struct dcfs_dir *old_dir = get_dir_ino(parent);
+    struct dcfs_dir *new_dir = get_dir_ino(new_parent);
 
-    struct dcfs_file *file;
-    json_array_for_each(dir->files, file) {
-      filler(buf, file->filename, NULL, 0, FUSE_FILL_DIR_DEFAULTS);
+    if (old_dir && new_dir) {
+      print_op("dcfs_rename", old_dir->channel.name, from);
+      print_op("dcfs_rename", new_dir->channel.name, to);
+      ret = rename_file(state, old_dir, from, new_dir, to);
+    } else {
+      ret = -ENOENT;
     }
+
+    if (old_dir)
+      dcfs_node_put(&old_dir->node);
+    if (new_dir)
+      dcfs_node_put(&new_dir->node);
+
+  } else {
+    ret = -ENOTSUP;
   }
 
-  return 0;
+  fuse_reply_err(req, -ret);
 }
 
-int dcfs_create(const char *path, mode_t mode, struct fuse_file_info *_) {
-  if (count_char(path, '/') != 2) {
-    return -EPERM;
+/* copies an uploaded file into a new one with copy_parts, without the data
+ * going through the kernel or being held whole. only a whole copy into an
+ * empty file is done here, the kernel falls back to reading and writing for
+ * anything else */
+static void dcfs_copy_file_range(fuse_req_t req, fuse_ino_t ino_in,
+                                 off_t off_in, struct fuse_file_info *fi_in,
+                                 fuse_ino_t ino_out, off_t off_out,
+                                 struct fuse_file_info *fi_out, size_t len,
+                                 int flags) {
+  struct dcfs_state *state = fuse_req_userdata(req);
+  struct dcfs_handle *fh_out = get_handle(fi_out);
+  struct dcfs_file *in = (struct dcfs_file *)get_handle(fi_in)->node;
+  struct dcfs_file *out = (struct dcfs_file *)fh_out->node;
+
+  print_op("dcfs_copy_file_range", in->parent->channel.name, in->filename);
+  print_op("dcfs_copy_file_range", out->parent->channel.name, out->filename);
+
+  if (flags) {
+    fuse_reply_err(req, EINVAL);
+    return;
   }
-  struct dcfs_state *state = get_state();
-
-  struct dcfs_path p;
-  dcfs_path_init(path, &p);
-  print_op("dcfs_create", &p);
 
-  struct dcfs_dir *dir = get_dir(state->dirs, &p);
-  CHECK_NULL(dir, ENOENT);
+  if (in == out || off_in != off_out) {
+    fuse_reply_err(req, EOPNOTSUPP);
+    return;
+  }
 
-  struct dcfs_file file;
-  memset(&file, 0, sizeof(file));
-  snprintf(file.filename, sizeof(file.filename), "%s", p.filename);
-  file.mode = mode;
+  char head[64] = {0};
+  pthread_mutex_lock(&in->lock);
+  size_t size = in->size;
+  size_t messages_n = in->messages_n;
+  uint64_t hash = in->hash;
+  int uploaded = in->messages_n && !in->uploading;
+  if (in->messages[0])
+    snprintf(head, sizeof(head), "%s", in->messages[0]->id);
+  pthread_mutex_unlock(&in->lock);
+
+  /* the two locks are never held together, copies both ways at once would
+   * deadlock. both are marked as uploading meanwhile so they're left
+   * alone, in keeps its messages and out gets none from elsewhere */
+  struct dcfs_file copy;
+  memset(&copy, 0, sizeof(struct dcfs_file));
+  struct dcfs_dir *dir = NULL;
+
+  pthread_mutex_lock(&out->lock);
+  int ret = EOPNOTSUPP;
+  if (off_in && *head && out->messages[0] && out->size == size &&
+      out->messages_n == messages_n && (!hash || out->hash == hash) &&
+      STREQ(fh_out->copied_from, head) &&
+      STREQ(fh_out->copied_to, out->messages[0]->id)) {
+    /* copied whole by an earlier call for the start of the range */
+    ret = 0;
+  } else if (uploaded && size && off_in == 0 && !out->messages_n &&
+             !out->uploading && !out->content && !out->size) {
+    snprintf(copy.filename, sizeof(copy.filename), "%s", out->filename);
+    copy.mode = out->mode;
+    copy.uid = out->uid;
+    copy.gid = out->gid;
+    copy.ctime = out->ctime ? out->ctime : time(NULL);
+    dir = out->parent;
+    out->uploading = 1;
+  }
+  pthread_mutex_unlock(&out->lock);
 
-  json_array_push(dir->files, &file, sizeof(struct dcfs_file), JSON_UNKNOWN);
-  return 0;
-}
+  if (dir) {
+    pthread_mutex_lock(&in->lock);
+    int busy = in->uploading || in->messages_n != messages_n;
+    if (!busy)
+      in->uploading = 1;
+    pthread_mutex_unlock(&in->lock);
 
-int dcfs_chown(const char *path, uid_t uid, gid_t gid,
-               struct fuse_file_info *_) {
-  struct dcfs_state *state = get_state();
+    ret = busy ? EOPNOTSUPP : -copy_parts(state, in, dir, &copy);
 
-  struct dcfs_path p;
-  dcfs_path_init(path, &p);
-  print_op("dcfs_chown", &p);
+    if (!busy) {
+      pthread_mutex_lock(&in->lock);
+      in->uploading = 0;
+      pthread_mutex_unlock(&in->lock);
+    }
 
-  struct dcfs_dir *dir;
-  struct dcfs_file *file;
+    pthread_mutex_lock(&out->lock);
+    if (ret == 0) {
+      memcpy(out->messages, copy.messages, sizeof(out->messages));
+      out->messages_n = copy.messages_n;
+      out->size = copy.size;
+      out->ctime = copy.ctime;
+      out->hash = copy.hash;
+      snprintf(fh_out->copied_from, sizeof(fh_out->copied_from), "%s", head);
+      snprintf(fh_out->copied_to, sizeof(fh_out->copied_to), "%s",
+               out->messages[0]->id);
+      dcfs_dir_changed(dir);
+    }
+    out->uploading = 0;
+    pthread_mutex_unlock(&out->lock);
+  }
 
-  if (*p.dir && !*p.filename) {
-    dir = get_dir(state->dirs, &p);
-    CHECK_NULL(dir, ENOENT);
+  if (ret != 0) {
+    fuse_reply_err(req, ret);
+    return;
+  }
 
-    dir->gid = gid;
-    dir->uid = uid;
+  size_t left = (size_t)off_in < size ? size - off_in : 0;
+  fuse_reply_write(req, len < left ? len : left);
+}
 
-  } else if (*p.dir && *p.filename) {
-    dir = get_dir(state->dirs, &p);
-    CHECK_NULL(dir, ENOENT);
-    file = get_file(dir->files, &p);
-    CHECK_NULL(file, ENOENT);
+/* the caller holds state->lock */
+static struct dcfs_dir *get_dir_id(json_array *dirs, const char *id) {
+  struct dcfs_dir *dir;
+  json_array_for_each(dirs, dir) {
+    if (STREQ(dir->channel.id, id))
+      return dir;
+  }
+  return NULL;
+}
 
-    file->gid = gid;
-    file->uid = uid;
+static struct dcfs_channel *get_channel(json_array *channels, const char *id) {
+  struct dcfs_channel *channel;
+  json_array_for_each(channels, channel) {
+    if (STREQ(channel->id, id))
+      return channel;
   }
+  return NULL;
+}
 
-  return 0;
-};
+/* brings the dirs in line with the guild's channels. dirs are matched by
+ * channel id, so their inodes survive renames made elsewhere */
+static void sync_dirs(struct dcfs_state *state, json_array *changes) {
+  json_array *channels = discord_get_channels(GUILD_ID);
+  if (!channels)
+    return;
 
-int dcfs_chmod(const char *path, mode_t mode, struct fuse_file_info *_) {
-  struct dcfs_state *state = get_state();
+  json_array *gone = json_array_new();
+  assert(gone);
 
-  struct dcfs_path p;
-  dcfs_path_init(path, &p);
-  print_op("dcfs_chown", &p);
+  pthread_rwlock_wrlock(&state->lock);
 
   struct dcfs_dir *dir;
-  struct dcfs_file *file;
+  json_array *node = state->dirs;
+  while (node && node->data) {
+    dir = node->data;
+    node = node->next;
+
+    if (!get_channel(channels, dir->channel.id)) {
+      json_array_detach_ptr(&state->dirs, dir);
+      json_array_push(gone, dir, 0, JSON_UNKNOWN);
+      dcfs_add_change(changes, DCFS_ROOT_INO, dir->node.ino,
+                      dir->channel.name);
+    }
+  }
 
-  if (*p.dir && !*p.filename) {
-    dir = get_dir(state->dirs, &p);
-    CHECK_NULL(dir, ENOENT);
+  struct dcfs_channel *channel;
+  json_array_for_each(channels, channel) {
+    dir = get_dir_id(state->dirs, channel->id);
+    if (!dir) {
+      dir = dcfs_new_dir(state->dirs, channel);
+      if (dir)
+        dcfs_add_change(changes, DCFS_ROOT_INO, 0, dir->channel.name);
+      continue;
+    }
 
-    if (S_ISREG(mode))
-      return -ENOTSUP;
+    if (!STREQ(dir->channel.name, channel->name)) {
+      dcfs_add_change(changes, DCFS_ROOT_INO, 0, dir->channel.name);
+      dcfs_add_change(changes, DCFS_ROOT_INO, 0, channel->name);
+      snprintf(dir->channel.name, sizeof(dir->channel.name), "%s",
+               channel->name);
+    }
+    dir->channel.type = channel->type;
+    dir->channel.has_parent = channel->has_parent;
+  }
 
-    dir->mode = mode;
+  index_dirs(state);
+  pthread_rwlock_unlock(&state->lock);
 
-  } else if (*p.dir && *p.filename) {
-    dir = get_dir(state->dirs, &p);
-    CHECK_NULL(dir, ENOENT);
-    file = get_file(dir->files, &p);
-    CHECK_NULL(file, ENOENT);
+  /* the rest is guarded by the dir locks */
+  pthread_rwlock_rdlock(&state->lock);
+  json_array_for_each(state->dirs, dir) {
+    channel = get_channel(channels, dir->channel.id);
+    if (!channel || !*channel->last_message_id)
+      continue;
+
+    pthread_rwlock_wrlock(&dir->lock);
+    if (!STREQ(dir->channel.last_message_id, channel->last_message_id)) {
+      snprintf(dir->channel.last_message_id,
+               sizeof(dir->channel.last_message_id), "%s",
+               channel->last_message_id);
+      id_to_ctime(&dir->mtime, channel->last_message_id);
+      dcfs_add_change(changes, 0, dir->node.ino, NULL);
+
+      /* new messages, refresh on this round */
+      dir->ttl = 0;
+    }
+    dcfs_dir_unlock(dir);
+  }
+  pthread_rwlock_unlock(&state->lock);
 
-    if (S_ISDIR(mode))
-      return -ENOTSUP;
+  /* deleted elsewhere, drop them the way dcfs_rmdir does */
+  json_array_for_each(gone, dir) {
+    pthread_rwlock_wrlock(&dir->lock);
+    while (dir->files && dir->files->data)
+      dcfs_dir_remove_file(dir, dir->files->data);
+    dcfs_dir_unlock(dir);
 
-    file->mode = mode;
+    dcfs_node_put(&dir->node);
   }
 
-  return 0;
-};
+  json_array_destroy(gone);
+  discord_free_channels(channels);
+}
 
-int dcfs_write(const char *path, const char *buf, size_t size, off_t offset,
-               struct fuse_file_info *_) {
+/* picks up new files in every listed dir whose ttl is up, and deleted ones
+ * in every listed dir if prune is set. a dir that didn't change waits twice
+ * as long next time, up to refresh_max_ttl. dirs nobody has listed yet are
+ * left for their first readdir */
+static void sync_files(struct dcfs_state *state, json_array *changes,
+                       int prune) {
+  json_array *due = json_array_new();
+  assert(due);
 
-  struct dcfs_state *state = get_state();
+  time_t now = time(NULL);
 
-  struct dcfs_path p;
-  dcfs_path_init(path, &p);
-  print_op("dcfs_write", &p);
+  struct dcfs_dir *dir;
+  pthread_rwlock_rdlock(&state->lock);
+  json_array_for_each(state->dirs, dir) {
+    pthread_rwlock_rdlock(&dir->lock);
+    if (dir->loaded && (prune || now >= dir->refreshed + dir->ttl)) {
+      dcfs_node_ref(&dir->node);
+      json_array_push(due, dir, 0, JSON_UNKNOWN);
+    }
+    dcfs_dir_unlock(dir);
+  }
+  pthread_rwlock_unlock(&state->lock);
 
-  struct dcfs_dir *dir = get_dir(state->dirs, &p);
-  CHECK_NULL(dir, ENOENT);
-  struct dcfs_file *file = get_file(dir->files, &p);
-  CHECK_NULL(file, ENOENT);
+  json_array_for_each(due, dir) {
+    int changes_n = json_array_size(changes);
 
-  file->size += size;
+    if (dcfs_dir_refresh(dir, changes) != 0 ||
+        (prune && dcfs_dir_prune(dir, changes) != 0))
+      print_warn("failed to sync %s\n", dir->channel.name);
 
-  if (!file->content) {
-    file->content = malloc(size);
+    if (json_array_size(changes) != changes_n || !dir->ttl)
+      dir->ttl = state->refresh_ttl;
+    else if (dir->ttl < state->refresh_max_ttl)
+      dir->ttl *= 2;
+    if (dir->ttl > state->refresh_max_ttl)
+      dir->ttl = state->refresh_max_ttl;
+    dir->refreshed = now;
 
-    if (!file->content) {
-      print_err("dcfs_write: failed to malloc\n");
-      return -ENOBUFS;
-    }
-  } else {
-    file->content = realloc(file->content, file->size);
+    dcfs_node_put(&dir->node);
   }
 
-  if (offset < file->size) {
-    if (offset + size > file->size) {
-      size = file->size - offset;
-    }
+  json_array_destroy(due);
+}
 
-    memcpy(file->content + offset, buf, size);
+/* tells the kernel to drop what it cached about changes. this must not be
+ * called with any lock held, the kernel may call back into the daemon */
+static void notify_changes(struct dcfs_state *state, json_array *changes) {
+  struct dcfs_change *change;
+  json_array_for_each(changes, change) {
+    if (*change->name)
+      fuse_lowlevel_notify_inval_entry(state->se, change->parent, change->name,
+                                       strlen(change->name));
+    if (change->ino)
+      fuse_lowlevel_notify_inval_inode(state->se, change->ino, 0, 0);
+  }
+}
 
-  } else {
-    size = 0;
+/* saves the manifests of the dirs that changed since their last one */
+static void save_manifests(struct dcfs_state *state) {
+  json_array *dirs = json_array_new();
+  assert(dirs);
+
+  struct dcfs_dir *dir;
+  pthread_rwlock_rdlock(&state->lock);
+  json_array_for_each(state->dirs, dir) {
+    dcfs_node_ref(&dir->node);
+    json_array_push(dirs, dir, 0, JSON_UNKNOWN);
   }
+  pthread_rwlock_unlock(&state->lock);
 
-  return size;
-}
+  json_array_for_each(dirs, dir) {
+    dcfs_manifest_save(dir);
+    dcfs_node_put(&dir->node);
+  }
 
-int dcfs_read(const char *path, char *buf, size_t size, off_t offset,
-              struct fuse_file_info *_) {
-  struct dcfs_state *state = get_state();
+  json_array_destroy(dirs);
+}
 
-  struct dcfs_path p;
-  dcfs_path_init(path, &p);
-  print_op("dcfs_read", &p);
+static void save_snapshot(struct dcfs_state *state) {
+  if (!state->snapshot)
+    return;
 
-  struct dcfs_dir *dir = get_dir(state->dirs, &p);
-  CHECK_NULL(dir, ENOENT);
-  struct dcfs_file *file = get_file(dir->files, &p);
-  CHECK_NULL(file, ENOENT);
+  pthread_rwlock_rdlock(&state->lock);
+  dcfs_snapshot_save(state->snapshot, GUILD_ID, state->dirs);
+  pthread_rwlock_unlock(&state->lock);
+}
 
-  // size_t part_size = file->size;
-  // int part_n = offset / part_size;
+/* checks a snapshot loaded at mount against the server right away, then
+ * syncs every refresh_ttl seconds until sync_stop. looking for deleted
+ * files costs a walk of every channel, that's only done every
+ * prune_interval seconds, and the snapshot is saved every
+ * snapshot_interval seconds */
+static void *sync_run(void *data) {
+  struct dcfs_state *state = data;
+  time_t pruned = time(NULL);
+  time_t saved = pruned;
+
+  pthread_mutex_lock(&state->sync_lock);
+  for (;;) {
+    if (!state->stale) {
+      if (!state->refresh_ttl)
+        break;
+
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += state->refresh_ttl;
+
+      while (!state->sync_stop &&
+             pthread_cond_timedwait(&state->sync_cond, &state->sync_lock,
+                                    &deadline) != ETIMEDOUT)
+        ;
+    }
 
-  if (!file->content) {
-    struct response resp = {0};
-    off_t content_offset = 0;
+    if (state->sync_stop)
+      break;
+    pthread_mutex_unlock(&state->sync_lock);
 
-    for (size_t i = 0; i < file->messages_n; i++) {
-      struct dcfs_message *part = file->messages[i];
+    time_t now = time(NULL);
+    int prune = state->stale || now - pruned >= state->prune_interval;
+    if (prune)
+      pruned = now;
 
-      resp = (struct response){0};
-      request_get(part->url, &resp, 0);
+    json_array *changes = json_array_new();
+    assert(changes);
 
-      if (i == 0)
-        file->content = malloc(resp.size);
-      else {
-        file->content = realloc(file->content, file->size + resp.size);
-      }
+    sync_dirs(state, changes);
+    sync_files(state, changes, prune);
+    notify_changes(state, changes);
+    json_array_destroy(changes);
+    save_manifests(state);
 
-      print_inf("%s %d\n", file->filename, file->size);
-      memcpy(file->content + content_offset, resp.raw, resp.size);
-      part->content = resp.raw;
-      content_offset += resp.size;
+    if (state->stale ||
+        (state->snapshot_interval && now - saved >= state->snapshot_interval)) {
+      save_snapshot(state);
+      saved = now;
     }
+
+    pthread_mutex_lock(&state->sync_lock);
+    state->stale = 0;
   }
+  pthread_mutex_unlock(&state->sync_lock);
 
-  if (offset < file->size) {
-    if (offset + size > file->size) {
-      size = file->size - offset;
-    }
+  return NULL;
+}
 
-    memcpy(buf, file->content + offset, size);
+static void sync_start(struct dcfs_state *state) {
+  if (!state->stale && !state->refresh_ttl)
+    return;
 
-  } else {
-    size = 0;
+  if (pthread_create(&state->sync_thread, NULL, sync_run, state) != 0) {
+    print_warn("failed to start the background sync\n");
+    return;
   }
 
-  return size;
+  state->sync_started = 1;
 }
 
-int dcfs_release(const char *path, struct fuse_file_info *_) {
-  struct dcfs_state *state = get_state();
-
-  struct dcfs_path p;
-  dcfs_path_init(path, &p);
-  print_op("dcfs_release", &p);
+static void sync_stop(struct dcfs_state *state) {
+  if (!state->sync_started)
+    return;
 
-  struct dcfs_dir *dir = get_dir(state->dirs, &p);
-  CHECK_NULL(dir, ENOENT);
+  pthread_mutex_lock(&state->sync_lock);
+  state->sync_stop = 1;
+  pthread_cond_signal(&state->sync_cond);
+  pthread_mutex_unlock(&state->sync_lock);
 
-  return upload_file(dir, &p);
+  pthread_join(state->sync_thread, NULL);
+  state->sync_started = 0;
 }
 
-int dcfs_unlink(const char *path) {
-  struct dcfs_state *state = get_state();
+/* whether -o warm asked for the dir. the caller holds state->lock */
+static int warm_wanted(struct dcfs_state *state, struct dcfs_dir *dir) {
+  if (state->warm_all)
+    return 1;
+  if (!state->warm)
+    return 0;
 
-  struct dcfs_path p;
-  dcfs_path_init(path, &p);
-  print_op("dcfs_unlink", &p);
+  size_t len = strlen(dir->channel.name);
+  for (const char *name = state->warm; name; name = strchr(name, ':')) {
+    if (*name == ':')
+      name++;
+    if (strncmp(name, dir->channel.name, len) == 0 &&
+        (name[len] == ':' || !name[len]))
+      return 1;
+  }
+  return 0;
+}
 
-  struct dcfs_dir *dir = get_dir(state->dirs, &p);
-  CHECK_NULL(dir, ENOENT);
+/* loads the listing a page at a time, so lookups in the dir get a turn
+ * between pages */
+static void warm_dir(struct dcfs_state *state, struct dcfs_dir *dir) {
+  while (!__atomic_load_n(&state->warm_stop, __ATOMIC_RELAXED)) {
+    pthread_rwlock_wrlock(&dir->lock);
+    int done = dir->loaded || dcfs_dir_load_page(dir) != 0 || dir->loaded;
+    dcfs_dir_unlock(dir);
 
-  return delete_file(dir, &p);
+    if (done)
+      return;
+  }
 }
 
-int dcfs_rename(const char *from, const char *to, unsigned int flags) {
-  if (flags)
-    return -EINVAL;
+static void *warm_run(void *data) {
+  struct dcfs_state *state = data;
 
-  int ret = 0;
-  struct dcfs_state *state = get_state();
-
-  struct dcfs_path p_from;
-  dcfs_path_init(from, &p_from);
-  struct dcfs_dir *old_dir = get_dir(state->dirs, &p_from);
-  CHECK_NULL(old_dir, ENOENT);
+  for (;;) {
+    pthread_mutex_lock(&state->warm_lock);
+    struct dcfs_dir *dir = state->warm_queue->data;
+    if (dir)
+      json_array_detach_ptr(&state->warm_queue, dir);
+    pthread_mutex_unlock(&state->warm_lock);
 
-  struct dcfs_path p_to;
-  dcfs_path_init(to, &p_to);
-  struct dcfs_dir *new_dir = get_dir(state->dirs, &p_to);
+    if (!dir)
+      break;
 
-  print_op("dcfs_rename", &p_from);
-  print_op("dcfs_rename", &p_to);
+    warm_dir(state, dir);
+    dcfs_node_put(&dir->node);
+  }
 
-  if (*p_from.dir && !*p_from.filename && *p_to.dir && !*p_to.filename) {
-    struct response resp = {0};
-    discord_rename_channel(old_dir->channel.id, p_to.dir, &resp);
-    if (resp.http_code != 200)
-      return -EAGAIN;
+  return NULL;
+}
 
-    snprintf(old_dir->channel.name, sizeof(old_dir->channel.name), "%s",
-             p_to.dir);
+/* crawls the dirs asked for with -o warm on warm_threads threads, so the
+ * first walk over the mount doesn't wait on the network. rate limits are
+ * handled by the request layer */
+static void warm_start(struct dcfs_state *state) {
+  if (!state->warm_all && !state->warm)
+    return;
 
-  } else if (*p_from.dir && *p_from.filename && *p_to.dir && *p_to.filename) {
-    if (STREQ(p_from.dir, p_to.dir))
-      return -ENOSYS;
+  state->warm_queue = json_array_new();
+  assert(state->warm_queue);
 
-    if (!old_dir || !new_dir)
-      return -ENOENT;
+  struct dcfs_dir *dir;
+  pthread_rwlock_rdlock(&state->lock);
+  json_array_for_each(state->dirs, dir) {
+    if (!warm_wanted(state, dir))
+      continue;
 
-    struct dcfs_file new_file;
-    memset(&new_file, 0, sizeof(new_file));
+    dcfs_node_ref(&dir->node);
+    json_array_push(state->warm_queue, dir, 0, JSON_UNKNOWN);
+  }
+  pthread_rwlock_unlock(&state->lock);
 
-    snprintf(new_file.filename, sizeof(new_file.filename), "%s", p_to.filename);
+  size_t threads_n = json_array_size(state->warm_queue);
+  if (threads_n > state->warm_threads)
+    threads_n = state->warm_threads;
+  if (!threads_n)
+    return;
 
-    struct dcfs_file *old_file = get_file(old_dir->files, &p_from);
-    CHECK_NULL(old_file, ENOENT);
+  state->warm_pool = calloc(threads_n, sizeof(pthread_t));
+  assert(state->warm_pool);
 
-    for (size_t i = 0; i < old_file->messages_n; i++) {
-    }
-    new_file.content = malloc(old_file->size);
-    if (!new_file.content) {
-      print_err("dcfs_rename: failed to malloc\n");
-      return -ENOBUFS;
+  for (size_t i = 0; i < threads_n; i++) {
+    if (pthread_create(&state->warm_pool[i], NULL, warm_run, state) != 0) {
+      print_warn("failed to start a warm thread\n");
+      break;
     }
+    state->warm_pool_n++;
+  }
+}
 
-    int offset = 0;
-    int bytes_read = 0;
-    while ((bytes_read = dcfs_read(from, new_file.content + offset, 4096,
-                                   offset, NULL)) > 0)
-      offset += bytes_read;
-    ;
-    new_file.size = old_file->size;
-    new_file.mode = old_file->mode;
-    new_file.gid = old_file->gid;
-    new_file.uid = old_file->uid;
+static void warm_stop(struct dcfs_state *state) {
+  __atomic_store_n(&state->warm_stop, 1, __ATOMIC_RELAXED);
 
-    if ((ret = delete_file(old_dir, &p_from)) != 0)
-      return -EAGAIN;
+  for (size_t i = 0; i < state->warm_pool_n; i++)
+    pthread_join(state->warm_pool[i], NULL);
 
-    json_array_remove_ptr(&old_dir->files, old_file);
-    json_array_push(new_dir->files, &new_file, sizeof(struct dcfs_file),
-                    JSON_UNKNOWN);
+  struct dcfs_dir *dir;
+  json_array_for_each(state->warm_queue, dir) dcfs_node_put(&dir->node);
+  json_array_destroy(state->warm_queue);
+  state->warm_queue = NULL;
 
-    ret = upload_file(new_dir, &p_to);
+  free(state->warm_pool);
+  state->warm_pool = NULL;
+  state->warm_pool_n = 0;
+}
 
-  } else {
-    ret = -ENOTSUP;
-  }
+static void dcfs_init(void *userdata, struct fuse_conn_info *conn) {
+  struct dcfs_state *state = userdata;
 
-  return ret;
+  /* libfuse clamps these to what the kernel and its buffers allow */
+  conn->max_write = state->max_write;
+  if (state->max_readahead && state->max_readahead < conn->max_readahead)
+    conn->max_readahead = state->max_readahead;
+
+  fuse_set_feature_flag(conn, FUSE_CAP_ASYNC_READ);
+  fuse_set_feature_flag(conn, FUSE_CAP_READDIRPLUS);
+
+  if (state->writeback_cache &&
+      !fuse_set_feature_flag(conn, FUSE_CAP_WRITEBACK_CACHE))
+    print_warn("the kernel doesn't support writeback caching\n");
+
+  if (state->splice) {
+    fuse_set_feature_flag(conn, FUSE_CAP_SPLICE_READ);
+    fuse_set_feature_flag(conn, FUSE_CAP_SPLICE_WRITE);
+    fuse_set_feature_flag(conn, FUSE_CAP_SPLICE_MOVE);
+  }
 }
 
+static const struct fuse_lowlevel_ops operations = {
+    .init = dcfs_init,
+    .lookup = dcfs_lookup,
+    .forget = dcfs_forget,
+    .forget_multi = dcfs_forget_multi,
+    .getattr = dcfs_getattr,
+    .setattr = dcfs_setattr,
+    .opendir = dcfs_opendir,
+    .readdir = dcfs_readdir,
+    .readdirplus = dcfs_readdirplus,
+    .releasedir = dcfs_releasedir,
+    .mkdir = dcfs_mkdir,
+    .rmdir = dcfs_rmdir,
+    .create = dcfs_create,
+    .open = dcfs_open,
+    .unlink = dcfs_unlink,
+    .read = dcfs_read,
+    .write = dcfs_write,
+    .release = dcfs_release,
+    .rename = dcfs_rename,
+    .copy_file_range = dcfs_copy_file_range,
+#ifdef __APPLE__
+    .getxattr = dcfs_getxattr,
+    .setxattr = dcfs_setxattr,
+#endif /* __APPLE__ */
+};
+
 int main(int argc, char *argv[]) {
-  int res;
-  struct fuse *fuse;
+  int res = 1;
   struct fuse_session *se;
   struct stat stbuf;
   struct fuse_cmdline_opts opts;
@@ -751,106 +3607,189 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  struct fuse_operations operations = {
-      .readdir = dcfs_readdir,
-      .mkdir = dcfs_mkdir,
-      .rmdir = dcfs_rmdir,
-      .getattr = dcfs_getattr,
-      .create = dcfs_create,
-      .unlink = dcfs_unlink,
-      .chown = dcfs_chown,
-      .chmod = dcfs_chmod,
-      .read = dcfs_read,
-      .write = dcfs_write,
-      .release = dcfs_release,
-      .rename = dcfs_rename,
-#ifdef __APPLE__
-      .getxattr = dcfs_getxattr,
-      .setxattr = dcfs_setxattr,
-      .setattr = dcfs_setattr,
-#endif /* __APPLE__ */
-
+  struct dcfs_state state = {
+      .lock = PTHREAD_RWLOCK_INITIALIZER,
+      .attr_timeout = 1.0,
+      .entry_timeout = 1.0,
+      .negative_timeout = 1.0,
+      .max_write = 1024 * 1024,
+      .writeback_cache = 1,
+      .splice = 1,
+      .kernel_cache = 1,
+      .snapshot_interval = 300,
+      .prune_interval = 3600,
+      .refresh_ttl = 30,
+      .refresh_max_ttl = 600,
+      .warm_threads = 4,
+      .crawl_threads = 4,
+      .batch_window = 100,
+      .inline_size = 512,
+      .connect_timeout = 10,
+      .stall_timeout = 30,
+      .request_timeout = 300,
+      .hedge = 95,
+      .batch_lock = PTHREAD_MUTEX_INITIALIZER,
+      .batch_cond = PTHREAD_COND_INITIALIZER,
+      .resume_lock = PTHREAD_MUTEX_INITIALIZER,
+      .resume_cond = PTHREAD_COND_INITIALIZER,
+      .warm_lock = PTHREAD_MUTEX_INITIALIZER,
+      .sync_lock = PTHREAD_MUTEX_INITIALIZER,
+      .sync_cond = PTHREAD_COND_INITIALIZER,
   };
 
   struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-  if (fuse_parse_cmdline(&args, &opts) != 0)
+  if (fuse_opt_parse(&args, &state, dcfs_opts, NULL) != 0)
+    return 1;
+
+  if (fuse_parse_cmdline(&args, &opts) != 0) {
+    fuse_opt_free_args(&args);
     return 1;
+  }
 
   if (opts.show_help) {
-    fuse_lib_help(&args);
-    return 0;
+    printf("usage: %s [options] <mountpoint>\n\n", program_name);
+    dcfs_opts_help();
+    fuse_cmdline_help();
+    fuse_lowlevel_help();
+    res = 0;
+    goto out4;
+  }
+
+  if (opts.show_version) {
+    fuse_lowlevel_version();
+    res = 0;
+    goto out4;
   }
 
   if (!opts.mountpoint) {
     print_err("missing mountpoint parameter\n");
-    return 1;
+    goto out4;
   }
 
   if (stat(opts.mountpoint, &stbuf) == -1) {
     print_err("failed to access mountpoint %s: %s\n", opts.mountpoint,
               strerror(errno));
-    free(opts.mountpoint);
-    return 1;
+    goto out4;
   }
 
-  if ((res = fuse_daemonize(opts.foreground)) == -1) {
-    print_err("failed to fuse_daemonize\n");
+  if (curl_global_init(CURL_GLOBAL_ALL) != 0) {
+    print_err("failed to curl_global_init\n");
     goto out4;
   }
 
-  struct dcfs_state state = {0};
-  fuse = fuse_new(&args, &operations, sizeof(struct fuse_operations), &state);
-  se = fuse_get_session(fuse);
+  dcfs_manifest_enable(!state.no_manifest);
+  dcfs_set_crawl_threads(state.crawl_threads);
+  request_set_timeouts(state.connect_timeout, state.stall_timeout,
+                       state.request_timeout);
+  request_set_hedge(state.hedge);
+
+  if (state.inline_size > DISCORD_INLINE_MAX) {
+    print_warn("inline_size is at most %d\n", DISCORD_INLINE_MAX);
+    state.inline_size = DISCORD_INLINE_MAX;
+  }
+
+  if (state.no_snapshot) {
+    free(state.snapshot);
+    state.snapshot = NULL;
+  } else if (!state.snapshot) {
+    state.snapshot = dcfs_snapshot_path(GUILD_ID);
+  }
+
+  /* mount from the snapshot if there's one, the background sync catches up
+   * with the server */
+  if (state.snapshot)
+    state.dirs = dcfs_snapshot_load(state.snapshot, GUILD_ID);
+  state.stale = state.dirs != NULL;
+
+  if (!state.dirs)
+    state.dirs = dcfs_get_dirs(GUILD_ID);
+  if (!state.dirs) {
+    print_err("failed to get dirs\n");
+    goto out3;
+  }
+  index_dirs(&state);
 
-  if ((res = fuse_set_signal_handlers(se)) != 0)
+  se = fuse_session_new(&args, &operations, sizeof(operations), &state);
+  if (!se) {
+    print_err("failed to fuse_session_new\n");
     goto out3;
+  }
+  state.se = se;
 
-  char *real_mountpoint = realpath(opts.mountpoint, NULL);
-  if ((res = fuse_mount(fuse, real_mountpoint)) != 0) {
-    print_err("failed to fuse_mount\n");
+  if (fuse_set_signal_handlers(se) != 0)
     goto out2;
+
+  if (fuse_session_mount(se, opts.mountpoint) != 0) {
+    print_err("failed to fuse_session_mount\n");
+    goto out1;
   }
 
-  if ((res = fcntl(fuse_session_fd(se), F_SETFD, FD_CLOEXEC)) == -1) {
+  if (fcntl(fuse_session_fd(se), F_SETFD, FD_CLOEXEC) == -1) {
     perror("fcntl");
     print_warn("failed to set FD_CLOEXEC on fuse device\n");
   };
 
-  if ((res = curl_global_init(CURL_GLOBAL_ALL)) != 0) {
-    print_err("failed to curl_global_init\n");
-    goto out1;
-  }
+  fuse_daemonize(opts.foreground);
 
-  state.dirs = dcfs_get_dirs(GUILD_ID);
-  if (!state.dirs) {
-    print_err("failed to get dirs\n");
-    goto out1;
-  }
+  /* threads don't survive the fork in fuse_daemonize, start them after */
+  if (request_loop_start() != 0) {
+    print_err("failed to start the request loop\n");
+  } else {
+    sync_start(&state);
+    warm_start(&state);
+    batch_start(&state);
+
+    /* deletions left by the last mount go out first */
+    char *journal = dcfs_cache_path(GUILD_ID, "deletes");
+    if (dcfs_deleter_start(journal) != 0)
+      print_warn("failed to start deleting in the background\n");
+    free(journal);
+
+    /* so do uploads it didn't finish */
+    resume_start(&state);
+
+    if (opts.singlethread)
+      res = fuse_session_loop(se);
+    else {
+      struct fuse_loop_config *config = fuse_loop_cfg_create();
+      fuse_loop_cfg_set_clone_fd(config, opts.clone_fd);
+      fuse_loop_cfg_set_max_threads(config, opts.max_threads);
+      res = fuse_session_loop_mt(se, config);
+      fuse_loop_cfg_destroy(config);
+    }
 
-  if (opts.singlethread)
-    res = fuse_session_loop(se);
-  else {
-    struct fuse_loop_config *config = fuse_loop_cfg_create();
-    fuse_loop_cfg_set_clone_fd(config, opts.clone_fd);
-    fuse_loop_cfg_set_max_threads(config, opts.max_threads);
-    res = fuse_session_loop_mt(se, config);
+    batch_stop(&state);
+    resume_stop(&state);
+    warm_stop(&state);
+    sync_stop(&state);
+    dcfs_deleter_stop();
   }
 
+  /* answers whatever is still waiting on the network before the session
+   * goes away */
+  request_loop_stop();
+  fuse_session_unmount(se);
+
 out1:
-  curl_global_cleanup();
-  fuse_unmount(fuse);
   fuse_remove_signal_handlers(se);
 
 out2:
-  free(real_mountpoint);
+  fuse_session_destroy(se);
 
 out3:
+  request_loop_stop();
+  if (state.dirs) {
+    save_manifests(&state);
+    save_snapshot(&state);
+  }
   dcfs_free_dirs(state.dirs);
-  fuse_destroy(fuse);
+  curl_global_cleanup();
 
 out4:
+  free(state.snapshot);
+  free(state.warm);
   fuse_opt_free_args(&args);
   free(opts.mountpoint);
 
-  return res;
+  return res ? 1 : 0;
 }
@@ -0,0 +1,329 @@
+#include "deleter.h"
+#include "util.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+/* how long a deletion that failed for now waits before it's tried again */
+#define RETRY_DELAY 30
+/* how long the first deletion waits for others in milliseconds, so an rm -r
+ * goes out in bulk */
+#define GATHER_DELAY 100
+
+struct deletion {
+  char channel_id[64];
+  char message_id[64];
+  /* empty to delete the whole message */
+  char filename[256];
+  char done;
+  /* part of a bulk delete that failed, it goes on its own */
+  char alone;
+};
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t thread;
+  json_array *queue;
+  char *journal;
+  FILE *fp;
+  /* set once discord refused a bulk delete, messages go one at a time */
+  char no_bulk;
+  char started;
+  char stop;
+} deleter = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* the caller holds deleter.lock */
+static void journal_append(FILE *fp, const struct deletion *deletion) {
+  char encoded[512] = "-";
+  if (*deletion->filename)
+    b64encode(encoded, deletion->filename, sizeof(encoded));
+
+  fprintf(fp, "%s %s %s\n", deletion->channel_id, deletion->message_id,
+          encoded);
+}
+
+/* writes the journal again with what's left in the queue. the caller holds
+ * deleter.lock */
+static void journal_save() {
+  if (!deleter.journal)
+    return;
+
+  if (deleter.fp)
+    fclose(deleter.fp);
+  deleter.fp = NULL;
+
+  char tmp_path[4096];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", deleter.journal);
+
+  FILE *fp = fopen(tmp_path, "w");
+  if (!fp) {
+    print_warn("failed to open %s: %s\n", tmp_path, strerror(errno));
+    return;
+  }
+
+  struct deletion *deletion;
+  json_array_for_each(deleter.queue, deletion) journal_append(fp, deletion);
+
+  if (fclose(fp) != 0 || rename(tmp_path, deleter.journal) != 0) {
+    print_warn("failed to save %s: %s\n", deleter.journal, strerror(errno));
+    unlink(tmp_path);
+  }
+
+  deleter.fp = fopen(deleter.journal, "a");
+}
+
+static void journal_load(const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return;
+
+  char line[1024];
+  while (fgets(line, sizeof(line), fp)) {
+    struct deletion deletion;
+    memset(&deletion, 0, sizeof(struct deletion));
+
+    char encoded[512];
+    if (sscanf(line, "%63s %63s %511s", deletion.channel_id,
+               deletion.message_id, encoded) != 3)
+      continue;
+
+    if (!STREQ(encoded, "-") &&
+        b64decode(deletion.filename, encoded, sizeof(deletion.filename)) != 0)
+      continue;
+
+    json_array_push(deleter.queue, &deletion, sizeof(struct deletion),
+                    JSON_UNKNOWN);
+  }
+
+  fclose(fp);
+}
+
+void dcfs_deleter_add(const char *channel_id, const char *message_id,
+                      const char *filename) {
+  struct deletion deletion;
+  memset(&deletion, 0, sizeof(struct deletion));
+  snprintf(deletion.channel_id, sizeof(deletion.channel_id), "%s",
+           channel_id);
+  snprintf(deletion.message_id, sizeof(deletion.message_id), "%s",
+           message_id);
+  if (filename)
+    snprintf(deletion.filename, sizeof(deletion.filename), "%s", filename);
+
+  pthread_mutex_lock(&deleter.lock);
+  if (!deleter.queue)
+    deleter.queue = json_array_new();
+  json_array_push(deleter.queue, &deletion, sizeof(struct deletion),
+                  JSON_UNKNOWN);
+
+  if (deleter.fp) {
+    journal_append(deleter.fp, &deletion);
+    fflush(deleter.fp);
+  }
+
+  pthread_cond_signal(&deleter.cond);
+  pthread_mutex_unlock(&deleter.lock);
+}
+
+/* whether a deletion is worth trying again later */
+static inline int transient(long http_code) {
+  return http_code == 0 || http_code == 429 || http_code >= 500;
+}
+
+/* deletes deletion along with the other whole messages of its channel in
+ * pending that discord takes in bulk. returns 0 if they're all gone */
+static int bulk_delete(struct deletion *deletion, json_array *pending) {
+  char ids[DISCORD_BULK_DELETE_MAX][64];
+  struct deletion *found[DISCORD_BULK_DELETE_MAX];
+  size_t ids_n = 0;
+  time_t now = time(NULL);
+
+  struct deletion *other;
+  json_array_for_each(pending, other) {
+    if (ids_n == DISCORD_BULK_DELETE_MAX)
+      break;
+    if (other->done || other->alone || *other->filename ||
+        !STREQ(other->channel_id, deletion->channel_id))
+      continue;
+
+    /* with an hour to spare, and a message listed twice would fail it */
+    time_t posted;
+    id_to_ctime(&posted, other->message_id);
+    if (now - posted > DISCORD_BULK_DELETE_AGE - 3600)
+      continue;
+
+    size_t i = 0;
+    while (i < ids_n && !STREQ(ids[i], other->message_id))
+      i++;
+    if (i < ids_n)
+      continue;
+
+    snprintf(ids[ids_n], sizeof(ids[0]), "%s", other->message_id);
+    found[ids_n++] = other;
+  }
+
+  if (ids_n < 2)
+    return 1;
+
+  struct response resp = {0};
+  discord_bulk_delete(deletion->channel_id, ids, ids_n, &resp);
+  if (resp.http_code == 403)
+    deleter.no_bulk = 1;
+
+  for (size_t i = 0; i < ids_n; i++) {
+    if (resp.http_code == 204)
+      found[i]->done = 1;
+    else
+      found[i]->alone = 1;
+  }
+  return resp.http_code == 204 ? 0 : 1;
+}
+
+/* returns 0 once the deletion is done with, 1 if it's worth another try */
+static int delete_one(struct deletion *deletion) {
+  struct response resp = {0};
+  if (*deletion->filename)
+    discord_remove_attachments(deletion->channel_id, deletion->message_id,
+                               deletion->filename, &resp);
+  else
+    discord_delete_messsage(deletion->channel_id, deletion->message_id,
+                            &resp);
+
+  if (transient(resp.http_code))
+    return 1;
+
+  /* already gone is as good as deleted */
+  if (resp.http_code != 200 && resp.http_code != 204 &&
+      resp.http_code != 404)
+    print_warn("failed to delete message %s. http code: %ld\n",
+               deletion->message_id, resp.http_code);
+  return 0;
+}
+
+/* works through what was taken off the queue. whatever failed for now, or
+ * wasn't reached before a stop, goes into failed */
+static void delete_pending(json_array *pending, json_array *failed) {
+  struct deletion *deletion;
+  json_array_for_each(pending, deletion) {
+    if (deletion->done)
+      continue;
+
+    int ret = 1;
+    if (!__atomic_load_n(&deleter.stop, __ATOMIC_RELAXED)) {
+      if (!*deletion->filename && !deletion->alone && !deleter.no_bulk &&
+          bulk_delete(deletion, pending) == 0)
+        continue;
+      ret = delete_one(deletion);
+    }
+
+    deletion->done = 1;
+    if (ret != 0)
+      json_array_push(failed, deletion, sizeof(struct deletion),
+                      JSON_UNKNOWN);
+  }
+}
+
+/* waits on deleter.cond until stop or ms milliseconds have passed. the
+ * caller holds deleter.lock */
+static void wait_for(long ms) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += ms / 1000;
+  deadline.tv_nsec += (ms % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  while (!deleter.stop && pthread_cond_timedwait(&deleter.cond, &deleter.lock,
+                                                 &deadline) != ETIMEDOUT)
+    ;
+}
+
+static void *deleter_run(void *data) {
+  pthread_mutex_lock(&deleter.lock);
+  for (;;) {
+    while (!deleter.stop && !deleter.queue->data)
+      pthread_cond_wait(&deleter.cond, &deleter.lock);
+
+    wait_for(GATHER_DELAY);
+    if (deleter.stop)
+      break;
+
+    json_array *pending = deleter.queue;
+    deleter.queue = json_array_new();
+    pthread_mutex_unlock(&deleter.lock);
+
+    json_array *failed = json_array_new();
+    delete_pending(pending, failed);
+    json_array_destroy(pending);
+
+    pthread_mutex_lock(&deleter.lock);
+    struct deletion *deletion;
+    json_array_for_each(failed, deletion) {
+      deletion->done = 0;
+      deletion->alone = 0;
+      json_array_push(deleter.queue, deletion, sizeof(struct deletion),
+                      JSON_UNKNOWN);
+    }
+    journal_save();
+
+    /* the server is having trouble, give it a while */
+    if (failed->data)
+      wait_for(RETRY_DELAY * 1000L);
+    json_array_destroy(failed);
+  }
+  pthread_mutex_unlock(&deleter.lock);
+
+  return NULL;
+}
+
+/* picks up the deletions left in journal by the last mount, if any, and
+ * starts deleting. journal may be NULL to keep the queue in memory only */
+int dcfs_deleter_start(const char *journal) {
+  pthread_mutex_lock(&deleter.lock);
+  deleter.stop = 0;
+  if (!deleter.queue)
+    deleter.queue = json_array_new();
+
+  if (journal) {
+    deleter.journal = strdup(journal);
+    journal_load(journal);
+    journal_save();
+  }
+  pthread_mutex_unlock(&deleter.lock);
+
+  if (pthread_create(&deleter.thread, NULL, deleter_run, NULL) != 0)
+    return 1;
+
+  deleter.started = 1;
+  return 0;
+}
+
+/* the deletions still queued stay in the journal for the next mount */
+void dcfs_deleter_stop() {
+  pthread_mutex_lock(&deleter.lock);
+  deleter.stop = 1;
+  pthread_cond_signal(&deleter.cond);
+  pthread_mutex_unlock(&deleter.lock);
+
+  if (deleter.started)
+    pthread_join(deleter.thread, NULL);
+  deleter.started = 0;
+
+  pthread_mutex_lock(&deleter.lock);
+  if (deleter.fp)
+    fclose(deleter.fp);
+  deleter.fp = NULL;
+
+  free(deleter.journal);
+  deleter.journal = NULL;
+  json_array_destroy(deleter.queue);
+  deleter.queue = NULL;
+  pthread_mutex_unlock(&deleter.lock);
+}
@@ -0,0 +1,21 @@
+#ifndef DCFS_DELETER_H
+#define DCFS_DELETER_H
+
+#include "fs.h"
+
+/* the messages of deleted files are queued and deleted in the background,
+ * so unlink returns without waiting on the server. one thread works through
+ * the queue a request at a time, which keeps it within the rate limits, and
+ * deletes the messages of a channel in bulk where discord allows it. the
+ * queue is journaled one line per message
+ *
+ *   <channel id> <message id> <base64 filename or ->
+ *
+ * and whatever is left at unmount goes out at the next mount. a filename
+ * means only the attachments of that file go, the message may hold others */
+void dcfs_deleter_add(const char *channel_id, const char *message_id,
+                      const char *filename);
+int dcfs_deleter_start(const char *journal);
+void dcfs_deleter_stop();
+
+#endif
@@ -15,92 +15,478 @@ void discord_free_messages(json_array *messages) {
   json_array_destroy(messages);
 }
 
-json_array *discord_get_messages(const char *channel_id) {
-  json_array *messages = json_array_new();
+/* the length of the record at record, and where the next one starts */
+static size_t record_len(const char *record, const char **next) {
+  const char *end = strchr(record, DISCORD_META_SEPARATOR);
+  *next = end ? end + 1 : NULL;
+  return end ? (size_t)(end - record) : strlen(record);
+}
+
+static inline int is_inline(const char *record) {
+  return strncmp(record, DISCORD_INLINE_PREFIX,
+                 strlen(DISCORD_INLINE_PREFIX)) == 0;
+}
+
+/* reads the inline record of len characters at record into message, whose
+ * url holds the data. returns 0 if it is one */
+static int parse_inline(const char *record, size_t len,
+                        struct dcfs_message *message) {
+  size_t prefix_len = strlen(DISCORD_INLINE_PREFIX);
+  if (!is_inline(record) || len >= DISCORD_META_SIZE)
+    return 1;
+
+  char fields[DISCORD_META_SIZE];
+  memcpy(fields, record + prefix_len, len - prefix_len);
+  fields[len - prefix_len] = 0;
+
+  char *data = strchr(fields, ' ');
+  char *rest = data ? strchr(data + 1, ' ') : NULL;
+  if (!rest)
+    return 1;
+  *data++ = 0;
+  *rest++ = 0;
+
+  char content[DISCORD_META_SIZE];
+  snprintf(content, sizeof(content), "%s%s", DISCORD_META_PREFIX, rest);
+
+  struct discord_meta meta;
+  if (discord_parse_meta(content, &meta) != 0 || meta.parts_n != 1 ||
+      strlen(data) != (meta.size * 4 + 2) / 3)
+    return 1;
+
+  memset(message->filename, 0, sizeof(message->filename));
+  if (b64decode(message->filename, fields, sizeof(message->filename)) != 0)
+    return 1;
+
+  size_t url_size = strlen(DISCORD_INLINE_URL) + strlen(data) + 1;
+  message->url = malloc(url_size);
+  assert(message->url);
+  snprintf(message->url, url_size, "%s%s", DISCORD_INLINE_URL, data);
+
+  message->content = strdup(content);
+  message->size = meta.size;
+  return 0;
+}
+
+/* fetches one page of up to DISCORD_PAGE_SIZE messages older than
+ * page->before or newer than page->after, or the newest ones if neither is
+ * set. returns the attachments found in it and stores the ids of the newest
+ * and oldest messages in the page and how many messages it had. a short
+ * page is the last one */
+json_array *discord_get_messages_page(const char *channel_id,
+                                      struct discord_page *page) {
+  char new_url[DISCORD_SIZE];
+  if (page->after) {
+    snprintf(new_url, DISCORD_SIZE, "%s/%s/%s/%s?limit=%d&after=%s",
+             DISCORD_API_BASE_URL, "channels", channel_id, "messages",
+             DISCORD_PAGE_SIZE, page->after);
+
+  } else if (page->before) {
+    snprintf(new_url, DISCORD_SIZE, "%s/%s/%s/%s?limit=%d&before=%s",
+             DISCORD_API_BASE_URL, "channels", channel_id, "messages",
+             DISCORD_PAGE_SIZE, page->before);
+
+  } else {
+    snprintf(new_url, DISCORD_SIZE, "%s/%s/%s/%s?limit=%d",
+             DISCORD_API_BASE_URL, "channels", channel_id, "messages",
+             DISCORD_PAGE_SIZE);
+  }
 
-  int messages_n = -1;
   struct response resp = {0};
+  request_get(new_url, &resp, 1);
+  if (resp.http_code != 200 && resp.http_code != 201) {
+    json_object *error = NULL;
+    json_load(resp.raw, (void **)&error);
 
-  while (messages_n == -1 || messages_n == 100) {
-    if (resp.raw) {
-      free(resp.raw);
-      resp.raw = NULL;
+    if (error) {
+      json_string error_message = json_object_get(error, "message");
+      fprintf(stderr, "ERROR: %s\n", error_message);
+      json_object_destroy(error);
     }
 
-    char new_url[DISCORD_SIZE];
-    if (messages_n == -1) {
-      snprintf(new_url, DISCORD_SIZE, "%s/%s/%s/%s?limit=100",
-               DISCORD_API_BASE_URL, "channels", channel_id, "messages");
+    free(resp.raw);
+    return NULL;
+  }
 
-    } else {
-      int idx = json_array_size(messages) - 1;
-      struct dcfs_message *last_message = json_array_get(messages, idx);
-
-      if (!last_message) {
-        printf("WARNING: no message found at index %d\n", idx);
-        free(resp.raw);
-        json_array_destroy(messages);
-        return NULL;
+  json_array *json = NULL;
+  json_load(resp.raw, (void **)&json);
+  free(resp.raw);
+
+  if (!json)
+    return NULL;
+
+  json_array *messages = json_array_new();
+  page->messages_n = json_array_size(json);
+  *page->first_id = 0;
+  *page->last_id = 0;
+
+  json_object *o;
+  json_array_for_each(json, o) {
+    json_string message_id = json_object_get(o, "id");
+    json_string content = json_object_get_type(o, "content", JSON_STRING);
+    const char *record = content;
+
+    /* pages come newest first, but don't count on it for after= */
+    if (!*page->first_id || id_cmp(message_id, page->first_id) > 0)
+      snprintf(page->first_id, sizeof(page->first_id), "%s", message_id);
+    if (!*page->last_id || id_cmp(message_id, page->last_id) < 0)
+      snprintf(page->last_id, sizeof(page->last_id), "%s", message_id);
+
+    /* inline files come first, they have no attachment */
+    while (record && is_inline(record)) {
+      const char *next;
+      size_t len = record_len(record, &next);
+
+      struct dcfs_message message;
+      memset(&message, 0, sizeof(struct dcfs_message));
+      snprintf(message.id, sizeof(message.id), "%s", message_id);
+
+      if (parse_inline(record, len, &message) == 0)
+        json_array_push(messages, &message, sizeof(struct dcfs_message),
+                        JSON_UNKNOWN);
+      record = next;
+    }
+
+    json_object *attachment;
+    json_array *attachments = json_object_get(o, "attachments");
+    json_array_for_each(attachments, attachment) {
+      struct dcfs_message message;
+      memset(&message, 0, sizeof(struct dcfs_message));
+
+      json_string filename = json_object_get(attachment, "filename");
+      json_number *size = json_object_get(attachment, "size");
+      json_string url = json_object_get(attachment, "url");
+
+      if (STREQ(filename, DISCORD_MANIFEST_NAME))
+        continue;
+
+      snprintf(message.id, sizeof(message.id), "%s", message_id);
+      b64decode(message.filename, filename, sizeof(message.filename));
+
+      message.size = *size;
+      message.url = strdup(url);
+
+      /* the records line up with the attachments. the parts of a file
+       * posted along with its head have none */
+      if (record) {
+        const char *next;
+        size_t len = record_len(record, &next);
+        if (strncmp(record, DISCORD_META_PREFIX,
+                    strlen(DISCORD_META_PREFIX)) == 0)
+          message.content = strndup(record, len);
+        record = next;
       }
 
-      snprintf(new_url, DISCORD_SIZE, "%s/%s/%s/%s?limit=100&before=%s",
-               DISCORD_API_BASE_URL, "channels", channel_id, "messages",
-               last_message->id);
+      json_array_push(messages, &message, sizeof(struct dcfs_message),
+                      JSON_UNKNOWN);
     }
+  }
 
-    request_get(new_url, &resp, 1);
-    if (resp.http_code != 200 && resp.http_code != 201) {
-      json_object *error;
-      json_load(resp.raw, (void **)&error);
+  json_array_destroy(json);
+  return messages;
+}
 
-      json_string error_message = json_object_get(error, "message");
-      fprintf(stderr, "ERROR: %s\n", error_message);
+json_array *discord_get_messages(const char *channel_id) {
+  json_array *messages = json_array_new();
 
-      free(resp.raw);
-      json_array_destroy(messages);
-      json_object_destroy(error);
+  struct discord_page page;
+  memset(&page, 0, sizeof(struct discord_page));
+  page.messages_n = DISCORD_PAGE_SIZE;
+
+  char before[sizeof(page.last_id)];
+  while (page.messages_n == DISCORD_PAGE_SIZE) {
+    json_array *found = discord_get_messages_page(channel_id, &page);
+    if (!found) {
+      discord_free_messages(messages);
       return NULL;
     }
 
-    json_array *json = NULL;
-    json_load(resp.raw, (void **)&json);
-    free(resp.raw);
+    struct dcfs_message *message;
+    json_array_for_each(found, message) json_array_push(
+        messages, message, sizeof(struct dcfs_message), JSON_UNKNOWN);
+    json_array_destroy(found);
 
-    if (!json) {
-      json_array_destroy(messages);
-      return NULL;
+    snprintf(before, sizeof(before), "%s", page.last_id);
+    page.before = before;
+  }
+
+  return messages;
+}
+
+int discord_format_meta(char *out, size_t out_size,
+                        const struct discord_meta *meta) {
+  int len = snprintf(out, out_size, "%s%llu %u %llu %o %u %u %lld %016llx",
+                     DISCORD_META_PREFIX, (unsigned long long)meta->size,
+                     meta->parts_n, (unsigned long long)meta->part_size,
+                     meta->mode, meta->uid, meta->gid, (long long)meta->mtime,
+                     (unsigned long long)meta->hash);
+
+  for (unsigned int i = 0; i < meta->ids_n; i++) {
+    if (len < 0 || len >= (int)out_size)
+      break;
+    len += snprintf(out + len, out_size - len, " %s", meta->ids[i]);
+  }
+
+  return len < 0 || len >= (int)out_size ? 1 : 0;
+}
+
+/* returns 0 if content is the metadata of a file */
+int discord_parse_meta(const char *content, struct discord_meta *meta) {
+  memset(meta, 0, sizeof(struct discord_meta));
+
+  size_t prefix_len = strlen(DISCORD_META_PREFIX);
+  if (strncmp(content, DISCORD_META_PREFIX, prefix_len) != 0)
+    return 1;
+
+  unsigned long long size, part_size, hash;
+  long long mtime;
+  int len = 0;
+  if (sscanf(content + prefix_len, "%llu %u %llu %o %u %u %lld %llx%n", &size,
+             &meta->parts_n, &part_size, &meta->mode, &meta->uid, &meta->gid,
+             &mtime, &hash, &len) != 8)
+    return 1;
+
+  if (meta->parts_n == 0 || meta->parts_n > DISCORD_MAX_PARTS ||
+      part_size == 0 || size > part_size * meta->parts_n)
+    return 1;
+
+  meta->size = size;
+  meta->part_size = part_size;
+  meta->mtime = mtime;
+  meta->hash = hash;
+
+  content += prefix_len + len;
+  size_t ids_max = sizeof(meta->ids) / sizeof(meta->ids[0]);
+  while (meta->ids_n < ids_max &&
+         sscanf(content, " %63[0-9]%n", meta->ids[meta->ids_n], &len) == 1) {
+    meta->ids_n++;
+    content += len;
+  }
+
+  return 0;
+}
+
+int discord_format_inline(char *out, size_t out_size, const char *filename,
+                          const char *data, const struct discord_meta *meta) {
+  char name[512] = {0};
+  char encoded[DISCORD_META_SIZE] = {0};
+  char fields[DISCORD_META_SIZE];
+  if (meta->size > DISCORD_INLINE_MAX ||
+      b64encode(name, filename, sizeof(name)) != 0 ||
+      b64encode_n(encoded, data, meta->size, sizeof(encoded)) != 0 ||
+      discord_format_meta(fields, sizeof(fields), meta) != 0)
+    return 1;
+
+  int len = snprintf(out, out_size, "%s%s %s %s", DISCORD_INLINE_PREFIX, name,
+                     encoded, fields + strlen(DISCORD_META_PREFIX));
+  return len < 0 || len >= (int)out_size ? 1 : 0;
+}
+
+/* returns the url holding the data of filename if content has it inline,
+ * or NULL */
+char *discord_inline_url(const char *content, const char *filename) {
+  const char *record = content;
+  while (record && is_inline(record)) {
+    const char *next;
+    size_t len = record_len(record, &next);
+
+    struct dcfs_message message;
+    memset(&message, 0, sizeof(struct dcfs_message));
+    if (parse_inline(record, len, &message) == 0) {
+      free(message.content);
+      if (STREQ(message.filename, filename))
+        return message.url;
+      free(message.url);
     }
+    record = next;
+  }
 
-    messages_n = json_array_size(json);
+  return NULL;
+}
 
-    json_object *o;
-    json_array_for_each(json, o) {
-      json_string message_id = json_object_get(o, "id");
+/* decodes the data behind an inline url as if it had been downloaded.
+ * returns 1 if url isn't one */
+int discord_inline_content(const char *url, struct response *resp) {
+  size_t prefix_len = strlen(DISCORD_INLINE_URL);
+  if (strncmp(url, DISCORD_INLINE_URL, prefix_len) != 0)
+    return 1;
+
+  const char *data = url + prefix_len;
+  size_t size = strlen(data) * 3 / 4;
+  char *raw = malloc(size + 3);
+  if (!raw || b64decode(raw, data, size + 3) != 0) {
+    free(raw);
+    return 1;
+  }
 
-      json_object *attachment;
-      json_array *attachments = json_object_get(o, "attachments");
-      json_array_for_each(attachments, attachment) {
-        struct dcfs_message message;
-        memset(&message, 0, sizeof(struct dcfs_message));
+  resp->raw = raw;
+  resp->size = size;
+  resp->http_code = 200;
+  return 0;
+}
 
-        json_string filename = json_object_get(attachment, "filename");
-        json_number *size = json_object_get(attachment, "size");
-        json_string url = json_object_get(attachment, "url");
+/* returns the url of the attachment called filename in a message fetched
+ * from the api, or NULL. attachment urls expire, this is how a fresh one is
+ * found */
+char *discord_attachment_url(const char *raw, const char *filename) {
+  json_object *message = NULL;
+  json_load(raw, (void **)&message);
+  if (!message)
+    return NULL;
 
-        snprintf(message.id, sizeof(message.id), "%s", message_id);
-        b64decode(message.filename, filename, sizeof(message.filename));
+  char *res = NULL;
+
+  json_object *attachment;
+  json_array *attachments = json_object_get(message, "attachments");
+  json_array_for_each(attachments, attachment) {
+    json_string encoded = json_object_get(attachment, "filename");
+    json_string url = json_object_get(attachment, "url");
+    if (!encoded || !url)
+      continue;
+
+    char decoded[256] = {0};
+    b64decode(decoded, encoded, sizeof(decoded));
+    if (STREQ(decoded, filename)) {
+      res = strdup(url);
+      break;
+    }
+  }
 
-        message.size = *size;
-        message.url = strdup(url);
+  json_string content = json_object_get_type(message, "content", JSON_STRING);
+  if (!res && content)
+    res = discord_inline_url(content, filename);
 
-        json_array_push(messages, &message, sizeof(struct dcfs_message),
-                        JSON_UNKNOWN);
-      }
+  json_object_destroy(message);
+  return res;
+}
+
+char *discord_get_attachment_url(const char *channel_id,
+                                 const char *message_id,
+                                 const char *filename) {
+  char new_url[DISCORD_SIZE];
+  snprintf(new_url, DISCORD_SIZE, "%s/%s/%s/%s/%s", DISCORD_API_BASE_URL,
+           "channels", channel_id, "messages", message_id);
+
+  struct response resp = {0};
+  request_get(new_url, &resp, 1);
+
+  char *res = NULL;
+  if (resp.http_code == 200)
+    res = discord_attachment_url(resp.raw, filename);
+
+  free(resp.raw);
+  return res;
+}
+
+int discord_get_message_async(const char *channel_id, const char *message_id,
+                              request_cb cb, void *data) {
+  char new_url[DISCORD_SIZE];
+  snprintf(new_url, DISCORD_SIZE, "%s/%s/%s/%s/%s", DISCORD_API_BASE_URL,
+           "channels", channel_id, "messages", message_id);
+
+  return request_get_async(new_url, 1, cb, data);
+}
+
+/* returns the pinned manifests of the channel. there's normally one, but
+ * two clients saving at once may leave more */
+json_array *discord_get_manifests(const char *channel_id) {
+  char new_url[DISCORD_SIZE];
+  snprintf(new_url, DISCORD_SIZE, "%s/%s/%s/%s", DISCORD_API_BASE_URL,
+           "channels", channel_id, "pins");
+
+  struct response resp = {0};
+  request_get(new_url, &resp, 1);
+  if (resp.http_code != 200) {
+    free(resp.raw);
+    return NULL;
+  }
+
+  json_array *json = NULL;
+  json_load(resp.raw, (void **)&json);
+  free(resp.raw);
+
+  if (!json)
+    return NULL;
+
+  json_array *manifests = json_array_new();
+
+  json_object *o;
+  json_array_for_each(json, o) {
+    json_string message_id = json_object_get(o, "id");
+
+    json_object *attachment;
+    json_array *attachments = json_object_get(o, "attachments");
+    json_array_for_each(attachments, attachment) {
+      json_string filename = json_object_get(attachment, "filename");
+      json_number *size = json_object_get(attachment, "size");
+      json_string url = json_object_get(attachment, "url");
+      if (!filename || !url || !STREQ(filename, DISCORD_MANIFEST_NAME))
+        continue;
+
+      struct dcfs_message message;
+      memset(&message, 0, sizeof(struct dcfs_message));
+      snprintf(message.id, sizeof(message.id), "%s", message_id);
+      snprintf(message.filename, sizeof(message.filename), "%s", filename);
+      message.size = size ? *size : 0;
+      message.url = strdup(url);
+
+      json_array_push(manifests, &message, sizeof(struct dcfs_message),
+                      JSON_UNKNOWN);
     }
-    json_array_destroy(json);
   }
 
-  return messages;
+  json_array_destroy(json);
+  return manifests;
+}
+
+/* posts a manifest and pins it. stores the id of its message */
+int discord_post_manifest(const char *channel_id, char *content, size_t size,
+                          char *message_id, size_t message_id_size) {
+  struct file file;
+  memset(&file, 0, sizeof(struct file));
+  snprintf(file.filename, sizeof(file.filename), "%s", DISCORD_MANIFEST_NAME);
+  file.buffer = content;
+  file.buffer_size = size;
+
+  struct response resp = {0};
+  discord_create_attachments(channel_id, &file, 1, NULL, &resp);
+  if (resp.http_code != 200) {
+    print_err("failed to post the manifest of %s. http code: %ld\n",
+              channel_id, resp.http_code);
+    free(resp.raw);
+    return 1;
+  }
+
+  json_object *json = NULL;
+  json_load(resp.raw, (void **)&json);
+  free(resp.raw);
+
+  json_string id = json ? json_object_get(json, "id") : NULL;
+  if (!id) {
+    if (json)
+      json_object_destroy(json);
+    return 1;
+  }
+
+  snprintf(message_id, message_id_size, "%s", id);
+  json_object_destroy(json);
+
+  char new_url[DISCORD_SIZE];
+  snprintf(new_url, DISCORD_SIZE, "%s/%s/%s/%s/%s", DISCORD_API_BASE_URL,
+           "channels", channel_id, "pins", message_id);
+
+  memset(&resp, 0, sizeof(struct response));
+  request_put(new_url, "", &resp, 1);
+  free(resp.raw);
+
+  if (resp.http_code != 204) {
+    print_err("failed to pin the manifest of %s. http code: %ld\n",
+              channel_id, resp.http_code);
+    discord_delete_messsage(channel_id, message_id, &resp);
+    return 1;
+  }
+
+  return 0;
 }
 
 json_array *discord_get_channels(const char *guild_id) {
@@ -139,6 +525,8 @@ json_array *discord_get_channels(const char *guild_id) {
     json_string name = json_object_get(o, "name");
     json_number *type = json_object_get(o, "type");
     json_word *parent = json_object_get(o, "parent_id");
+    json_string last_message_id =
+        json_object_get_type(o, "last_message_id", JSON_STRING);
 
     struct dcfs_channel channel;
     memset(&channel, 0, sizeof(struct dcfs_channel));
@@ -148,6 +536,9 @@ json_array *discord_get_channels(const char *guild_id) {
 
     channel.type = *type;
     channel.has_parent = *parent == JSON_NULL ? 0 : 1;
+    if (last_message_id)
+      snprintf(channel.last_message_id, sizeof(channel.last_message_id), "%s",
+               last_message_id);
 
     json_array_push(channels, &channel, sizeof(struct dcfs_channel),
                     JSON_UNKNOWN);
@@ -209,20 +600,384 @@ int discord_delete_channel(const char *channel_id, struct response *resp) {
   return res;
 }
 
+/* content is plain text without anything json would need escaped, or NULL
+ * for a message with only the files */
+static void content_payload(char *out, size_t out_size, const char *content) {
+  snprintf(out, out_size, "{\"content\": \"%s\"}", content);
+}
+
 int discord_create_attachments(const char *channel_id, const struct file *files,
-                               size_t files_n, struct response *resp) {
+                               size_t files_n, const char *content,
+                               struct response *resp) {
   int res = 0;
 
   char new_url[DISCORD_SIZE];
   snprintf(new_url, DISCORD_SIZE, "%s/%s/%s/%s", DISCORD_API_BASE_URL,
            "channels", channel_id, "messages");
 
-  if (request_post_files(new_url, files, files_n, resp) != 0)
+  char payload[DISCORD_META_SIZE + 32];
+  if (content)
+    content_payload(payload, sizeof(payload), content);
+
+  if (request_post_files(new_url, files, files_n, content ? payload : NULL,
+                         resp) != 0)
     res = 1;
 
   return res;
 }
 
+int discord_create_attachments_async(const char *channel_id,
+                                     const struct file *files, size_t files_n,
+                                     const char *content, request_cb cb,
+                                     void *data) {
+  char new_url[DISCORD_SIZE];
+  snprintf(new_url, DISCORD_SIZE, "%s/%s/%s/%s", DISCORD_API_BASE_URL,
+           "channels", channel_id, "messages");
+
+  char payload[DISCORD_META_SIZE + 32];
+  if (content)
+    content_payload(payload, sizeof(payload), content);
+
+  return request_post_files_async(new_url, files, files_n,
+                                  content ? payload : NULL, cb, data);
+}
+
+/* whether an attachment is filename or one of its parts */
+static int owned_by(const char *decoded, const char *filename) {
+  size_t len = strlen(filename);
+  return strncmp(decoded, filename, len) == 0 &&
+         (!decoded[len] || strncmp(decoded + len, ".PART", 5) == 0);
+}
+
+/* builds the edit that takes the attachments of filename out of a message
+ * fetched from the api, along with their records. returns 1 if other
+ * files are left, 0 if the message can go and -1 if raw isn't a message */
+static int removal_payload(const char *raw, const char *filename, char *out,
+                           size_t out_size) {
+  json_object *message = NULL;
+  json_load(raw, (void **)&message);
+  if (!message)
+    return -1;
+
+  json_string content = json_object_get_type(message, "content", JSON_STRING);
+  const char *record = content;
+
+  char records[DISCORD_META_SIZE + 1] = {0};
+  char ids[DISCORD_SIZE * 4] = {0};
+  size_t records_len = 0, ids_len = 0;
+  int records_n = 0, ids_n = 0;
+
+  while (record && is_inline(record)) {
+    const char *next;
+    int len = record_len(record, &next);
+
+    struct dcfs_message inlined;
+    memset(&inlined, 0, sizeof(struct dcfs_message));
+    int owned = parse_inline(record, len, &inlined) == 0 &&
+                STREQ(inlined.filename, filename);
+    free(inlined.url);
+    free(inlined.content);
+
+    if (!owned)
+      records_len +=
+          snprintf(records + records_len, sizeof(records) - records_len,
+                   "%s%.*s", records_n++ ? ";" : "", len, record);
+    record = next;
+
+    if (records_len >= sizeof(records)) {
+      json_object_destroy(message);
+      return -1;
+    }
+  }
+
+  json_object *attachment;
+  json_array *attachments = json_object_get(message, "attachments");
+  json_array_for_each(attachments, attachment) {
+    json_string id = json_object_get(attachment, "id");
+    json_string encoded = json_object_get(attachment, "filename");
+
+    const char *next = NULL;
+    int len = record ? (int)record_len(record, &next) : 0;
+
+    char decoded[256] = {0};
+    b64decode(decoded, encoded ? encoded : "", sizeof(decoded));
+    if (!id || owned_by(decoded, filename)) {
+      record = next;
+      continue;
+    }
+
+    ids_len +=
+        snprintf(ids + ids_len, sizeof(ids) - ids_len, "%s{\"id\": \"%s\"}",
+                 ids_n++ ? ", " : "", id);
+    if (record)
+      records_len +=
+          snprintf(records + records_len, sizeof(records) - records_len,
+                   "%s%.*s", records_n++ ? ";" : "", len, record);
+    record = next;
+
+    if (ids_len >= sizeof(ids) || records_len >= sizeof(records))
+      break;
+  }
+
+  json_object_destroy(message);
+  if (ids_len >= sizeof(ids) || records_len >= sizeof(records))
+    return -1;
+  if (!ids_n && !records_n)
+    return 0;
+
+  snprintf(out, out_size, "{\"content\": \"%s\", \"attachments\": [%s]}",
+           records, ids);
+  return 1;
+}
+
+/* a message may hold several small files, so one of them is removed by
+ * editing the others back in. the message is only deleted with the last */
+int discord_remove_attachments(const char *channel_id, const char *message_id,
+                               const char *filename, struct response *resp) {
+  char new_url[DISCORD_SIZE];
+  snprintf(new_url, DISCORD_SIZE, "%s/%s/%s/%s/%s", DISCORD_API_BASE_URL,
+           "channels", channel_id, "messages", message_id);
+
+  struct response message = {0};
+  request_get(new_url, &message, 1);
+
+  /* already gone */
+  if (message.http_code == 404) {
+    free(message.raw);
+    resp->http_code = 204;
+    return 0;
+  }
+
+  char payload[DISCORD_META_SIZE + DISCORD_SIZE * 4 + 64];
+  int ret = message.http_code == 200
+                ? removal_payload(message.raw, filename, payload,
+                                  sizeof(payload))
+                : -1;
+  free(message.raw);
+
+  if (ret < 0)
+    return 1;
+  if (ret == 0)
+    return discord_delete_messsage(channel_id, message_id, resp);
+
+  int res = request_patch(new_url, payload, resp, 1) != 0;
+  free(resp->raw);
+  return res;
+}
+
+/* builds the edit that gives the attachments of filename, and its inline
+ * record, the name new_filename in a message fetched from the api. returns
+ * how many were renamed or -1 if raw isn't a message or the edit too long */
+static int rename_payload(const char *raw, const char *filename,
+                          const char *new_filename, char *out,
+                          size_t out_size) {
+  json_object *message = NULL;
+  json_load(raw, (void **)&message);
+  if (!message)
+    return -1;
+
+  json_string content = json_object_get_type(message, "content", JSON_STRING);
+  const char *record = content;
+
+  char records[DISCORD_META_SIZE + 1] = {0};
+  char ids[DISCORD_SIZE * 20] = {0};
+  size_t records_len = 0, ids_len = 0;
+  int records_n = 0, ids_n = 0, renamed = 0;
+
+  /* every record is kept, an inline one of the file with the new name */
+  while (record) {
+    const char *next;
+    int len = record_len(record, &next);
+
+    struct dcfs_message inlined;
+    memset(&inlined, 0, sizeof(struct dcfs_message));
+    int owned = parse_inline(record, len, &inlined) == 0 &&
+                STREQ(inlined.filename, filename);
+    free(inlined.url);
+    free(inlined.content);
+
+    char name[512] = {0};
+    const char *data = NULL;
+    if (owned)
+      data = strchr(record + strlen(DISCORD_INLINE_PREFIX), ' ');
+    if (data && b64encode(name, new_filename, sizeof(name)) == 0) {
+      records_len += snprintf(records + records_len,
+                              sizeof(records) - records_len, "%s%s%s%.*s",
+                              records_n++ ? ";" : "", DISCORD_INLINE_PREFIX,
+                              name, len - (int)(data - record), data);
+      renamed++;
+    } else {
+      records_len +=
+          snprintf(records + records_len, sizeof(records) - records_len,
+                   "%s%.*s", records_n++ ? ";" : "", len, record);
+    }
+    record = next;
+
+    if (records_len >= sizeof(records))
+      break;
+  }
+
+  json_object *attachment;
+  json_array *attachments = json_object_get(message, "attachments");
+  json_array_for_each(attachments, attachment) {
+    json_string id = json_object_get(attachment, "id");
+    json_string encoded = json_object_get(attachment, "filename");
+    if (!id)
+      continue;
+
+    char decoded[256] = {0};
+    char new_decoded[512], name[768] = {0};
+    b64decode(decoded, encoded ? encoded : "", sizeof(decoded));
+
+    /* the part suffix stays */
+    int len = owned_by(decoded, filename)
+                  ? snprintf(new_decoded, sizeof(new_decoded), "%s%s",
+                             new_filename, decoded + strlen(filename))
+                  : -1;
+    if (len > 0 && len < (int)sizeof(new_decoded) &&
+        b64encode(name, new_decoded, sizeof(name)) == 0) {
+      ids_len += snprintf(ids + ids_len, sizeof(ids) - ids_len,
+                          "%s{\"id\": \"%s\", \"filename\": \"%s\"}",
+                          ids_n++ ? ", " : "", id, name);
+      renamed++;
+    } else {
+      ids_len +=
+          snprintf(ids + ids_len, sizeof(ids) - ids_len, "%s{\"id\": \"%s\"}",
+                   ids_n++ ? ", " : "", id);
+    }
+
+    if (ids_len >= sizeof(ids))
+      break;
+  }
+
+  json_object_destroy(message);
+  if (ids_len >= sizeof(ids) || records_len >= sizeof(records))
+    return -1;
+
+  snprintf(out, out_size, "{\"content\": \"%s\", \"attachments\": [%s]}",
+           records, ids);
+  return renamed;
+}
+
+/* how many attachments of filename, and inline records, a message has */
+static int count_owned(const char *raw, const char *filename) {
+  json_object *message = NULL;
+  json_load(raw, (void **)&message);
+  if (!message)
+    return 0;
+
+  int count = 0;
+  json_object *attachment;
+  json_array *attachments = json_object_get(message, "attachments");
+  json_array_for_each(attachments, attachment) {
+    json_string encoded = json_object_get(attachment, "filename");
+    char decoded[256] = {0};
+    b64decode(decoded, encoded ? encoded : "", sizeof(decoded));
+    count += owned_by(decoded, filename);
+  }
+
+  json_string content = json_object_get_type(message, "content", JSON_STRING);
+  char *url = content ? discord_inline_url(content, filename) : NULL;
+  count += url != NULL;
+  free(url);
+
+  json_object_destroy(message);
+  return count;
+}
+
+/* renames the attachments of filename in a message, and its inline record,
+ * by editing the message, which leaves the data where it is. returns 0 once
+ * the edited message in resp->raw has them under new_filename. the caller
+ * frees resp->raw either way */
+int discord_rename_attachments(const char *channel_id, const char *message_id,
+                               const char *filename, const char *new_filename,
+                               struct response *resp) {
+  char new_url[DISCORD_SIZE];
+  snprintf(new_url, DISCORD_SIZE, "%s/%s/%s/%s/%s", DISCORD_API_BASE_URL,
+           "channels", channel_id, "messages", message_id);
+
+  struct response message = {0};
+  request_get(new_url, &message, 1);
+
+  char payload[DISCORD_META_SIZE + DISCORD_SIZE * 20 + 64];
+  int renamed = message.http_code == 200
+                    ? rename_payload(message.raw, filename, new_filename,
+                                     payload, sizeof(payload))
+                    : -1;
+  free(message.raw);
+
+  if (renamed <= 0)
+    return 1;
+
+  /* an edit that can't rename an attachment leaves its name as it was */
+  if (request_patch(new_url, payload, resp, 1) != 0 ||
+      resp->http_code != 200 || count_owned(resp->raw, new_filename) < renamed)
+    return 1;
+  return 0;
+}
+
+int discord_edit_message(const char *channel_id, const char *message_id,
+                         const char *content, struct response *resp) {
+  int res = 0;
+
+  char new_url[DISCORD_SIZE];
+  snprintf(new_url, DISCORD_SIZE, "%s/%s/%s/%s/%s", DISCORD_API_BASE_URL,
+           "channels", channel_id, "messages", message_id);
+
+  char payload[DISCORD_META_SIZE + 32];
+  content_payload(payload, sizeof(payload), content);
+
+  if (request_patch(new_url, payload, resp, 1) != 0)
+    res = 1;
+
+  free(resp->raw);
+  return res;
+}
+
+int discord_edit_message_async(const char *channel_id, const char *message_id,
+                               const char *content, request_cb cb,
+                               void *data) {
+  char new_url[DISCORD_SIZE];
+  snprintf(new_url, DISCORD_SIZE, "%s/%s/%s/%s/%s", DISCORD_API_BASE_URL,
+           "channels", channel_id, "messages", message_id);
+
+  char payload[DISCORD_META_SIZE + 32];
+  content_payload(payload, sizeof(payload), content);
+
+  return request_patch_async(new_url, payload, 1, cb, data);
+}
+
+int discord_delete_message_async(const char *channel_id,
+                                 const char *message_id, request_cb cb,
+                                 void *data) {
+  char new_url[DISCORD_SIZE];
+  snprintf(new_url, DISCORD_SIZE, "%s/%s/%s/%s/%s", DISCORD_API_BASE_URL,
+           "channels", channel_id, "messages", message_id);
+
+  return request_delete_async(new_url, 1, cb, data);
+}
+
+/* deletes up to DISCORD_BULK_DELETE_MAX messages of a channel with one
+ * request. discord needs at least 2 of them, none older than
+ * DISCORD_BULK_DELETE_AGE */
+int discord_bulk_delete(const char *channel_id, char ids[][64], size_t ids_n,
+                        struct response *resp) {
+  char new_url[DISCORD_SIZE];
+  snprintf(new_url, DISCORD_SIZE, "%s/%s/%s/%s", DISCORD_API_BASE_URL,
+           "channels", channel_id, "messages/bulk-delete");
+
+  char payload[DISCORD_BULK_DELETE_MAX * 72 + 32];
+  size_t len = snprintf(payload, sizeof(payload), "{\"messages\": [");
+  for (size_t i = 0; i < ids_n && i < DISCORD_BULK_DELETE_MAX; i++)
+    len += snprintf(payload + len, sizeof(payload) - len, "%s\"%s\"",
+                    i ? ", " : "", ids[i]);
+  snprintf(payload + len, sizeof(payload) - len, "]}");
+
+  int res = request_post(new_url, payload, resp, 1) != 0;
+  free(resp->raw);
+  return res;
+}
+
 int discord_delete_messsage(const char *channel_id, const char *message_id,
                             struct response *resp) {
   int res = 0;
@@ -4,6 +4,7 @@
 #include "request.h"
 #include "json/json.h"
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -11,6 +12,32 @@
 #define DISCORD_API_BASE_URL "https://discord.com/api/v9"
 #define DISCORD_MAX_PARTS 256
 #define DISCORD_SIZE 256
+#define DISCORD_PAGE_SIZE 100
+/* the attachment holding a channel's manifest. its name isn't base64 like
+ * the ones of files, so it never shows up in a listing */
+#define DISCORD_MANIFEST_NAME "dcfs-manifest"
+/* parts are posted 10 to a message */
+#define DISCORD_PARTS_PER_MESSAGE 10
+/* the content of a file's head message starts with this, followed by the
+ * fields of discord_meta. a message holding the heads of several small
+ * files has one record for each attachment, separated by
+ * DISCORD_META_SEPARATOR */
+#define DISCORD_META_PREFIX "dcfs1 "
+#define DISCORD_META_SEPARATOR ';'
+/* the most content a message takes */
+#define DISCORD_META_SIZE 2000
+/* a file small enough to live in the content of its message has no
+ * attachment. its record starts with this, followed by the base64 of its
+ * name and of its data, then the fields of a DISCORD_META_PREFIX record.
+ * inline records come before the ones of attachments */
+#define DISCORD_INLINE_PREFIX "dcfs1i "
+/* the part of an inline file keeps the data in its url, behind this */
+#define DISCORD_INLINE_URL "data:"
+/* the largest file whose record still fits in a message */
+#define DISCORD_INLINE_MAX 1024
+/* the most messages deleted with one request, and how old they may be */
+#define DISCORD_BULK_DELETE_MAX 100
+#define DISCORD_BULK_DELETE_AGE (14 * 24 * 3600)
 
 struct discord_snowflake {
   size_t timestamp;
@@ -45,6 +72,33 @@ struct dcfs_channel {
   char name[128];
   enum channel_types type;
   char has_parent;
+  char last_message_id[64];
+};
+
+/* what the head message of a file says about it. ids are the messages
+ * holding the parts after the head's own, in order. they are only known
+ * once the whole file is posted, so a file whose upload was cut short has
+ * none */
+struct discord_meta {
+  uint64_t size;
+  unsigned int parts_n;
+  uint64_t part_size;
+  unsigned int mode;
+  unsigned int uid;
+  unsigned int gid;
+  int64_t mtime;
+  uint64_t hash;
+  char ids[DISCORD_MAX_PARTS / DISCORD_PARTS_PER_MESSAGE][64];
+  unsigned int ids_n;
+};
+
+/* where a page of messages starts, and what it held once fetched */
+struct discord_page {
+  const char *before;
+  const char *after;
+  char first_id[64];
+  char last_id[64];
+  int messages_n;
 };
 
 void discord_free_channels(json_array *channels);
@@ -53,6 +107,26 @@ json_array *discord_get_channels(const char *guild_id);
 void discord_free_messages(json_array *messages);
 void discord_free_message(struct dcfs_message *message);
 json_array *discord_get_messages(const char *channel_id);
+json_array *discord_get_messages_page(const char *channel_id,
+                                      struct discord_page *page);
+
+int discord_format_meta(char *out, size_t out_size,
+                        const struct discord_meta *meta);
+int discord_parse_meta(const char *content, struct discord_meta *meta);
+int discord_format_inline(char *out, size_t out_size, const char *filename,
+                          const char *data, const struct discord_meta *meta);
+char *discord_inline_url(const char *content, const char *filename);
+int discord_inline_content(const char *url, struct response *resp);
+
+char *discord_attachment_url(const char *raw, const char *filename);
+char *discord_get_attachment_url(const char *channel_id,
+                                 const char *message_id, const char *filename);
+int discord_get_message_async(const char *channel_id, const char *message_id,
+                              request_cb cb, void *data);
+
+json_array *discord_get_manifests(const char *channel_id);
+int discord_post_manifest(const char *channel_id, char *content, size_t size,
+                          char *message_id, size_t message_id_size);
 
 int discord_create_channel(const char *guild_id, const char *name,
                            struct response *resp);
@@ -60,8 +134,28 @@ int discord_rename_channel(const char *channel_id, const char *name,
                            struct response *resp);
 int discord_delete_channel(const char *channel_id, struct response *resp);
 int discord_create_attachments(const char *channel_id, const struct file *files,
-                               size_t files_n, struct response *resp);
+                               size_t files_n, const char *content,
+                               struct response *resp);
+int discord_remove_attachments(const char *channel_id, const char *message_id,
+                               const char *filename, struct response *resp);
+int discord_rename_attachments(const char *channel_id, const char *message_id,
+                               const char *filename, const char *new_filename,
+                               struct response *resp);
+int discord_edit_message(const char *channel_id, const char *message_id,
+                         const char *content, struct response *resp);
 int discord_delete_messsage(const char *channel_id, const char *message_id,
                             struct response *resp);
+int discord_bulk_delete(const char *channel_id, char ids[][64], size_t ids_n,
+                        struct response *resp);
+
+int discord_create_attachments_async(const char *channel_id,
+                                     const struct file *files, size_t files_n,
+                                     const char *content, request_cb cb,
+                                     void *data);
+int discord_edit_message_async(const char *channel_id, const char *message_id,
+                               const char *content, request_cb cb, void *data);
+int discord_delete_message_async(const char *channel_id,
+                                 const char *message_id, request_cb cb,
+                                 void *data);
 
 #endif
@@ -1,143 +1,1041 @@
+#include "manifest.h"
 #include "util.h"
 
 #include <assert.h>
-#include <regex.h>
+#include <ctype.h>
 #include <sys/stat.h>
 
 static struct {
-  regex_t comp;
-  regmatch_t matches[3];
-} part_regex;
-
-void dcfs_path_init(const char *path, struct dcfs_path *p) {
-  memset(p, 0, sizeof(struct dcfs_path));
-
-  char path_normalized[256];
-  memset(path_normalized, 0, sizeof(path_normalized));
-  string_normalize(path_normalized, path, sizeof(path_normalized));
-
-  if (!STREQ(path_normalized, "/")) {
-    int last_slash_idx = last_index(path_normalized, '/');
-
-    if (last_slash_idx > 0) {
-      memcpy(p->dir, path_normalized + 1, last_slash_idx - 1);
-      memcpy(p->filename, path_normalized + (last_slash_idx + 1),
-             strlen(path_normalized) - last_slash_idx);
-    } else {
-      memcpy(p->dir, path_normalized + 1, strlen(path_normalized) - 1);
+  pthread_mutex_t lock;
+  struct dcfs_node **buckets;
+  size_t buckets_n;
+  size_t size;
+  uint64_t next_ino;
+} inodes = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .next_ino = DCFS_ROOT_INO + 1,
+};
+
+static void inodes_grow() {
+  size_t buckets_n = inodes.buckets_n ? inodes.buckets_n * 2 : 1024;
+  struct dcfs_node **buckets = calloc(buckets_n, sizeof(struct dcfs_node *));
+  assert(buckets);
+
+  for (size_t i = 0; i < inodes.buckets_n; i++) {
+    struct dcfs_node *node = inodes.buckets[i];
+    while (node) {
+      struct dcfs_node *next = node->next;
+      size_t n = node->ino & (buckets_n - 1);
+      node->next = buckets[n];
+      buckets[n] = node;
+      node = next;
+    }
+  }
+
+  free(inodes.buckets);
+  inodes.buckets = buckets;
+  inodes.buckets_n = buckets_n;
+}
+
+static struct dcfs_node **inodes_slot(uint64_t ino) {
+  struct dcfs_node **slot = &inodes.buckets[ino & (inodes.buckets_n - 1)];
+  for (; *slot && (*slot)->ino != ino; slot = &(*slot)->next)
+    ;
+  return slot;
+}
+
+static void free_node(struct dcfs_node *node) {
+  if (node->type == DCFS_NODE_DIR) {
+    struct dcfs_dir *dir = (struct dcfs_dir *)node;
+    dcfs_free_dir(dir);
+    free(dir);
+
+  } else {
+    struct dcfs_file *file = (struct dcfs_file *)node;
+    struct dcfs_dir *parent = file->parent;
+
+    pthread_mutex_destroy(&file->lock);
+    dcfs_free_file(file);
+    free(file);
+
+    if (parent)
+      dcfs_node_put(&parent->node);
+  }
+}
+
+/* registers a node with one reference held by the caller */
+void dcfs_node_register(struct dcfs_node *node, enum dcfs_node_type type,
+                        uint64_t ino) {
+  pthread_mutex_lock(&inodes.lock);
+
+  if (inodes.size >= inodes.buckets_n)
+    inodes_grow();
+
+  node->ino = ino;
+  node->type = type;
+  node->nlookup = 0;
+  node->refs = 1;
+
+  struct dcfs_node **slot = inodes_slot(ino);
+  node->next = *slot ? (*slot)->next : NULL;
+  if (*slot)
+    print_warn("inode %llu registered twice\n", (unsigned long long)ino);
+  else
+    inodes.size++;
+  *slot = node;
+
+  pthread_mutex_unlock(&inodes.lock);
+}
+
+uint64_t dcfs_node_next_ino() {
+  return __atomic_fetch_add(&inodes.next_ino, 1, __ATOMIC_RELAXED);
+}
+
+struct dcfs_node *dcfs_node_get(uint64_t ino) {
+  pthread_mutex_lock(&inodes.lock);
+
+  struct dcfs_node *node = NULL;
+  if (inodes.buckets && (node = *inodes_slot(ino)))
+    node->refs++;
+
+  pthread_mutex_unlock(&inodes.lock);
+  return node;
+}
+
+void dcfs_node_ref(struct dcfs_node *node) {
+  pthread_mutex_lock(&inodes.lock);
+  node->refs++;
+  pthread_mutex_unlock(&inodes.lock);
+}
+
+void dcfs_node_lookup(struct dcfs_node *node) {
+  pthread_mutex_lock(&inodes.lock);
+  node->nlookup++;
+  pthread_mutex_unlock(&inodes.lock);
+}
+
+static void release_node(struct dcfs_node *node) {
+  if (node->refs || node->nlookup) {
+    pthread_mutex_unlock(&inodes.lock);
+    return;
+  }
+
+  struct dcfs_node **slot = inodes_slot(node->ino);
+  if (*slot == node) {
+    *slot = node->next;
+    inodes.size--;
+  }
+  pthread_mutex_unlock(&inodes.lock);
+
+  free_node(node);
+}
+
+void dcfs_node_put(struct dcfs_node *node) {
+  pthread_mutex_lock(&inodes.lock);
+  node->refs--;
+  release_node(node);
+}
+
+void dcfs_node_forget(uint64_t ino, uint64_t nlookup) {
+  pthread_mutex_lock(&inodes.lock);
+
+  struct dcfs_node *node = inodes.buckets ? *inodes_slot(ino) : NULL;
+  if (!node) {
+    pthread_mutex_unlock(&inodes.lock);
+    return;
+  }
+
+  node->nlookup = nlookup < node->nlookup ? node->nlookup - nlookup : 0;
+  release_node(node);
+}
+
+static struct dcfs_file **file_map_slot(struct dcfs_file_map *map,
+                                        const char *name, size_t name_len) {
+  size_t mask = map->slots_n - 1;
+  size_t n = string_hash_n(name, name_len) & mask;
+
+  for (; map->slots[n]; n = (n + 1) & mask) {
+    const char *filename = map->slots[n]->filename;
+    if (strncmp(filename, name, name_len) == 0 && !filename[name_len])
+      break;
+  }
+  return &map->slots[n];
+}
+
+static void file_map_grow(struct dcfs_file_map *map) {
+  struct dcfs_file_map grown = {0};
+  grown.slots_n = map->slots_n ? map->slots_n * 2 : 16;
+  grown.slots = calloc(grown.slots_n, sizeof(struct dcfs_file *));
+  assert(grown.slots);
+
+  for (size_t i = 0; i < map->slots_n; i++) {
+    struct dcfs_file *file = map->slots[i];
+    if (file)
+      *file_map_slot(&grown, file->filename, strlen(file->filename)) = file;
+  }
+
+  grown.size = map->size;
+  free(map->slots);
+  *map = grown;
+}
+
+static struct dcfs_file **file_map_insert(struct dcfs_file_map *map,
+                                          const char *name, size_t name_len) {
+  if ((map->size + 1) * 2 > map->slots_n)
+    file_map_grow(map);
+
+  struct dcfs_file **slot = file_map_slot(map, name, name_len);
+  if (!*slot)
+    map->size++;
+  return slot;
+}
+
+/* linear probing, so the entries following a removed one are shifted back
+ * instead of leaving a tombstone */
+static void file_map_remove(struct dcfs_file_map *map, struct dcfs_file *file) {
+  if (!map->slots)
+    return;
+
+  size_t mask = map->slots_n - 1;
+  struct dcfs_file **slot =
+      file_map_slot(map, file->filename, strlen(file->filename));
+  if (*slot != file)
+    return;
+
+  size_t hole = slot - map->slots;
+  map->slots[hole] = NULL;
+  map->size--;
+
+  for (size_t n = (hole + 1) & mask; map->slots[n]; n = (n + 1) & mask) {
+    struct dcfs_file *moved = map->slots[n];
+    size_t home = string_hash(moved->filename) & mask;
+
+    if (((n - home) & mask) >= ((n - hole) & mask)) {
+      map->slots[hole] = moved;
+      map->slots[n] = NULL;
+      hole = n;
     }
   }
 }
 
+/* takes dir->lock and loads the file listing on first use. the listing is
+ * fetched with the write lock held, so concurrent callers wait for it */
+int dcfs_dir_lock(struct dcfs_dir *dir, int write) {
+  if (write)
+    pthread_rwlock_wrlock(&dir->lock);
+  else
+    pthread_rwlock_rdlock(&dir->lock);
+
+  if (dir->loaded)
+    return 0;
+
+  if (!write) {
+    pthread_rwlock_unlock(&dir->lock);
+    pthread_rwlock_wrlock(&dir->lock);
+  }
+
+  if (!dir->loaded && dcfs_get_files(dir) != 0) {
+    pthread_rwlock_unlock(&dir->lock);
+    return 1;
+  }
+
+  if (!write) {
+    pthread_rwlock_unlock(&dir->lock);
+    pthread_rwlock_rdlock(&dir->lock);
+  }
+  return 0;
+}
+
+inline void dcfs_dir_unlock(struct dcfs_dir *dir) {
+  pthread_rwlock_unlock(&dir->lock);
+}
+
+struct dcfs_file *dcfs_dir_find(struct dcfs_dir *dir, const char *filename) {
+  if (!dir->index.slots)
+    return NULL;
+
+  return *file_map_slot(&dir->index, filename, strlen(filename));
+}
+
+static void link_file(struct dcfs_dir *dir, struct dcfs_file *file) {
+  if (!dir->files)
+    dir->files = json_array_new();
+
+  file->seq = ++dir->seq;
+  json_array_push(dir->files, file, 0, JSON_UNKNOWN);
+  *file_map_insert(&dir->index, file->filename, strlen(file->filename)) = file;
+}
+
+/* the listing takes its own reference. the caller holds dir->lock for
+ * writing */
+void dcfs_dir_add_file(struct dcfs_dir *dir, struct dcfs_file *file) {
+  dcfs_node_ref(&file->node);
+  link_file(dir, file);
+}
+
+/* registers a file read from the server, whose inode is its head message
+ * id mixed with its name, and lists it. the listing owns the reference taken
+ * by dcfs_node_register. the caller holds dir->lock for writing */
+void dcfs_dir_add_remote_file(struct dcfs_dir *dir, struct dcfs_file *file) {
+  file->parent = dir;
+  dcfs_node_ref(&dir->node);
+  dcfs_node_register(&file->node, DCFS_NODE_FILE,
+                     strtoull(file->messages[0]->id, NULL, 10) ^
+                         string_hash(file->filename));
+  link_file(dir, file);
+}
+
+void dcfs_dir_remove_file(struct dcfs_dir *dir, struct dcfs_file *file) {
+  file_map_remove(&dir->index, file);
+  json_array_detach_ptr(&dir->files, file);
+  dcfs_node_put(&file->node);
+}
+
+/* returns a file with one reference held by the caller. it isn't part of
+ * the listing until dcfs_dir_add_file */
+struct dcfs_file *dcfs_new_file(struct dcfs_dir *parent, const char *filename) {
+  struct dcfs_file *file = calloc(1, sizeof(struct dcfs_file));
+  if (!file)
+    return NULL;
+
+  snprintf(file->filename, sizeof(file->filename), "%s", filename);
+  pthread_mutex_init(&file->lock, NULL);
+
+  file->parent = parent;
+  dcfs_node_ref(&parent->node);
+  dcfs_node_register(&file->node, DCFS_NODE_FILE, dcfs_node_next_ino());
+
+  return file;
+}
+
 void dcfs_free_file(struct dcfs_file *file) {
-  for (size_t i = 0; i < file->messages_n; i++) {
+  size_t freed = 0;
+  for (size_t i = 0; i < DISCORD_MAX_PARTS && freed < file->messages_n; i++) {
     struct dcfs_message *message = file->messages[i];
+    if (!message)
+      continue;
+
     discord_free_message(message);
     free(message);
+    freed++;
   }
 
   if (file->content)
     free(file->content);
+
+  json_array_destroy(file->readers);
 }
 
 void dcfs_free_files(json_array *files) {
   struct dcfs_file *file;
-  json_array_for_each(files, file) dcfs_free_file(file);
+  json_array_for_each(files, file) {
+    pthread_mutex_destroy(&file->lock);
+    dcfs_free_file(file);
+  }
   json_array_destroy(files);
 }
 
-json_array *dcfs_get_files(const char *channel_id) {
-  regcomp(&part_regex.comp, "(.+)\\.PART([0-9]+)", REG_EXTENDED);
-  json_array *messages = discord_get_messages(channel_id);
-  json_array *files = NULL;
+/* returns the part number encoded in a "<name>.PART<n>" filename and stores
+ * the length of <name> in base_len. plain filenames are part 0 */
+static long parse_part_suffix(const char *filename, size_t *base_len) {
+  size_t len = strlen(filename);
+  size_t digits = 0;
+
+  *base_len = len;
+  while (digits < len && isdigit((unsigned char)filename[len - digits - 1]))
+    digits++;
+
+  if (digits == 0 || len - digits <= 5 ||
+      strncmp(filename + len - digits - 5, ".PART", 5) != 0)
+    return 0;
+
+  *base_len = len - digits - 5;
+  return strtol(filename + len - digits, NULL, 10);
+}
+
+/* stores a part of a file. a part announced by the metadata of the head is
+ * already there without a url, which the attachment fills in. returns 0 for
+ * a new part, 1 for a filled in one and -1 if the part is taken. the caller
+ * holds file->lock, or owns the file */
+static int attach_part(struct dcfs_file *file, long part_n,
+                       struct dcfs_message *message) {
+  struct dcfs_message *part = file->messages[part_n];
+  if (part) {
+    if (part->url || !STREQ(part->id, message->id))
+      return -1;
+
+    part->url = message->url;
+    return 1;
+  }
+
+  part = calloc(1, sizeof(struct dcfs_message));
+  assert(part);
+
+  part->size = message->size;
+  part->url = message->url;
+  snprintf(part->id, sizeof(part->id), "%s", message->id);
+  snprintf(part->filename, sizeof(part->filename), "%s", message->filename);
+
+  if (!file->hash)
+    file->size += message->size;
+  file->messages[part_n] = part;
+  file->messages_n++;
+  return 0;
+}
+
+/* applies the metadata of a head message. parts not seen yet are added
+ * from the message ids in it and get their urls on first read, so the file
+ * doesn't wait for the crawl to reach them */
+static void describe_file(struct dcfs_file *file,
+                          const struct discord_meta *meta) {
+  const char *head_id = file->messages[0]->id;
+
+  file->size = meta->size;
+  file->hash = meta->hash;
+  file->ctime = meta->mtime;
+  file->mode = S_IFREG | (meta->mode & 07777);
+  file->uid = meta->uid;
+  file->gid = meta->gid;
+
+  for (unsigned int i = 1; i < meta->parts_n; i++) {
+    unsigned int batch = i / DISCORD_PARTS_PER_MESSAGE;
+    if (file->messages[i] || (batch > 0 && batch > meta->ids_n))
+      continue;
+
+    struct dcfs_message *part = calloc(1, sizeof(struct dcfs_message));
+    assert(part);
+
+    /* a name that leaves no room for the suffix of a part can't have been
+     * uploaded in parts */
+    int len = snprintf(part->filename, sizeof(part->filename), "%s.PART%u",
+                       file->filename, i);
+    if (len < 0 || len >= (int)sizeof(part->filename)) {
+      free(part);
+      continue;
+    }
+
+    snprintf(part->id, sizeof(part->id), "%s",
+             batch == 0 ? head_id : meta->ids[batch - 1]);
+    part->size = i + 1 < meta->parts_n
+                     ? meta->part_size
+                     : meta->size - meta->part_size * (meta->parts_n - 1);
+
+    file->messages[i] = part;
+    file->messages_n++;
+  }
+}
+
+/* adds one attachment found by the crawl. messages come newest first and
+ * the parts of a file are always posted with or after its head, so a file
+ * may be seen part-first. parts found before their head are parked in
+ * dir->pending, and the file joins the listing once its head shows up */
+static void add_message(struct dcfs_dir *dir, struct dcfs_message *message) {
+  struct discord_meta meta;
+  int described =
+      message->content && discord_parse_meta(message->content, &meta) == 0;
+  free(message->content);
+  message->content = NULL;
+
+  size_t base_len;
+  long part_n = parse_part_suffix(message->filename, &base_len);
+
+  if (part_n >= DISCORD_MAX_PARTS) {
+    print_warn("skipping %s: too many parts\n", message->filename);
+    discord_free_message(message);
+    return;
+  }
+
+  /* the rest of the head's message, or an older upload under the name of a
+   * file that's already listed */
+  struct dcfs_file *file = NULL;
+  if (dir->index.slots)
+    file = *file_map_slot(&dir->index, message->filename, base_len);
+
+  if (file) {
+    int ret = -1;
+    pthread_mutex_lock(&file->lock);
+    if (part_n != 0 && file->messages[0] && !file->uploading &&
+        id_cmp(message->id, file->messages[0]->id) >= 0)
+      ret = attach_part(file, part_n, message);
+    pthread_mutex_unlock(&file->lock);
+
+    if (ret < 0)
+      discord_free_message(message);
+    return;
+  }
+
+  struct dcfs_file **slot =
+      file_map_insert(&dir->pending, message->filename, base_len);
+  if (!*slot) {
+    file = calloc(1, sizeof(struct dcfs_file));
+    assert(file);
+
+    snprintf(file->filename, base_len + 1, "%s", message->filename);
+    pthread_mutex_init(&file->lock, NULL);
+    *slot = file;
+  }
+
+  file = *slot;
+  if (attach_part(file, part_n, message) < 0) {
+    discord_free_message(message);
+    return;
+  }
+
+  if (part_n != 0)
+    return;
+
+  id_to_ctime(&file->ctime, message->id);
+  file->mode = S_IFREG | 0644;
+  file->gid = getgid();
+  file->uid = getuid();
+  if (described)
+    describe_file(file, &meta);
+
+  file_map_remove(&dir->pending, file);
+  dcfs_dir_add_remote_file(dir, file);
+}
+
+/* drops the parts whose head message is gone */
+static void free_pending(struct dcfs_dir *dir) {
+  for (size_t i = 0; i < dir->pending.slots_n; i++) {
+    struct dcfs_file *file = dir->pending.slots[i];
+    if (!file)
+      continue;
+
+    pthread_mutex_destroy(&file->lock);
+    dcfs_free_file(file);
+    free(file);
+  }
 
-  if (messages) {
-    files = json_array_new();
+  free(dir->pending.slots);
+  memset(&dir->pending, 0, sizeof(struct dcfs_file_map));
+}
+
+static int load_manifest(struct dcfs_dir *dir);
+
+int dcfs_dir_load_page(struct dcfs_dir *dir) {
+  if (dir->loaded)
+    return 0;
+
+  /* the crawl is the fallback for channels without a usable manifest */
+  if (!*dir->cursor && !dir->manifest_tried) {
+    dir->manifest_tried = 1;
+    if (load_manifest(dir) == 0)
+      return 0;
+  }
+
+  struct discord_page page;
+  memset(&page, 0, sizeof(struct discord_page));
+  page.before = *dir->cursor ? dir->cursor : NULL;
+
+  json_array *messages = discord_get_messages_page(dir->channel.id, &page);
+  if (!messages)
+    return 1;
+
+  /* the first page has the newest message, see dcfs_dir_refresh */
+  if (!page.before)
+    snprintf(dir->newest, sizeof(dir->newest), "%s", page.first_id);
+
+  if (!dir->files)
+    dir->files = json_array_new();
+
+  struct dcfs_message *message;
+  json_array_for_each(messages, message) add_message(dir, message);
+  json_array_destroy(messages);
+
+  snprintf(dir->cursor, sizeof(dir->cursor), "%s", page.last_id);
+  if (page.messages_n < DISCORD_PAGE_SIZE) {
+    free_pending(dir);
+    dir->loaded = 1;
+
+    /* took more than one page, the next mount shouldn't have to */
+    if (page.before && !*dir->manifest_id)
+      dcfs_dir_changed(dir);
+  }
+  return 0;
+}
+
+static unsigned int crawl_threads = 4;
+
+void dcfs_set_crawl_threads(unsigned int n) { crawl_threads = n; }
+
+/* a slice of the channel's history, the messages with ids in
+ * (lower, before) */
+struct window {
+  const char *channel_id;
+  char before[64];
+  uint64_t lower;
+  json_array *found;
+  int err;
+  pthread_t thread;
+  char threaded;
+};
+
+/* the api only takes one of before= and after=, so a window is walked down
+ * from its top and the page that crosses its bottom is cut short */
+static void *crawl_window(void *data) {
+  struct window *window = data;
+  window->found = json_array_new();
+  assert(window->found);
+
+  struct discord_page page;
+  memset(&page, 0, sizeof(struct discord_page));
+  page.before = window->before;
+
+  do {
+    json_array *messages =
+        discord_get_messages_page(window->channel_id, &page);
+    if (!messages) {
+      window->err = 1;
+      return NULL;
+    }
 
     struct dcfs_message *message;
     json_array_for_each(messages, message) {
-      int ret = regexec(&part_regex.comp, message->filename,
-                        sizeof(part_regex.matches) / sizeof(regmatch_t),
-                        part_regex.matches, 0);
+      if (strtoull(message->id, NULL, 10) <= window->lower) {
+        discord_free_message(message);
+        continue;
+      }
 
-      if (ret != 0) {
-        struct dcfs_file file;
-        memset(&file, 0, sizeof(struct dcfs_file));
+      json_array_push(window->found, message, sizeof(struct dcfs_message),
+                      JSON_UNKNOWN);
+    }
+    json_array_destroy(messages);
 
-        struct dcfs_message *head = calloc(1, sizeof(struct dcfs_message));
-        assert(head);
+    snprintf(window->before, sizeof(window->before), "%s", page.last_id);
+  } while (page.messages_n == DISCORD_PAGE_SIZE &&
+           strtoull(page.last_id, NULL, 10) > window->lower);
 
-        id_to_ctime(&file.ctime, message->id);
-        file.mode = S_IFREG | 0644;
-        file.gid = getgid();
-        file.uid = getuid();
-        file.size = message->size;
-        snprintf(file.filename, sizeof(file.filename), "%s", message->filename);
+  return NULL;
+}
 
-        head->size = message->size;
-        head->url = message->url;
+/* lists what's older than dir->cursor by splitting the ids left, which are
+ * timestamps, into windows crawled at once. span is how many ids the last
+ * page covered, so a channel with little left isn't split. the caller holds
+ * dir->lock for writing */
+static int load_windows(struct dcfs_dir *dir, uint64_t span) {
+  uint64_t bottom = strtoull(dir->channel.id, NULL, 10);
+  uint64_t top = strtoull(dir->cursor, NULL, 10);
+  if (top <= bottom || !span)
+    return 1;
 
-        snprintf(head->id, sizeof(head->id), "%s", message->id);
-        snprintf(head->filename, sizeof(head->filename), "%s",
-                 message->filename);
+  uint64_t pages = (top - bottom) / span;
+  size_t windows_n = pages < crawl_threads ? pages : crawl_threads;
+  if (windows_n < 2)
+    return 1;
 
-        file.messages[0] = head;
-        file.messages_n++;
+  struct window *windows = calloc(windows_n, sizeof(struct window));
+  assert(windows);
 
-        json_array_push(files, &file, sizeof(struct dcfs_file), JSON_UNKNOWN);
-      }
+  uint64_t step = (top - bottom) / windows_n;
+  for (size_t i = 0; i < windows_n; i++) {
+    struct window *window = &windows[i];
+    window->channel_id = dir->channel.id;
+    window->lower = i + 1 == windows_n ? bottom : top - step * (i + 1);
+    snprintf(window->before, sizeof(window->before), "%llu",
+             (unsigned long long)(i == 0 ? top : top - step * i + 1));
+
+    /* a window without a thread is crawled here once the others are off */
+    window->threaded =
+        pthread_create(&window->thread, NULL, crawl_window, window) == 0;
+  }
+
+  int err = 0;
+  for (size_t i = 0; i < windows_n; i++) {
+    if (windows[i].threaded)
+      pthread_join(windows[i].thread, NULL);
+    else
+      crawl_window(&windows[i]);
+    err |= windows[i].err;
+  }
+
+  /* newest window first, so the listing sees messages in crawl order */
+  for (size_t i = 0; i < windows_n; i++) {
+    struct dcfs_message *message;
+    if (err) {
+      if (windows[i].found)
+        discord_free_messages(windows[i].found);
+      continue;
+    }
+
+    json_array_for_each(windows[i].found, message) add_message(dir, message);
+    json_array_destroy(windows[i].found);
+  }
+  free(windows);
+
+  if (err)
+    return 1;
+
+  free_pending(dir);
+  dir->loaded = 1;
+  if (!*dir->manifest_id)
+    dcfs_dir_changed(dir);
+  return 0;
+}
+
+int dcfs_get_files(struct dcfs_dir *dir) {
+  int split = crawl_threads < 2;
+
+  while (!dir->loaded) {
+    uint64_t top = strtoull(*dir->cursor ? dir->cursor : "0", NULL, 10);
+    if (dcfs_dir_load_page(dir) != 0)
+      return 1;
+
+    if (dir->loaded || split)
+      continue;
+
+    /* a failed split is picked up page by page */
+    split = 1;
+    if (!top)
+      top = strtoull(dir->newest, NULL, 10);
+    uint64_t cursor = strtoull(dir->cursor, NULL, 10);
+    load_windows(dir, top > cursor ? top - cursor : 0);
+  }
+  return 0;
+}
+
+/* marks the listing as differing from the manifest on the server. the
+ * caller may hold any lock */
+void dcfs_dir_changed(struct dcfs_dir *dir) {
+  __atomic_store_n(&dir->manifest_dirty, 1, __ATOMIC_RELAXED);
+}
+
+void dcfs_add_change(json_array *changes, uint64_t parent, uint64_t ino,
+                     const char *name) {
+  if (!changes)
+    return;
+
+  struct dcfs_change change;
+  memset(&change, 0, sizeof(struct dcfs_change));
+  change.parent = parent;
+  change.ino = ino;
+  if (name)
+    snprintf(change.name, sizeof(change.name), "%s", name);
+
+  json_array_push(changes, &change, sizeof(struct dcfs_change), JSON_UNKNOWN);
+}
+
+/* adds one attachment newer than anything listed. messages come oldest
+ * first here, so a file's head shows up before its parts. the caller holds
+ * dir->lock for writing */
+static void merge_message(struct dcfs_dir *dir, struct dcfs_message *message,
+                          json_array *changes) {
+  size_t base_len;
+  long part_n = parse_part_suffix(message->filename, &base_len);
+
+  struct dcfs_file *file = NULL;
+  if (dir->index.slots)
+    file = *file_map_slot(&dir->index, message->filename, base_len);
+
+  if (part_n == 0 && file) {
+    /* our own uploads come back too */
+    pthread_mutex_lock(&file->lock);
+    int known = !file->messages_n || file->uploading ||
+                id_cmp(file->messages[0]->id, message->id) >= 0;
+    pthread_mutex_unlock(&file->lock);
+
+    if (known) {
+      discord_free_message(message);
+      return;
     }
 
+    /* uploaded again elsewhere. the newest upload wins, as in the crawl */
+    dcfs_add_change(changes, dir->node.ino, file->node.ino, file->filename);
+    dcfs_dir_remove_file(dir, file);
+    file = NULL;
+  }
+
+  if (part_n == 0 || part_n >= DISCORD_MAX_PARTS) {
+    /* the kernel may have cached the name as missing */
+    if (part_n == 0 && !file)
+      dcfs_add_change(changes, dir->node.ino, 0, message->filename);
+
+    add_message(dir, message);
+    return;
+  }
+
+  /* a part whose head is older than what's listed was dropped by the
+   * crawl already */
+  if (!file) {
+    discord_free_message(message);
+    return;
+  }
+
+  int ret = -1;
+  pthread_mutex_lock(&file->lock);
+  if (file->messages[0] && !file->uploading &&
+      id_cmp(message->id, file->messages[0]->id) >= 0)
+    ret = attach_part(file, part_n, message);
+
+  /* still being uploaded when it was last seen */
+  if (ret == 0) {
+    free(file->content);
+    file->content = NULL;
+    dcfs_add_change(changes, 0, file->node.ino, NULL);
+  }
+  pthread_mutex_unlock(&file->lock);
+
+  if (ret < 0)
+    discord_free_message(message);
+}
+
+static int message_order(const void *a, const void *b) {
+  const struct dcfs_message *x = *(struct dcfs_message *const *)a;
+  const struct dcfs_message *y = *(struct dcfs_message *const *)b;
+  size_t len;
+
+  int ret = id_cmp(x->id, y->id);
+  if (ret == 0)
+    ret = parse_part_suffix(x->filename, &len) -
+          parse_part_suffix(y->filename, &len);
+  return ret;
+}
+
+/* the messages posted after a point, oldest first */
+struct backlog {
+  char after[64];
+  json_array *found;
+  struct dcfs_message **sorted;
+  size_t found_n;
+  size_t pages;
+};
+
+/* fetches every message after backlog->after, which ends up as the newest
+ * one found. the caller holds no lock, or dir->lock if it can wait */
+static int fetch_backlog(const char *channel_id, struct backlog *backlog) {
+  backlog->found = json_array_new();
+  assert(backlog->found);
+
+  /* an empty channel is read from the start */
+  if (!*backlog->after)
+    snprintf(backlog->after, sizeof(backlog->after), "0");
+
+  struct discord_page page;
+  memset(&page, 0, sizeof(struct discord_page));
+  page.after = backlog->after;
+
+  do {
+    json_array *messages = discord_get_messages_page(channel_id, &page);
+    if (!messages) {
+      discord_free_messages(backlog->found);
+      return 1;
+    }
+
+    struct dcfs_message *message;
+    json_array_for_each(messages, message) json_array_push(
+        backlog->found, message, sizeof(struct dcfs_message), JSON_UNKNOWN);
+    json_array_destroy(messages);
+
+    if (*page.first_id)
+      snprintf(backlog->after, sizeof(backlog->after), "%s", page.first_id);
+    backlog->pages++;
+  } while (page.messages_n == DISCORD_PAGE_SIZE);
+
+  backlog->found_n = json_array_size(backlog->found);
+  if (backlog->found_n) {
+    backlog->sorted = calloc(backlog->found_n, sizeof(struct dcfs_message *));
+    assert(backlog->sorted);
+
+    size_t i = 0;
+    struct dcfs_message *message;
+    json_array_for_each(backlog->found, message) backlog->sorted[i++] =
+        message;
+    qsort(backlog->sorted, backlog->found_n, sizeof(struct dcfs_message *),
+          message_order);
+  }
+
+  return 0;
+}
+
+/* merges the backlog into the listing and frees it. the caller holds
+ * dir->lock for writing */
+static void merge_backlog(struct dcfs_dir *dir, struct backlog *backlog,
+                          json_array *changes) {
+  for (size_t i = 0; i < backlog->found_n; i++)
+    merge_message(dir, backlog->sorted[i], changes);
+
+  if (!STREQ(backlog->after, "0") &&
+      (!*dir->newest || id_cmp(backlog->after, dir->newest) > 0)) {
+    snprintf(dir->newest, sizeof(dir->newest), "%s", backlog->after);
+    id_to_ctime(&dir->mtime, backlog->after);
+    dcfs_add_change(changes, 0, dir->node.ino, NULL);
+  }
+
+  free(backlog->sorted);
+  json_array_destroy(backlog->found);
+}
+
+/* fetches only the messages newer than the newest one seen, a request or
+ * two when little has changed, and merges them into the listing. what
+ * changed is added to changes. dirs that haven't been listed are left for
+ * their first readdir. the caller holds no lock */
+int dcfs_dir_refresh(struct dcfs_dir *dir, json_array *changes) {
+  char channel_id[sizeof(dir->channel.id)];
+  struct backlog backlog;
+  memset(&backlog, 0, sizeof(struct backlog));
+
+  pthread_rwlock_rdlock(&dir->lock);
+  int loaded = dir->loaded;
+  snprintf(channel_id, sizeof(channel_id), "%s", dir->channel.id);
+  snprintf(backlog.after, sizeof(backlog.after), "%s", dir->newest);
+  dcfs_dir_unlock(dir);
+
+  if (!loaded)
+    return 0;
+
+  if (fetch_backlog(channel_id, &backlog) != 0)
+    return 1;
+
+  pthread_rwlock_wrlock(&dir->lock);
+  merge_backlog(dir, &backlog, changes);
+  dcfs_dir_unlock(dir);
+  return 0;
+}
+
+/* lists the dir from its manifest and the messages posted after it, a few
+ * requests however big the channel is. the caller holds dir->lock for
+ * writing */
+static int load_manifest(struct dcfs_dir *dir) {
+  if (dcfs_manifest_load(dir) != 0)
+    return 1;
+
+  struct backlog backlog;
+  memset(&backlog, 0, sizeof(struct backlog));
+  snprintf(backlog.after, sizeof(backlog.after), "%s", dir->newest);
+
+  if (fetch_backlog(dir->channel.id, &backlog) != 0) {
+    while (dir->files && dir->files->data)
+      dcfs_dir_remove_file(dir, dir->files->data);
+    *dir->newest = 0;
+    return 1;
+  }
+
+  /* a lot was posted since, save a fresher one */
+  if (backlog.pages > DCFS_MANIFEST_STALE_PAGES)
+    dcfs_dir_changed(dir);
+
+  merge_backlog(dir, &backlog, NULL);
+  dir->loaded = 1;
+  return 0;
+}
+
+static int id_order(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/* finds the files deleted on the server. dcfs_dir_refresh only sees new
+ * messages, so this walks the whole channel, but keeps nothing but the ids
+ * of the head messages and holds no lock while doing it. files newer than
+ * the walk are left alone */
+int dcfs_dir_prune(struct dcfs_dir *dir, json_array *changes) {
+  char channel_id[sizeof(dir->channel.id)];
+
+  pthread_rwlock_rdlock(&dir->lock);
+  int loaded = dir->loaded;
+  snprintf(channel_id, sizeof(channel_id), "%s", dir->channel.id);
+  dcfs_dir_unlock(dir);
+
+  if (!loaded)
+    return 0;
+
+  uint64_t *heads = NULL;
+  size_t heads_n = 0, heads_capacity = 0;
+  char newest[sizeof(dir->newest)] = {0};
+  char before[sizeof(dir->cursor)];
+
+  struct discord_page page;
+  memset(&page, 0, sizeof(struct discord_page));
+
+  do {
+    json_array *messages = discord_get_messages_page(channel_id, &page);
+    if (!messages) {
+      free(heads);
+      return 1;
+    }
+
+    if (!page.before)
+      snprintf(newest, sizeof(newest), "%s", page.first_id);
+
+    struct dcfs_message *message;
     json_array_for_each(messages, message) {
-      int ret = regexec(&part_regex.comp, message->filename,
-                        sizeof(part_regex.matches) / sizeof(regmatch_t),
-                        part_regex.matches, 0);
-
-      if (ret == 0) {
-        regmatch_t m_filename = part_regex.matches[1];
-        regmatch_t m_part = part_regex.matches[2];
-        size_t part_n = strtol(message->filename + m_part.rm_so, NULL, 10);
-
-
-        if (part_n >= DISCORD_MAX_PARTS) {
-          discord_free_messages(messages);
-          return NULL;
-        }
-
-        size_t filename_size = m_filename.rm_eo - m_filename.rm_so + 1;
-        char part_filename[filename_size + 1];
-        snprintf(part_filename, filename_size, "%s", message->filename + m_filename.rm_so);
-
-        struct dcfs_file *parent_file;
-        json_array_for_each(files, parent_file) {
-          if (strcmp(parent_file->filename, part_filename) == 0) {
-            struct dcfs_message *part = calloc(1, sizeof(struct dcfs_message));
-            assert(part);
-
-            part->size = message->size;
-            part->url = message->url;
-            snprintf(part->filename, sizeof(part->filename), "%s", message->filename);
-
-            parent_file->size += message->size;
-            parent_file->messages_n++;
-            parent_file->messages[part_n] = part;
-            break;
-          };
-        }
+      size_t base_len;
+      if (parse_part_suffix(message->filename, &base_len) != 0)
+        continue;
+
+      if (heads_n == heads_capacity) {
+        heads_capacity = heads_capacity ? heads_capacity * 2 : 64;
+        heads = realloc(heads, heads_capacity * sizeof(uint64_t));
+        assert(heads);
       }
+      heads[heads_n++] = strtoull(message->id, NULL, 10);
     }
+    discord_free_messages(messages);
 
-    json_array_destroy(messages);
-    goto out;
+    snprintf(before, sizeof(before), "%s", page.last_id);
+    page.before = before;
+  } while (page.messages_n == DISCORD_PAGE_SIZE);
+
+  if (heads_n)
+    qsort(heads, heads_n, sizeof(uint64_t), id_order);
+
+  pthread_rwlock_wrlock(&dir->lock);
+
+  json_array *node = dir->files;
+  while (node && node->data) {
+    struct dcfs_file *file = node->data;
+    node = node->next;
+
+    pthread_mutex_lock(&file->lock);
+    int keep = !file->messages_n || file->uploading ||
+               (*newest && id_cmp(file->messages[0]->id, newest) > 0);
+    if (!keep) {
+      uint64_t head = strtoull(file->messages[0]->id, NULL, 10);
+      keep = heads_n && bsearch(&head, heads, heads_n, sizeof(uint64_t),
+                                id_order) != NULL;
+    }
+    pthread_mutex_unlock(&file->lock);
+
+    if (!keep) {
+      dcfs_add_change(changes, dir->node.ino, file->node.ino, file->filename);
+      dcfs_dir_remove_file(dir, file);
+    }
   }
 
-out:
-  regfree(&part_regex.comp);
-  return files;
+  dcfs_dir_unlock(dir);
+
+  free(heads);
+  return 0;
+}
+
+struct dcfs_dir *dcfs_new_dir(json_array *dirs, struct dcfs_channel *channel) {
+  struct dcfs_dir *dir = calloc(1, sizeof(struct dcfs_dir));
+  if (!dir)
+    return NULL;
+
+  id_to_ctime(&dir->ctime, channel->id);
+  dir->mtime = dir->ctime;
+  if (*channel->last_message_id)
+    id_to_ctime(&dir->mtime, channel->last_message_id);
+  dir->mode = S_IFDIR | 0755;
+  dir->gid = getgid();
+  dir->uid = getuid();
+  memcpy(&dir->channel, channel, sizeof(struct dcfs_channel));
+  pthread_rwlock_init(&dir->lock, NULL);
+
+  /* the reference taken by dcfs_node_register belongs to dirs */
+  dcfs_node_register(&dir->node, DCFS_NODE_DIR,
+                     strtoull(channel->id, NULL, 10));
+  json_array_push(dirs, dir, 0, JSON_UNKNOWN);
+  return dir;
 }
 
 inline void dcfs_free_dir(struct dcfs_dir *dir) {
+  pthread_rwlock_destroy(&dir->lock);
   dcfs_free_files(dir->files);
+  free(dir->index.slots);
+  free_pending(dir);
 };
 
 void dcfs_free_dirs(json_array *dirs) {
@@ -155,18 +1053,7 @@ json_array *dcfs_get_dirs(const char *guild_id) {
     assert(dirs);
 
     struct dcfs_channel *channel;
-    json_array_for_each(channels, channel) {
-      struct dcfs_dir dir;
-      memset(&dir, 0, sizeof(struct dcfs_dir));
-
-      id_to_ctime(&dir.ctime, channel->id);
-      dir.mode = S_IFDIR | 0755;
-      dir.gid = getgid();
-      dir.uid = getuid();
-      memcpy(&dir.channel, channel, sizeof(struct dcfs_channel));
-
-      json_array_push(dirs, &dir, sizeof(struct dcfs_dir), JSON_UNKNOWN);
-    }
+    json_array_for_each(channels, channel) dcfs_new_dir(dirs, channel);
   }
 
   json_array_destroy(channels);
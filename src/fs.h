@@ -2,11 +2,40 @@
 #define DCFS_FS_H
 
 #include "discord/discord.h"
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/stat.h>
 
+#define DCFS_ROOT_INO 1
+
 typedef unsigned int dcfs_hash;
+
+enum dcfs_node_type {
+  DCFS_NODE_DIR = 1,
+  DCFS_NODE_FILE,
+};
+
+/* every dir and file starts with a node. ino is the channel id for dirs and
+ * the head message id for files, mixed with the filename since small files
+ * may share a head, so inode numbers stay the same across mounts. files
+ * created locally get a small number from a counter instead. a node is
+ * freed once the kernel has forgotten it (nlookup) and nothing else holds a
+ * reference (refs) */
+struct dcfs_node {
+  uint64_t ino;
+  uint64_t nlookup;
+  unsigned int refs;
+  enum dcfs_node_type type;
+  struct dcfs_node *next;
+};
+
+struct dcfs_dir;
+struct content_load;
+
 struct dcfs_file {
+  struct dcfs_node node;
+  struct dcfs_dir *parent;
   char filename[256];
   size_t size;
   mode_t mode;
@@ -16,27 +45,104 @@ struct dcfs_file {
   char *content;
   struct dcfs_message *messages[DISCORD_MAX_PARTS];
   size_t messages_n;
+  /* the content hash from the metadata of the head message, 0 if it had
+   * none. the size of a file with metadata is exact rather than the sum of
+   * the parts seen so far */
+  uint64_t hash;
+  /* reads waiting for the content to download, the download and whether an
+   * upload is in flight. all are driven by request callbacks in dcfs.c */
+  json_array *readers;
+  struct content_load *load;
+  char uploading;
+  /* open handles. an unlinked file keeps its messages until the last one
+   * is closed */
+  unsigned int opened;
+  char unlinked;
+  /* position in the listing, see dcfs_dir.seq */
+  unsigned long seq;
+  pthread_mutex_t lock;
+};
+
+struct dcfs_file_map {
+  struct dcfs_file **slots;
+  size_t slots_n;
+  size_t size;
 };
 
 struct dcfs_dir {
+  struct dcfs_node node;
   mode_t mode;
   gid_t gid;
   uid_t uid;
   time_t ctime;
+  time_t mtime;
   struct dcfs_channel channel;
   json_array *files;
+  struct dcfs_file_map index;
+  /* the listing is crawled newest first, one page at a time. pending holds
+   * files whose head hasn't been seen yet and cursor is where the next page
+   * starts. loaded is set once the last page is in */
+  struct dcfs_file_map pending;
+  char cursor[64];
+  char loaded;
+  /* the newest message seen, where dcfs_dir_refresh picks up from */
+  char newest[64];
+  /* when the background sync last refreshed the dir and how long it waits
+   * before the next time. only touched by the sync */
+  time_t refreshed;
+  unsigned int ttl;
+  /* the message holding the manifest this client last saved, whether one
+   * was looked for and whether the listing has changed since */
+  char manifest_id[64];
+  char manifest_tried;
+  char manifest_dirty;
+  /* bumped for every file added to files, so readers can pick up what was
+   * added since they last looked */
+  unsigned long seq;
+  pthread_rwlock_t lock;
 };
 
-struct dcfs_path {
-  char dir[128];
-  char filename[256];
+/* something a sync changed that the kernel may have cached: the name in
+ * parent if name is set, the attributes and data of ino if it isn't 0 */
+struct dcfs_change {
+  uint64_t parent;
+  uint64_t ino;
+  char name[256];
 };
 
-void dcfs_path_init(const char *path, struct dcfs_path *p);
+void dcfs_node_register(struct dcfs_node *node, enum dcfs_node_type type,
+                        uint64_t ino);
+uint64_t dcfs_node_next_ino();
+struct dcfs_node *dcfs_node_get(uint64_t ino);
+void dcfs_node_ref(struct dcfs_node *node);
+void dcfs_node_put(struct dcfs_node *node);
+void dcfs_node_lookup(struct dcfs_node *node);
+void dcfs_node_forget(uint64_t ino, uint64_t nlookup);
+
+/* lock order is state->lock, then dir->lock, then file->lock. a dir lock
+ * guards dir->files and dir->index, a file lock guards its content, size and
+ * messages */
+int dcfs_dir_lock(struct dcfs_dir *dir, int write);
+void dcfs_dir_unlock(struct dcfs_dir *dir);
+
+struct dcfs_file *dcfs_dir_find(struct dcfs_dir *dir, const char *filename);
+void dcfs_dir_add_file(struct dcfs_dir *dir, struct dcfs_file *file);
+void dcfs_dir_remove_file(struct dcfs_dir *dir, struct dcfs_file *file);
+void dcfs_dir_add_remote_file(struct dcfs_dir *dir, struct dcfs_file *file);
+
+struct dcfs_file *dcfs_new_file(struct dcfs_dir *parent, const char *filename);
+struct dcfs_dir *dcfs_new_dir(json_array *dirs, struct dcfs_channel *channel);
 
 void dcfs_free_file(struct dcfs_file *file);
 void dcfs_free_files(json_array *files);
-json_array *dcfs_get_files(const char *channel_id);
+void dcfs_dir_changed(struct dcfs_dir *dir);
+void dcfs_add_change(json_array *changes, uint64_t parent, uint64_t ino,
+                     const char *name);
+int dcfs_dir_load_page(struct dcfs_dir *dir);
+int dcfs_get_files(struct dcfs_dir *dir);
+void dcfs_set_crawl_threads(unsigned int n);
+int dcfs_dir_refresh(struct dcfs_dir *dir, json_array *changes);
+int dcfs_dir_prune(struct dcfs_dir *dir, json_array *changes);
 
 void dcfs_free_dir(struct dcfs_dir *dir);
 void dcfs_free_dirs(json_array *dirs);
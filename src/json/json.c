@@ -1,6 +1,7 @@
 #include "json.h"
 #include "util.h"
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -91,6 +92,32 @@ void json_array_remove_ptr(json_array **head, void *obj) {
   }
 }
 
+void json_array_detach_ptr(json_array **head, void *obj) {
+  if (!*head)
+    return;
+
+  json_array *array = *head;
+
+  for (; array; array = array->next) {
+    if (array->data == obj) {
+      if (array->prev) {
+        array->prev->next = array->next;
+      } else if (array->next) {
+        *head = array->next;
+      } else {
+        array->data = NULL;
+        break;
+      }
+
+      if (array->next)
+        array->next->prev = array->prev;
+
+      free(array);
+      break;
+    }
+  }
+}
+
 void json_array_remove(json_array **head, int n) {
   if (!*head)
     return;
@@ -137,6 +164,82 @@ int json_array_size(json_array *array) {
   return i;
 }
 
+static struct {
+  pthread_rwlock_t lock;
+  char **slots;
+  size_t slots_n;
+  size_t size;
+} key_pool = {.lock = PTHREAD_RWLOCK_INITIALIZER};
+
+static const char *key_pool_find(const char *key, unsigned int hash) {
+  if (!key_pool.slots)
+    return NULL;
+
+  size_t mask = key_pool.slots_n - 1;
+  for (size_t i = hash & mask; key_pool.slots[i]; i = (i + 1) & mask) {
+    if (strcmp(key_pool.slots[i], key) == 0)
+      return key_pool.slots[i];
+  }
+  return NULL;
+}
+
+static int key_pool_grow() {
+  size_t slots_n = key_pool.slots_n ? key_pool.slots_n * 2 : 256;
+  char **slots = calloc(slots_n, sizeof(char *));
+  if (!slots)
+    return 1;
+
+  for (size_t i = 0; i < key_pool.slots_n; i++) {
+    char *key = key_pool.slots[i];
+    if (!key)
+      continue;
+
+    size_t n = string_hash(key) & (slots_n - 1);
+    for (; slots[n]; n = (n + 1) & (slots_n - 1))
+      ;
+    slots[n] = key;
+  }
+
+  free(key_pool.slots);
+  key_pool.slots = slots;
+  key_pool.slots_n = slots_n;
+  return 0;
+}
+
+/* object keys come from a small, fixed vocabulary (discord's schema), so every
+ * distinct key is stored once for the lifetime of the process */
+static const char *key_intern(const char *key, unsigned int hash) {
+  pthread_rwlock_rdlock(&key_pool.lock);
+  const char *interned = key_pool_find(key, hash);
+  pthread_rwlock_unlock(&key_pool.lock);
+
+  if (interned)
+    return interned;
+
+  pthread_rwlock_wrlock(&key_pool.lock);
+  if ((interned = key_pool_find(key, hash)))
+    goto out;
+
+  if ((key_pool.size + 1) * 2 > key_pool.slots_n && key_pool_grow() != 0)
+    goto out;
+
+  char *copy = strdup(key);
+  if (!copy)
+    goto out;
+
+  size_t mask = key_pool.slots_n - 1;
+  size_t n = hash & mask;
+  for (; key_pool.slots[n]; n = (n + 1) & mask)
+    ;
+  key_pool.slots[n] = copy;
+  key_pool.size++;
+  interned = copy;
+
+out:
+  pthread_rwlock_unlock(&key_pool.lock);
+  return interned;
+}
+
 json_object *json_object_new() {
   json_object *object = malloc(sizeof(json_object));
   if (!object) {
@@ -150,74 +253,140 @@ json_object *json_object_new() {
 }
 
 void json_object_destroy(json_object *object) {
-  for (size_t i = 0; i < JSON_OBJECT_SIZE; i++) {
-    json_object_bucket *bucket = object->buckets[i];
-    while (bucket) {
-      json_object_bucket *next = bucket->next;
-      if (bucket->type == JSON_OBJECT)
-        json_object_destroy(bucket->value);
-      else if (bucket->type == JSON_ARRAY)
-        json_array_destroy(bucket->value);
-      else
-        free(bucket->value);
-
-      free(bucket->key);
-      free(bucket);
-      bucket = next;
-    }
+  for (size_t i = 0; i < object->size; i++) {
+    json_object_entry *entry = &object->entries[i];
+    if (entry->type == JSON_OBJECT)
+      json_object_destroy(entry->value);
+    else if (entry->type == JSON_ARRAY)
+      json_array_destroy(entry->value);
+    else
+      free(entry->value);
   }
+  free(object->entries);
+  free(object->index);
   free(object);
 }
 
-void *json_object_get(json_object *object, const char *key) {
-  size_t n = string_hash(key) % JSON_OBJECT_SIZE;
-  json_object_bucket *bucket = object->buckets[n];
+static int json_object_reindex(json_object *object) {
+  unsigned int index_size = object->index_size ? object->index_size * 2 : 32;
+  unsigned int *index = calloc(index_size, sizeof(unsigned int));
+  if (!index)
+    return 1;
 
-  if (bucket != NULL) {
-    for (size_t i = 0; bucket; bucket = bucket->next, i++) {
-      if (strcmp(bucket->key, key) == 0) {
-        return bucket->value;
-      }
+  for (unsigned int i = 0; i < object->size; i++) {
+    unsigned int n = object->entries[i].hash & (index_size - 1);
+    for (; index[n]; n = (n + 1) & (index_size - 1))
+      ;
+    index[n] = i + 1;
+  }
+
+  free(object->index);
+  object->index = index;
+  object->index_size = index_size;
+  return 0;
+}
+
+static json_object_entry *json_object_find(json_object *object, const char *key,
+                                           unsigned int hash) {
+  if (object->index) {
+    unsigned int mask = object->index_size - 1;
+    for (unsigned int n = hash & mask; object->index[n]; n = (n + 1) & mask) {
+      json_object_entry *entry = &object->entries[object->index[n] - 1];
+      if (entry->hash == hash && strcmp(entry->key, key) == 0)
+        return entry;
     }
+    return NULL;
   }
 
+  for (unsigned int i = 0; i < object->size; i++) {
+    json_object_entry *entry = &object->entries[i];
+    if (entry->hash == hash && strcmp(entry->key, key) == 0)
+      return entry;
+  }
   return NULL;
 }
 
-void *json_object_set(json_object *object, json_string key, void *value,
-                      size_t value_size, json_value_type type) {
-  size_t n = string_hash(key) % JSON_OBJECT_SIZE;
+void *json_object_get(json_object *object, const char *key) {
+  json_object_entry *entry = json_object_find(object, key, string_hash(key));
+  return entry ? entry->value : NULL;
+}
 
-  json_object_bucket *new_bucket = malloc(sizeof(json_object_bucket));
-  if (!new_bucket) {
-    fprintf(stderr, "json_object_set: failed to malloc\n");
-    return NULL;
-  }
+/* like json_object_get, but NULL unless the value has the given type */
+void *json_object_get_type(json_object *object, const char *key,
+                           json_value_type type) {
+  json_object_entry *entry = json_object_find(object, key, string_hash(key));
+  return entry && entry->type == type ? entry->value : NULL;
+}
 
-  new_bucket->next = NULL;
-  new_bucket->key = strdup(key);
-  new_bucket->type = type;
+void *json_object_set(json_object *object, json_string key, void *value,
+                      size_t value_size, json_value_type type) {
+  unsigned int hash = string_hash(key);
 
+  void *new_value = value;
   if (value_size > 0) {
-    new_bucket->value = malloc(value_size);
-    if (!new_bucket) {
-      free(new_bucket);
+    new_value = malloc(value_size);
+    if (!new_value) {
       fprintf(stderr, "json_object_set: failed to malloc\n");
       return NULL;
     }
-    memcpy(new_bucket->value, value, value_size);
-  } else {
-    new_bucket->value = value;
+    memcpy(new_value, value, value_size);
   }
 
-  json_object_bucket *last_bucket = object->buckets[n];
-  if (last_bucket) {
-    for (; last_bucket->next; last_bucket = last_bucket->next)
-      ;
-    last_bucket->next = new_bucket;
-  } else {
-    object->buckets[n] = new_bucket;
+  json_object_entry *entry = json_object_find(object, key, hash);
+  if (entry) {
+    if (entry->type == JSON_OBJECT)
+      json_object_destroy(entry->value);
+    else if (entry->type == JSON_ARRAY)
+      json_array_destroy(entry->value);
+    else
+      free(entry->value);
+
+    entry->type = type;
+    entry->value = new_value;
+    return new_value;
   }
 
-  return new_bucket->value;
+  const char *interned = key_intern(key, hash);
+  if (!interned)
+    goto fail;
+
+  if (object->size == object->capacity) {
+    unsigned int capacity = object->capacity ? object->capacity * 2 : 4;
+    json_object_entry *entries =
+        realloc(object->entries, capacity * sizeof(json_object_entry));
+    if (!entries)
+      goto fail;
+
+    object->entries = entries;
+    object->capacity = capacity;
+  }
+
+  entry = &object->entries[object->size++];
+  entry->key = interned;
+  entry->hash = hash;
+  entry->type = type;
+  entry->value = new_value;
+
+  if (object->size > JSON_OBJECT_LINEAR_MAX) {
+    if (object->size * 2 > object->index_size) {
+      if (json_object_reindex(object) != 0) {
+        object->size--;
+        goto fail;
+      }
+    } else {
+      unsigned int mask = object->index_size - 1;
+      unsigned int n = hash & mask;
+      for (; object->index[n]; n = (n + 1) & mask)
+        ;
+      object->index[n] = object->size;
+    }
+  }
+
+  return new_value;
+
+fail:
+  fprintf(stderr, "json_object_set: failed to malloc\n");
+  if (value_size > 0)
+    free(new_value);
+  return NULL;
 }
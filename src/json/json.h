@@ -3,7 +3,7 @@
 
 #include <stdio.h>
 
-#define JSON_OBJECT_SIZE 256
+#define JSON_OBJECT_LINEAR_MAX 8
 
 typedef enum json_value_type {
   JSON_UNKNOWN,
@@ -30,29 +30,39 @@ typedef struct json_array {
   struct json_array *prev;
 } json_array;
 
-typedef struct json_object_bucket {
-  json_string key;
-  void *value;
+typedef struct json_object_entry {
+  const char *key;
+  unsigned int hash;
   json_value_type type;
-  struct json_object_bucket *next;
-} json_object_bucket;
+  void *value;
+} json_object_entry;
 
+/* entries are kept in insertion order. objects with more than
+ * JSON_OBJECT_LINEAR_MAX keys also get an open-addressed index of entry
+ * positions (+1, 0 marks an empty slot). keys are interned and shared between
+ * all objects */
 typedef struct json_object {
-  json_object_bucket *buckets[JSON_OBJECT_SIZE];
+  json_object_entry *entries;
+  unsigned int size;
+  unsigned int capacity;
+  unsigned int *index;
+  unsigned int index_size;
 } json_object;
 
 #define json_array_for_each(pos, member)                                       \
   for (json_array *__pos = pos; __pos && __pos->data && ((member = __pos->data), 1); __pos = __pos->next)
 
 #define json_object_for_each(m, p)                                             \
-  for (size_t __i = 0; __i < JSON_OBJECT_SIZE; __i++)                          \
-    for ((p) = (m)->buckets[__i]; (p) != NULL; (p) = (p)->next)
+  for (size_t __i = 0; __i < (m)->size && (((p) = &(m)->entries[__i]), 1);    \
+       __i++)
 
 json_value_type json_load(const char *blob, void **object);
 
 json_object *json_object_new();
 void json_object_destroy(json_object *object);
 void *json_object_get(json_object *object, const char *key);
+void *json_object_get_type(json_object *object, const char *key,
+                           json_value_type type);
 void *json_object_set(json_object *object, json_string key, void *value,
                       size_t value_size, json_value_type type);
 
@@ -62,6 +72,7 @@ void *json_array_push(json_array *array, void *data, size_t data_size,
                       json_value_type type);
 void json_array_remove(json_array **head, int n);
 void json_array_remove_ptr(json_array **head, void *obj);
+void json_array_detach_ptr(json_array **head, void *obj);
 void *json_array_get(json_array *array, int n);
 int json_array_size(json_array *array);
 
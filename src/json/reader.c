@@ -3,6 +3,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* the longest string kept whole. message content goes up to 2000
+ * characters */
+#define JSON_STRING_SIZE 4096
+
 static json_object *json_parse_object(const char *blob, size_t *offset);
 
 static int json_parse_string(const char *blob, size_t *offset, char *buffer,
@@ -14,13 +18,23 @@ static int json_parse_string(const char *blob, size_t *offset, char *buffer,
 
   memset(buffer, 0, buffer_size);
 
-  for (int i = 0; *offset < blob_size; (*offset)++, i++) {
+  int len = 0;
+  for (; *offset < blob_size; (*offset)++) {
     char c = blob[*offset];
-    if (c == '"') {
-      buffer[i + 1] = 0;
-      return i;
-    } else
-      buffer[i] = c;
+    if (c == '"')
+      return len;
+
+    /* escapes are kept as they are, but an escaped quote doesn't end the
+     * string */
+    if (c == '\\' && *offset + 1 < blob_size) {
+      if ((size_t)len + 1 < buffer_size)
+        buffer[len++] = c;
+      c = blob[++(*offset)];
+    }
+
+    /* longer strings are cut short */
+    if ((size_t)len + 1 < buffer_size)
+      buffer[len++] = c;
   }
 
   return -1;
@@ -90,7 +104,7 @@ static json_array *json_parse_array(const char *blob, size_t *offset) {
     char c = blob[*offset];
 
     if (c == '"') {
-      char buffer[1024];
+      char buffer[JSON_STRING_SIZE];
       int string_size = json_parse_string(blob, offset, buffer, sizeof(buffer));
       if (string_size == -1) {
         json_array_destroy(array);
@@ -163,7 +177,7 @@ static json_object *json_parse_object(const char *blob, size_t *offset) {
         }
 
       } else {
-        char buffer[1024];
+        char buffer[JSON_STRING_SIZE];
         int string_size =
             json_parse_string(blob, offset, buffer, sizeof(buffer));
 
@@ -0,0 +1,311 @@
+#include "manifest.h"
+#include "util.h"
+
+#include <assert.h>
+#include <string.h>
+
+#ifndef MAX_FILESIZE
+#define MAX_FILESIZE 10485760
+#endif
+
+#define HEADER_SIZE 24
+#define RECORD_SIZE 40
+#define PART_SIZE 16
+
+static char enabled = 1;
+
+void dcfs_manifest_enable(int on) { enabled = on; }
+
+struct buffer {
+  char *data;
+  size_t size;
+  size_t capacity;
+};
+
+static void put(struct buffer *buf, const void *data, size_t size) {
+  if (buf->size + size > buf->capacity) {
+    size_t capacity = buf->capacity ? buf->capacity : 4096;
+    while (capacity < buf->size + size)
+      capacity *= 2;
+
+    buf->data = realloc(buf->data, capacity);
+    assert(buf->data);
+    buf->capacity = capacity;
+  }
+
+  memcpy(buf->data + buf->size, data, size);
+  buf->size += size;
+}
+
+static void put_int(struct buffer *buf, uint64_t n, size_t size) {
+  unsigned char bytes[8];
+  for (size_t i = 0; i < size; i++)
+    bytes[i] = n >> (i * 8);
+  put(buf, bytes, size);
+}
+
+static uint64_t get_int(const char *data, size_t size) {
+  uint64_t n = 0;
+  for (size_t i = 0; i < size; i++)
+    n |= (uint64_t)(unsigned char)data[i] << (i * 8);
+  return n;
+}
+
+/* only files whose parts are all on the server. the caller holds
+ * file->lock */
+static int complete(struct dcfs_file *file) {
+  if (!file->messages_n || file->uploading || file->unlinked)
+    return 0;
+
+  for (size_t i = 0; i < file->messages_n; i++) {
+    if (!file->messages[i])
+      return 0;
+  }
+  return 1;
+}
+
+/* the caller holds dir->lock */
+static char *encode(struct dcfs_dir *dir, size_t *size) {
+  struct buffer buf = {0};
+  uint32_t files_n = 0;
+
+  put(&buf, DCFS_MANIFEST_MAGIC, 8);
+  put_int(&buf, DCFS_MANIFEST_VERSION, 4);
+  put_int(&buf, 0, 4);
+  put_int(&buf, strtoull(dir->newest, NULL, 10), 8);
+
+  struct dcfs_file *file;
+  json_array_for_each(dir->files, file) {
+    pthread_mutex_lock(&file->lock);
+
+    if (complete(file)) {
+      size_t name_len = strlen(file->filename);
+
+      put_int(&buf, file->size, 8);
+      put_int(&buf, file->ctime, 8);
+      put_int(&buf, file->mode, 4);
+      put_int(&buf, file->uid, 4);
+      put_int(&buf, file->gid, 4);
+      put_int(&buf, file->hash, 8);
+      put_int(&buf, name_len, 2);
+      put_int(&buf, file->messages_n, 2);
+      put(&buf, file->filename, name_len);
+
+      for (size_t i = 0; i < file->messages_n; i++) {
+        put_int(&buf, strtoull(file->messages[i]->id, NULL, 10), 8);
+        put_int(&buf, file->messages[i]->size, 8);
+      }
+
+      const char *url = file->messages[0]->url;
+      size_t inline_len = url && strncmp(url, DISCORD_INLINE_URL,
+                                         strlen(DISCORD_INLINE_URL)) == 0
+                              ? strlen(url)
+                              : 0;
+      put_int(&buf, inline_len, 2);
+      if (inline_len)
+        put(&buf, url, inline_len);
+      files_n++;
+    }
+
+    pthread_mutex_unlock(&file->lock);
+  }
+
+  /* patch in the count */
+  for (size_t i = 0; i < 4; i++)
+    buf.data[12 + i] = files_n >> (i * 8);
+
+  *size = buf.size;
+  return buf.data;
+}
+
+/* adds the files of the manifest to the listing. the caller holds dir->lock
+ * for writing */
+static int decode(struct dcfs_dir *dir, const char *raw, size_t size) {
+  if (size < HEADER_SIZE || memcmp(raw, DCFS_MANIFEST_MAGIC, 8) ||
+      get_int(raw + 8, 4) != DCFS_MANIFEST_VERSION)
+    return 1;
+
+  uint32_t files_n = get_int(raw + 12, 4);
+  uint64_t newest = get_int(raw + 16, 8);
+  size_t offset = HEADER_SIZE;
+
+  for (uint32_t i = 0; i < files_n; i++) {
+    if (offset + RECORD_SIZE > size)
+      return 1;
+
+    const char *record = raw + offset;
+    size_t name_len = get_int(record + 36, 2);
+    size_t parts_n = get_int(record + 38, 2);
+    offset += RECORD_SIZE;
+
+    if (offset + name_len + parts_n * PART_SIZE > size || !name_len ||
+        name_len >= sizeof(((struct dcfs_file *)0)->filename) || !parts_n ||
+        parts_n > DISCORD_MAX_PARTS)
+      return 1;
+
+    const char *name = raw + offset;
+    const char *parts = name + name_len;
+    offset += name_len + parts_n * PART_SIZE;
+
+    if (offset + 2 > size)
+      return 1;
+
+    size_t inline_len = get_int(raw + offset, 2);
+    const char *inline_url = raw + offset + 2;
+    offset += 2 + inline_len;
+    if (offset > size)
+      return 1;
+
+    /* the name isn't terminated in the manifest */
+    char filename[sizeof(((struct dcfs_file *)0)->filename)];
+    memcpy(filename, name, name_len);
+    filename[name_len] = '\0';
+
+    /* a name listed twice keeps its first entry */
+    if (dir->index.slots && dcfs_dir_find(dir, filename))
+      continue;
+
+    struct dcfs_file *file = calloc(1, sizeof(struct dcfs_file));
+    assert(file);
+
+    memcpy(file->filename, filename, name_len + 1);
+    pthread_mutex_init(&file->lock, NULL);
+    file->size = get_int(record, 8);
+    file->ctime = get_int(record + 8, 8);
+    file->mode = get_int(record + 16, 4);
+    file->uid = get_int(record + 20, 4);
+    file->gid = get_int(record + 24, 4);
+    file->hash = get_int(record + 28, 8);
+
+    for (size_t j = 0; j < parts_n; j++) {
+      struct dcfs_message *part = calloc(1, sizeof(struct dcfs_message));
+      assert(part);
+
+      snprintf(part->id, sizeof(part->id), "%llu",
+               (unsigned long long)get_int(parts + j * PART_SIZE, 8));
+      part->size = get_int(parts + j * PART_SIZE + 8, 8);
+      if (j == 0 && inline_len)
+        part->url = strndup(inline_url, inline_len);
+
+      /* a name that leaves no room for the suffix of a part can't have
+       * been uploaded in parts */
+      int len =
+          j == 0 ? snprintf(part->filename, sizeof(part->filename), "%s",
+                            file->filename)
+                 : snprintf(part->filename, sizeof(part->filename),
+                            "%s.PART%zu", file->filename, j);
+      if (len < 0 || len >= (int)sizeof(part->filename)) {
+        discord_free_message(part);
+        free(part);
+        continue;
+      }
+
+      file->messages[j] = part;
+      file->messages_n++;
+    }
+
+    dcfs_dir_add_remote_file(dir, file);
+  }
+
+  snprintf(dir->newest, sizeof(dir->newest), "%llu",
+           (unsigned long long)newest);
+  return 0;
+}
+
+static struct dcfs_message *newest_manifest(json_array *manifests) {
+  struct dcfs_message *newest = NULL, *manifest;
+  json_array_for_each(manifests, manifest) {
+    if (!newest || id_cmp(manifest->id, newest->id) > 0)
+      newest = manifest;
+  }
+  return newest;
+}
+
+/* lists the dir from its newest manifest. the caller holds dir->lock for
+ * writing and merges the messages posted after it */
+int dcfs_manifest_load(struct dcfs_dir *dir) {
+  if (!enabled)
+    return 1;
+
+  json_array *manifests = discord_get_manifests(dir->channel.id);
+  struct dcfs_message *manifest = newest_manifest(manifests);
+  if (!manifest) {
+    discord_free_messages(manifests);
+    return 1;
+  }
+
+  struct response resp = {0};
+  request_get(manifest->url, &resp, 0);
+
+  int ret = 1;
+  if (resp.http_code == 200)
+    ret = decode(dir, resp.raw, resp.size);
+
+  if (ret != 0) {
+    print_warn("ignoring the manifest of %s\n", dir->channel.name);
+    while (dir->files && dir->files->data)
+      dcfs_dir_remove_file(dir, dir->files->data);
+  } else {
+    snprintf(dir->manifest_id, sizeof(dir->manifest_id), "%s", manifest->id);
+  }
+
+  free(resp.raw);
+  discord_free_messages(manifests);
+  return ret;
+}
+
+/* saves a new manifest if the listing changed since the last one, then
+ * deletes the older ones. the caller holds no lock */
+int dcfs_manifest_save(struct dcfs_dir *dir) {
+  if (!enabled)
+    return 0;
+
+  char channel_id[sizeof(dir->channel.id)];
+  size_t size;
+  char *raw = NULL;
+
+  pthread_rwlock_rdlock(&dir->lock);
+  if (dir->loaded &&
+      __atomic_exchange_n(&dir->manifest_dirty, 0, __ATOMIC_RELAXED)) {
+    snprintf(channel_id, sizeof(channel_id), "%s", dir->channel.id);
+    raw = encode(dir, &size);
+  }
+  dcfs_dir_unlock(dir);
+
+  if (!raw)
+    return 0;
+
+  if (size > MAX_FILESIZE) {
+    print_warn("%s has too many files for a manifest\n", dir->channel.name);
+    free(raw);
+    return 1;
+  }
+
+  char message_id[sizeof(dir->manifest_id)];
+  int ret = discord_post_manifest(channel_id, raw, size, message_id,
+                                  sizeof(message_id));
+  free(raw);
+
+  if (ret != 0) {
+    dcfs_dir_changed(dir);
+    return 1;
+  }
+
+  pthread_rwlock_wrlock(&dir->lock);
+  snprintf(dir->manifest_id, sizeof(dir->manifest_id), "%s", message_id);
+  dcfs_dir_unlock(dir);
+
+  /* ours and whatever other clients left behind */
+  json_array *manifests = discord_get_manifests(channel_id);
+  struct dcfs_message *manifest;
+  json_array_for_each(manifests, manifest) {
+    if (id_cmp(manifest->id, message_id) >= 0)
+      continue;
+
+    struct response resp = {0};
+    discord_delete_messsage(channel_id, manifest->id, &resp);
+  }
+
+  discord_free_messages(manifests);
+  return 0;
+}
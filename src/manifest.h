@@ -0,0 +1,33 @@
+#ifndef DCFS_MANIFEST_H
+#define DCFS_MANIFEST_H
+
+#include "fs.h"
+
+#define DCFS_MANIFEST_MAGIC "DCFSMANI"
+#define DCFS_MANIFEST_VERSION 3
+
+/* a manifest older than this many pages of messages is saved again */
+#define DCFS_MANIFEST_STALE_PAGES 10
+
+/* the manifest is an attachment pinned in the channel listing every file
+ * up to its newest message, so a dir loads with a few requests instead of
+ * a crawl. it starts with a header
+ *
+ *   magic[8] version:u32 files_n:u32 newest:u64
+ *
+ * followed by files_n records
+ *
+ *   size:u64 ctime:i64 mode:u32 uid:u32 gid:u32 hash:u64 name_len:u16
+ *   parts_n:u16
+ *   name[name_len] parts_n * (message id:u64 size:u64)
+ *   inline_len:u16 inline[inline_len]
+ *
+ * integers are little endian. attachment urls expire, so they aren't kept
+ * and are looked up when a file is first read. the url of an inline file
+ * holds its data and never expires, it is kept in inline. hash is the
+ * content hash from the metadata of the head message, 0 if it had none */
+void dcfs_manifest_enable(int enabled);
+int dcfs_manifest_load(struct dcfs_dir *dir);
+int dcfs_manifest_save(struct dcfs_dir *dir);
+
+#endif
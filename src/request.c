@@ -2,7 +2,116 @@
 #include "util.h"
 
 #include <curl/curl.h>
+#include <pthread.h>
 #include <string.h>
+#include <time.h>
+
+/* how often a request answered with 429 is sent again */
+#define REQUEST_MAX_RETRIES 5
+/* a transfer slower than this many bytes a second for the stall timeout is
+ * given up on */
+#define STALL_SPEED 1024
+/* hedging waits for this many downloads to have finished, and never fires
+ * sooner than HEDGE_MIN_MS */
+#define HEDGE_SAMPLES 256
+#define HEDGE_MIN_SAMPLES 20
+#define HEDGE_MIN_MS 250
+
+/* an easy handle together with everything that has to outlive it until the
+ * transfer is done */
+struct request {
+  CURL *curl;
+  struct curl_slist *headers;
+  curl_mime *form;
+  struct response *resp;
+  const char *method;
+
+  /* only used by async requests */
+  struct response async_resp;
+  request_cb cb;
+  void *data;
+  const char *cancel;
+  struct request *prev;
+  struct request *next;
+
+  /* how often the api answered 429 so far */
+  int tries;
+
+  /* downloads are hedged, see start_twin. started is when the first of
+   * them went out */
+  char hedge;
+  char twinned;
+  struct request *twin;
+  struct timespec started;
+};
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_t thread;
+  CURLM *multi;
+  struct request *queue;
+  struct request *active;
+  /* requests waiting for a rate limit to pass, only touched by the loop
+   * thread */
+  struct request *limited;
+  char stop;
+} loop = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* in seconds, 0 for none. the total doesn't apply to uploads, which take
+ * as long as they take as long as they move */
+static struct {
+  long connect;
+  long stall;
+  long total;
+} timeouts = {.connect = 10, .stall = 30, .total = 300};
+
+/* how long recent downloads took, in milliseconds. a download running past
+ * the percentile of these, after_ms, gets a twin. only touched by the loop
+ * thread */
+static struct {
+  unsigned int percentile;
+  long samples[HEDGE_SAMPLES];
+  size_t samples_n;
+  size_t next;
+  long after_ms;
+} hedge = {.percentile = 95};
+
+/* set when the api answers 429. every request waits it out, so the threads
+ * crawling in parallel and the request loop back off together */
+static struct {
+  pthread_mutex_t lock;
+  struct timespec until;
+} limit = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* returns how many milliseconds are left of the rate limit, 0 if none */
+static long limit_left(struct timespec *until) {
+  pthread_mutex_lock(&limit.lock);
+  *until = limit.until;
+  pthread_mutex_unlock(&limit.lock);
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long left = (until->tv_sec - now.tv_sec) * 1000 +
+              (until->tv_nsec - now.tv_nsec) / 1000000;
+  return left > 0 ? left : 0;
+}
+
+static void limit_wait() {
+  struct timespec until;
+  if (limit_left(&until))
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+}
+
+static void limit_for(long seconds) {
+  struct timespec until;
+  clock_gettime(CLOCK_MONOTONIC, &until);
+  until.tv_sec += seconds;
+
+  pthread_mutex_lock(&limit.lock);
+  if (until.tv_sec > limit.until.tv_sec)
+    limit.until = until;
+  pthread_mutex_unlock(&limit.lock);
+}
 
 static size_t write_cb(void *content, size_t size, size_t nmemb, void *data) {
   size_t realsize = size * nmemb;
@@ -21,6 +130,17 @@ static size_t write_cb(void *content, size_t size, size_t nmemb, void *data) {
   return realsize;
 }
 
+static inline int cancelled(const struct request *req) {
+  return req->cancel && __atomic_load_n(req->cancel, __ATOMIC_RELAXED);
+}
+
+/* called by curl as the transfer makes progress, a nonzero return aborts
+ * it */
+static int xferinfo_cb(void *data, curl_off_t dltotal, curl_off_t dlnow,
+                       curl_off_t ultotal, curl_off_t ulnow) {
+  return cancelled(data);
+}
+
 static struct curl_slist *append_auth_header(struct curl_slist *headers) {
   char auth_string[512];
   snprintf(auth_string, sizeof(auth_string), "Authorization: %s",
@@ -29,181 +149,563 @@ static struct curl_slist *append_auth_header(struct curl_slist *headers) {
   return curl_slist_append(headers, auth_string);
 }
 
-int request_get(const char *url, struct response *resp, char user_auth) {
-  CURLcode res = 0;
-  CURL *curl = curl_easy_init();
-  if (curl) {
-    struct curl_slist *headers = NULL;
-    headers = curl_slist_append(
-        headers, "Content-Type: application/json; charset=utf-8");
-    headers =
-        curl_slist_append(headers, "Accept: application/json; charset=utf-8");
-
-    if (user_auth != 0) {
-      headers = append_auth_header(headers);
-    }
+static void free_request(struct request *req) {
+  curl_slist_free_all(req->headers);
+  curl_mime_free(req->form);
+  curl_easy_cleanup(req->curl);
+  free(req);
+}
 
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_cb);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, resp);
+static struct request *new_request(const char *method, const char *url,
+                                   struct response *resp) {
+  struct request *req = calloc(1, sizeof(struct request));
+  if (!req)
+    return NULL;
 
-    res = curl_easy_perform(curl);
-    if (res != CURLE_OK) {
-      fprintf(stderr, "failed to GET: %s\n", curl_easy_strerror(res));
+  req->curl = curl_easy_init();
+  if (!req->curl) {
+    free(req);
+    return NULL;
+  }
 
-    } else {
-      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &resp->http_code);
-    }
+  req->method = method;
+  req->resp = resp ? resp : &req->async_resp;
+
+  curl_easy_setopt(req->curl, CURLOPT_URL, url);
+  curl_easy_setopt(req->curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(req->curl, CURLOPT_WRITEFUNCTION, write_cb);
+  curl_easy_setopt(req->curl, CURLOPT_WRITEDATA, req->resp);
+  curl_easy_setopt(req->curl, CURLOPT_PRIVATE, req);
 
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
+  if (timeouts.connect)
+    curl_easy_setopt(req->curl, CURLOPT_CONNECTTIMEOUT, timeouts.connect);
+  if (timeouts.stall) {
+    curl_easy_setopt(req->curl, CURLOPT_LOW_SPEED_LIMIT, (long)STALL_SPEED);
+    curl_easy_setopt(req->curl, CURLOPT_LOW_SPEED_TIME, timeouts.stall);
   }
+  if (timeouts.total && !STREQ(method, "POST FILE"))
+    curl_easy_setopt(req->curl, CURLOPT_TIMEOUT, timeouts.total);
+  return req;
+}
 
-  return res;
+static struct request *new_json_request(const char *method, const char *url,
+                                        char *data, struct response *resp,
+                                        char user_auth) {
+  struct request *req = new_request(method, url, resp);
+  if (!req)
+    return NULL;
+
+  req->headers = curl_slist_append(
+      req->headers, "Content-Type: application/json; charset=utf-8");
+  req->headers = curl_slist_append(req->headers,
+                                   "Accept: application/json; charset=utf-8");
+
+  if (user_auth != 0)
+    req->headers = append_auth_header(req->headers);
+
+  if (!STREQ(method, "GET") && !STREQ(method, "POST"))
+    curl_easy_setopt(req->curl, CURLOPT_CUSTOMREQUEST, method);
+  if (data)
+    curl_easy_setopt(req->curl, CURLOPT_POSTFIELDS, data);
+
+  curl_easy_setopt(req->curl, CURLOPT_HTTPHEADER, req->headers);
+  return req;
 }
 
-int request_post_files(const char *url, const struct file *files,
-                       size_t files_n, struct response *resp) {
-  CURLcode res = 0;
-  CURL *curl = curl_easy_init();
-  if (curl) {
-    curl_mime *form = curl_mime_init(curl);
-
-    curl_mimepart *part;
-    struct curl_slist *headers = NULL;
-    headers = append_auth_header(headers);
-
-    for (size_t i = 0; i < files_n; i++) {
-      struct file file = files[i];
-      part = curl_mime_addpart(form);
-      curl_mime_data(part, file.buffer, file.buffer_size);
-      curl_mime_filename(part, file.filename);
-      char name[64];
-      snprintf(name, sizeof(name), "files[%ld]", i);
-      curl_mime_name(part, name);
-    }
+static struct request *new_files_request(const char *url,
+                                         const struct file *files,
+                                         size_t files_n,
+                                         const char *payload,
+                                         struct response *resp) {
+  struct request *req = new_request("POST FILE", url, resp);
+  if (!req)
+    return NULL;
+
+  req->form = curl_mime_init(req->curl);
+  req->headers = append_auth_header(NULL);
+
+  /* the rest of the message, as json next to the files */
+  if (payload) {
+    curl_mimepart *part = curl_mime_addpart(req->form);
+    curl_mime_data(part, payload, CURL_ZERO_TERMINATED);
+    curl_mime_type(part, "application/json");
+    curl_mime_name(part, "payload_json");
+  }
 
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_MIMEPOST, form);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_cb);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, resp);
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+  /* curl_mime_data copies the buffer, so the caller's content may change
+   * once this returns */
+  for (size_t i = 0; i < files_n; i++) {
+    struct file file = files[i];
+    curl_mimepart *part = curl_mime_addpart(req->form);
+    curl_mime_data(part, file.buffer, file.buffer_size);
+    curl_mime_filename(part, file.filename);
+    char name[64];
+    snprintf(name, sizeof(name), "files[%ld]", i);
+    curl_mime_name(part, name);
+  }
 
-    res = curl_easy_perform(curl);
-    if (res != CURLE_OK) {
-      fprintf(stderr, "failed to POST FILE: %s\n", curl_easy_strerror(res));
+  curl_easy_setopt(req->curl, CURLOPT_MIMEPOST, req->form);
+  curl_easy_setopt(req->curl, CURLOPT_HTTPHEADER, req->headers);
+  return req;
+}
+
+static struct request *new_delete_request(const char *url,
+                                          struct response *resp,
+                                          char user_auth) {
+  struct request *req = new_request("DELETE", url, resp);
+  if (!req)
+    return NULL;
+
+  curl_easy_setopt(req->curl, CURLOPT_CUSTOMREQUEST, "DELETE");
+  if (user_auth != 0) {
+    req->headers = append_auth_header(NULL);
+    curl_easy_setopt(req->curl, CURLOPT_HTTPHEADER, req->headers);
+  }
+  return req;
+}
+
+/* opens the rate limit window the api asked for and clears the response
+ * for the request to go out again */
+static void limit_retry(struct request *req) {
+  curl_off_t retry_after = 0;
+  curl_easy_getinfo(req->curl, CURLINFO_RETRY_AFTER, &retry_after);
+  if (retry_after <= 0)
+    retry_after = 1;
+
+  print_warn("rate limited, retrying %s in %lds\n", req->method,
+             (long)retry_after);
+  limit_for(retry_after);
+
+  free(req->resp->raw);
+  req->resp->raw = NULL;
+  req->resp->size = 0;
+}
 
-    } else {
-      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &resp->http_code);
+static int perform(struct request *req) {
+  if (!req)
+    return 0;
+
+  CURLcode res;
+  for (int tries = 0;; tries++) {
+    limit_wait();
+
+    res = curl_easy_perform(req->curl);
+    if (res != CURLE_OK) {
+      fprintf(stderr, "failed to %s: %s\n", req->method,
+              curl_easy_strerror(res));
+      break;
     }
 
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
+    curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &req->resp->http_code);
+    if (req->resp->http_code != 429 || tries == REQUEST_MAX_RETRIES)
+      break;
+
+    limit_retry(req);
   }
 
+  free_request(req);
   return res;
 }
 
+int request_get(const char *url, struct response *resp, char user_auth) {
+  return perform(new_json_request("GET", url, NULL, resp, user_auth));
+}
+
+int request_post_files(const char *url, const struct file *files,
+                       size_t files_n, const char *payload,
+                       struct response *resp) {
+  return perform(new_files_request(url, files, files_n, payload, resp));
+}
+
 int request_post(const char *url, char *data, struct response *resp,
                  char user_auth) {
-  CURLcode res = 0;
-  CURL *curl = curl_easy_init();
-  if (curl) {
-    struct curl_slist *headers = NULL;
-    headers = curl_slist_append(
-        headers, "Content-Type: application/json; charset=utf-8");
-    headers =
-        curl_slist_append(headers, "Accept: application/json; charset=utf-8");
-
-    if (user_auth != 0) {
-      headers = append_auth_header(headers);
-    }
+  return perform(new_json_request("POST", url, data, resp, user_auth));
+}
 
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data);
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_cb);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, resp);
+int request_patch(const char *url, char *data, struct response *resp,
+                  char user_auth) {
+  return perform(new_json_request("PATCH", url, data, resp, user_auth));
+}
 
-    res = curl_easy_perform(curl);
-    if (res != CURLE_OK) {
-      fprintf(stderr, "failed to POST: %s\n", curl_easy_strerror(res));
+int request_put(const char *url, char *data, struct response *resp,
+                char user_auth) {
+  return perform(new_json_request("PUT", url, data, resp, user_auth));
+}
 
-    } else {
-      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &resp->http_code);
-    }
+int request_delete(const char *url, struct response *resp, char user_auth) {
+  return perform(new_delete_request(url, resp, user_auth));
+}
+
+static void unlink_active(struct request *req) {
+  if (req->prev)
+    req->prev->next = req->next;
+  else if (loop.active == req)
+    loop.active = req->next;
+  if (req->next)
+    req->next->prev = req->prev;
+  req->prev = req->next = NULL;
+}
+
+static void link_active(struct request *req) {
+  req->next = loop.active;
+  if (loop.active)
+    loop.active->prev = req;
+  loop.active = req;
+}
+
+static long ms_since(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000 +
+         (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static int cmp_long(const void *a, const void *b) {
+  long x = *(const long *)a, y = *(const long *)b;
+  return (x > y) - (x < y);
+}
+
+static void hedge_record(long ms) {
+  hedge.samples[hedge.next] = ms;
+  hedge.next = (hedge.next + 1) % HEDGE_SAMPLES;
+  if (hedge.samples_n < HEDGE_SAMPLES)
+    hedge.samples_n++;
+
+  if (!hedge.percentile || hedge.samples_n < HEDGE_MIN_SAMPLES)
+    return;
+
+  long sorted[HEDGE_SAMPLES];
+  memcpy(sorted, hedge.samples, hedge.samples_n * sizeof(long));
+  qsort(sorted, hedge.samples_n, sizeof(long), cmp_long);
+
+  long at = sorted[(hedge.samples_n - 1) * hedge.percentile / 100];
+  hedge.after_ms = at > HEDGE_MIN_MS ? at : HEDGE_MIN_MS;
+}
 
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
+/* only called from the loop thread, which owns loop.active */
+static void complete(struct request *req, CURLcode res) {
+  unlink_active(req);
+
+  if (res == CURLE_OK)
+    curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE,
+                      &req->resp->http_code);
+
+  /* a rate limited request goes out again once the limit has passed */
+  if (res == CURLE_OK && req->resp->http_code == 429 && !req->twin &&
+      req->tries < REQUEST_MAX_RETRIES && !cancelled(req)) {
+    req->tries++;
+    limit_retry(req);
+    req->next = loop.limited;
+    loop.limited = req;
+    return;
   }
 
-  return res;
+  /* the twin still running may yet make it */
+  struct request *twin = req->twin;
+  if (twin && (res != CURLE_OK || req->resp->http_code != 200)) {
+    twin->twin = NULL;
+    free(req->resp->raw);
+    free_request(req);
+    return;
+  }
+
+  if (twin) {
+    curl_multi_remove_handle(loop.multi, twin->curl);
+    unlink_active(twin);
+    free(twin->resp->raw);
+    free_request(twin);
+  }
+
+  /* nobody waits on a cancelled transfer, its failure isn't news */
+  if (res != CURLE_OK && !cancelled(req))
+    fprintf(stderr, "failed to %s: %s\n", req->method,
+            curl_easy_strerror(res));
+
+  if (req->hedge && req->resp->http_code == 200)
+    hedge_record(ms_since(&req->started));
+
+  /* the callback owns resp->raw */
+  req->cb(req->resp, req->data);
+  free_request(req);
 }
 
-int request_patch(const char *url, char *data, struct response *resp,
-                  char user_auth) {
-  CURLcode res = 0;
-  CURL *curl = curl_easy_init();
-  if (curl) {
-    struct curl_slist *headers = NULL;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-    headers = curl_slist_append(headers, "Accept: application/json");
-
-    if (user_auth != 0) {
-      headers = append_auth_header(headers);
-    }
+/* starts a duplicate of a download that's slower than most, likely stuck
+ * on a bad edge of the cdn. whichever of the two finishes first answers */
+static void start_twin(struct request *req) {
+  req->twinned = 1;
 
-    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PATCH");
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data);
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_cb);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, resp);
+  struct request *twin = calloc(1, sizeof(struct request));
+  if (!twin)
+    return;
 
-    res = curl_easy_perform(curl);
-    if (res != CURLE_OK) {
-      fprintf(stderr, "failed to PATCH: %s\n", curl_easy_strerror(res));
+  twin->curl = curl_easy_duphandle(req->curl);
+  if (!twin->curl) {
+    free(twin);
+    return;
+  }
+
+  /* the duplicate shares the header list, it needs its own to outlive the
+   * first */
+  for (struct curl_slist *header = req->headers; header; header = header->next)
+    twin->headers = curl_slist_append(twin->headers, header->data);
+
+  twin->method = req->method;
+  twin->resp = &twin->async_resp;
+  twin->cb = req->cb;
+  twin->data = req->data;
+  twin->cancel = req->cancel;
+  twin->hedge = 1;
+  twin->twinned = 1;
+  twin->started = req->started;
+
+  curl_easy_setopt(twin->curl, CURLOPT_HTTPHEADER, twin->headers);
+  curl_easy_setopt(twin->curl, CURLOPT_WRITEDATA, twin->resp);
+  curl_easy_setopt(twin->curl, CURLOPT_PRIVATE, twin);
+  curl_easy_setopt(twin->curl, CURLOPT_XFERINFODATA, twin);
+
+  if (curl_multi_add_handle(loop.multi, twin->curl) != CURLM_OK) {
+    free_request(twin);
+    return;
+  }
+
+  link_active(twin);
+  twin->twin = req;
+  req->twin = twin;
+}
 
-    } else {
-      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &resp->http_code);
+/* drops cancelled transfers, which never make progress while they wait for
+ * a connection, and hedges slow downloads. returns how long until the next
+ * download is due a twin in milliseconds, at most a second */
+static long sweep() {
+  long wait = 1000;
+
+  for (struct request *req = loop.active; req;) {
+    if (cancelled(req)) {
+      curl_multi_remove_handle(loop.multi, req->curl);
+      complete(req, CURLE_ABORTED_BY_CALLBACK);
+      /* the twin may have gone along with it */
+      req = loop.active;
+      continue;
     }
 
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
+    if (req->hedge && !req->twinned && hedge.after_ms) {
+      long left = hedge.after_ms - ms_since(&req->started);
+      if (left <= 0)
+        start_twin(req);
+      else if (left < wait)
+        wait = left;
+    }
+    req = req->next;
   }
 
-  return res;
+  return wait;
 }
 
-int request_delete(const char *url, struct response *resp, char user_auth) {
-  CURLcode res = 0;
-  CURL *curl = curl_easy_init();
-  if (curl) {
-    curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_cb);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, resp);
-
-    struct curl_slist *headers;
-    if (user_auth != 0) {
-      headers = append_auth_header(NULL);
-      curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+/* hands the requests of list to curl, or keeps them in loop.limited while
+ * a rate limit is on */
+static void start(struct request *list, int limited) {
+  for (struct request *req = list, *next; req; req = next) {
+    next = req->next;
+    req->next = NULL;
+
+    if (cancelled(req)) {
+      complete(req, CURLE_ABORTED_BY_CALLBACK);
+      continue;
     }
 
-    res = curl_easy_perform(curl);
-    if (res != CURLE_OK) {
-      fprintf(stderr, "failed to DELETE: %s\n", curl_easy_strerror(res));
+    if (limited) {
+      req->next = loop.limited;
+      loop.limited = req;
+      continue;
+    }
 
-    } else {
-      curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &resp->http_code);
+    if (curl_multi_add_handle(loop.multi, req->curl) != CURLM_OK) {
+      complete(req, CURLE_FAILED_INIT);
+      continue;
     }
 
-    if (user_auth != 0)
-      curl_slist_free_all(headers);
+    clock_gettime(CLOCK_MONOTONIC, &req->started);
+    link_active(req);
+  }
+}
+
+static void *loop_run(void *_) {
+  for (;;) {
+    pthread_mutex_lock(&loop.lock);
+    struct request *queue = loop.queue;
+    loop.queue = NULL;
+    char stop = loop.stop;
+    pthread_mutex_unlock(&loop.lock);
+
+    if (stop) {
+      start(queue, 0);
+      break;
+    }
 
-    curl_easy_cleanup(curl);
+    struct timespec until;
+    long limit_ms = limit_left(&until);
+    struct request *limited = loop.limited;
+    loop.limited = NULL;
+    start(limited, limit_ms != 0);
+    start(queue, limit_ms != 0);
+
+    long wait = sweep();
+    if (loop.limited && limit_ms < wait)
+      wait = limit_ms;
+
+    int running;
+    curl_multi_perform(loop.multi, &running);
+
+    CURLMsg *msg;
+    int msgs_n;
+    while ((msg = curl_multi_info_read(loop.multi, &msgs_n))) {
+      if (msg->msg != CURLMSG_DONE)
+        continue;
+
+      struct request *req;
+      CURLcode res = msg->data.result;
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&req);
+      curl_multi_remove_handle(loop.multi, msg->easy_handle);
+      complete(req, res);
+    }
+
+    curl_multi_poll(loop.multi, NULL, 0, wait, NULL);
   }
 
-  return res;
+  /* fail whatever is still in flight so callers can release their state */
+  for (struct request *req = loop.limited, *next; req; req = next) {
+    next = req->next;
+    req->next = NULL;
+    complete(req, CURLE_ABORTED_BY_CALLBACK);
+  }
+  loop.limited = NULL;
+
+  while (loop.active) {
+    curl_multi_remove_handle(loop.multi, loop.active->curl);
+    complete(loop.active, CURLE_ABORTED_BY_CALLBACK);
+  }
+
+  return NULL;
+}
+
+/* in seconds, 0 turns one off. set before the first request */
+void request_set_timeouts(long connect, long stall, long total) {
+  timeouts.connect = connect;
+  timeouts.stall = stall;
+  timeouts.total = total;
+}
+
+/* downloads slower than percentile percent of recent ones get a twin, 0
+ * turns hedging off. set before request_loop_start */
+void request_set_hedge(unsigned int percentile) {
+  hedge.percentile = percentile > 100 ? 100 : percentile;
+}
+
+int request_loop_start() {
+  loop.multi = curl_multi_init();
+  if (!loop.multi)
+    return 1;
+
+  /* don't open a connection per queued request, extra transfers wait for a
+   * free one */
+  curl_multi_setopt(loop.multi, CURLMOPT_MAX_HOST_CONNECTIONS, 16L);
+
+  if (pthread_create(&loop.thread, NULL, loop_run, NULL) != 0) {
+    curl_multi_cleanup(loop.multi);
+    loop.multi = NULL;
+    return 1;
+  }
+  return 0;
+}
+
+void request_loop_stop() {
+  if (!loop.multi)
+    return;
+
+  pthread_mutex_lock(&loop.lock);
+  loop.stop = 1;
+  pthread_mutex_unlock(&loop.lock);
+
+  curl_multi_wakeup(loop.multi);
+  pthread_join(loop.thread, NULL);
+
+  curl_multi_cleanup(loop.multi);
+  loop.multi = NULL;
+}
+
+static int submit(struct request *req, request_cb cb, void *data) {
+  if (!req)
+    return 1;
+
+  req->cb = cb;
+  req->data = data;
+
+  pthread_mutex_lock(&loop.lock);
+  if (!loop.multi || loop.stop) {
+    pthread_mutex_unlock(&loop.lock);
+    free_request(req);
+    return 1;
+  }
+
+  req->next = loop.queue;
+  loop.queue = req;
+  curl_multi_wakeup(loop.multi);
+  pthread_mutex_unlock(&loop.lock);
+
+  return 0;
+}
+
+int request_get_async(const char *url, char user_auth, request_cb cb,
+                      void *data) {
+  return submit(new_json_request("GET", url, NULL, NULL, user_auth), cb, data);
+}
+
+/* downloads an attachment, which takes no auth. the download stops once
+ * request_cancel sets cancel, if given, and one running past the hedge
+ * percentile of recent downloads is raced by a duplicate */
+int request_download_async(const char *url, const char *cancel, request_cb cb,
+                           void *data) {
+  struct request *req = new_json_request("GET", url, NULL, NULL, 0);
+  if (req && cancel) {
+    req->cancel = cancel;
+    curl_easy_setopt(req->curl, CURLOPT_XFERINFOFUNCTION, xferinfo_cb);
+    curl_easy_setopt(req->curl, CURLOPT_XFERINFODATA, req);
+    curl_easy_setopt(req->curl, CURLOPT_NOPROGRESS, 0L);
+  }
+  if (req)
+    req->hedge = 1;
+  return submit(req, cb, data);
+}
+
+/* sets a flag given to async requests. the ones in flight are aborted
+ * right away, their callbacks see http_code 0 */
+void request_cancel(char *cancel) {
+  __atomic_store_n(cancel, 1, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&loop.lock);
+  if (loop.multi)
+    curl_multi_wakeup(loop.multi);
+  pthread_mutex_unlock(&loop.lock);
+}
+
+int request_post_files_async(const char *url, const struct file *files,
+                             size_t files_n, const char *payload,
+                             request_cb cb, void *data) {
+  return submit(new_files_request(url, files, files_n, payload, NULL), cb,
+                data);
+}
+
+int request_patch_async(const char *url, const char *data, char user_auth,
+                        request_cb cb, void *cb_data) {
+  struct request *req = new_json_request("PATCH", url, NULL, NULL, user_auth);
+  /* unlike the synchronous requests the caller's buffer may be gone before
+   * the transfer starts */
+  if (req)
+    curl_easy_setopt(req->curl, CURLOPT_COPYPOSTFIELDS, data);
+  return submit(req, cb, cb_data);
+}
+
+int request_delete_async(const char *url, char user_auth, request_cb cb,
+                         void *data) {
+  return submit(new_delete_request(url, NULL, user_auth), cb, data);
 }
@@ -19,9 +19,35 @@ int request_get(const char *url, struct response *resp, char user_auth);
 int request_post(const char *url, char *data, struct response *resp,
                  char user_auth);
 int request_post_files(const char *url, const struct file *files,
-                       size_t files_n, struct response *resp);
+                       size_t files_n, const char *payload,
+                       struct response *resp);
 int request_patch(const char *url, char *data, struct response *resp,
                   char user_auth);
+int request_put(const char *url, char *data, struct response *resp,
+                char user_auth);
 int request_delete(const char *url, struct response *resp, char user_auth);
 
+/* async requests run on a single thread driving a curl multi handle. the
+ * callback is called from that thread once the transfer is done and owns
+ * resp->raw. a nonzero return means the callback will never be called */
+typedef void (*request_cb)(struct response *resp, void *data);
+
+void request_set_timeouts(long connect, long stall, long total);
+void request_set_hedge(unsigned int percentile);
+int request_loop_start();
+void request_loop_stop();
+
+int request_get_async(const char *url, char user_auth, request_cb cb,
+                      void *data);
+int request_download_async(const char *url, const char *cancel, request_cb cb,
+                           void *data);
+int request_post_files_async(const char *url, const struct file *files,
+                             size_t files_n, const char *payload,
+                             request_cb cb, void *data);
+int request_patch_async(const char *url, const char *data, char user_auth,
+                        request_cb cb, void *cb_data);
+int request_delete_async(const char *url, char user_auth, request_cb cb,
+                         void *data);
+void request_cancel(char *cancel);
+
 #endif
@@ -0,0 +1,391 @@
+#include "snapshot.h"
+#include "util.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* records are read in place, keep every array 8 byte aligned */
+_Static_assert(sizeof(struct dcfs_snapshot_header) % 8 == 0, "header size");
+_Static_assert(sizeof(struct dcfs_snapshot_dir) % 8 == 0, "dir size");
+_Static_assert(sizeof(struct dcfs_snapshot_file) % 8 == 0, "file size");
+_Static_assert(sizeof(struct dcfs_snapshot_part) % 8 == 0, "part size");
+
+/* a growable array of records */
+struct buffer {
+  char *data;
+  size_t size;
+  size_t capacity;
+};
+
+static void *buffer_push(struct buffer *buf, const void *data, size_t size) {
+  if (buf->size + size > buf->capacity) {
+    size_t capacity = buf->capacity ? buf->capacity : 4096;
+    while (capacity < buf->size + size)
+      capacity *= 2;
+
+    char *grown = realloc(buf->data, capacity);
+    if (!grown)
+      return NULL;
+
+    buf->data = grown;
+    buf->capacity = capacity;
+  }
+
+  void *slot = buf->data + buf->size;
+  if (data)
+    memcpy(slot, data, size);
+  else
+    memset(slot, 0, size);
+
+  buf->size += size;
+  return slot;
+}
+
+/* $XDG_CACHE_HOME/dcfs/<guild id>.<suffix>, falling back to ~/.cache. the
+ * dir is created if needed */
+char *dcfs_cache_path(const char *guild_id, const char *suffix) {
+  char dir[4096];
+  const char *cache = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+
+  if (cache && *cache)
+    snprintf(dir, sizeof(dir), "%s/dcfs", cache);
+  else if (home && *home)
+    snprintf(dir, sizeof(dir), "%s/.cache/dcfs", home);
+  else
+    return NULL;
+
+  /* the parent of dir may not exist either */
+  char *slash = strrchr(dir, '/');
+  *slash = 0;
+  mkdir(dir, 0700);
+  *slash = '/';
+
+  if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+    print_warn("failed to create %s: %s\n", dir, strerror(errno));
+    return NULL;
+  }
+
+  char path[4096 + 128];
+  snprintf(path, sizeof(path), "%s/%s.%s", dir, guild_id, suffix);
+  return strdup(path);
+}
+
+char *dcfs_snapshot_path(const char *guild_id) {
+  return dcfs_cache_path(guild_id, "snapshot");
+}
+
+static int restore_file(struct dcfs_dir *dir,
+                        const struct dcfs_snapshot_header *header,
+                        const struct dcfs_snapshot_file *record,
+                        const struct dcfs_snapshot_part *parts,
+                        const char *strings) {
+  if (record->parts_start + record->parts_n > header->parts_n ||
+      record->parts_n == 0 || record->parts_n > DISCORD_MAX_PARTS ||
+      record->filename[sizeof(record->filename) - 1])
+    return 1;
+
+  struct dcfs_file *file = calloc(1, sizeof(struct dcfs_file));
+  assert(file);
+
+  snprintf(file->filename, sizeof(file->filename), "%s", record->filename);
+  pthread_mutex_init(&file->lock, NULL);
+  file->size = record->size;
+  file->ctime = record->ctime;
+  file->hash = record->hash;
+  file->mode = record->mode;
+  file->uid = record->uid;
+  file->gid = record->gid;
+
+  for (uint32_t i = 0; i < record->parts_n; i++) {
+    const struct dcfs_snapshot_part *p = &parts[record->parts_start + i];
+    if (p->part_n >= DISCORD_MAX_PARTS || file->messages[p->part_n] ||
+        p->url + p->url_len > header->strings_size ||
+        p->id[sizeof(p->id) - 1])
+      continue;
+
+    struct dcfs_message *part = calloc(1, sizeof(struct dcfs_message));
+    assert(part);
+
+    snprintf(part->id, sizeof(part->id), "%s", p->id);
+
+    /* the name of a part takes a suffix, a name that leaves no room for it
+     * can't have been uploaded in parts */
+    int len =
+        p->part_n == 0
+            ? snprintf(part->filename, sizeof(part->filename), "%s",
+                       file->filename)
+            : snprintf(part->filename, sizeof(part->filename), "%s.PART%u",
+                       file->filename, p->part_n);
+    if (len < 0 || len >= (int)sizeof(part->filename)) {
+      free(part);
+      continue;
+    }
+
+    part->size = p->size;
+    if (p->url_len)
+      part->url = strndup(strings + p->url, p->url_len);
+
+    file->messages[p->part_n] = part;
+    file->messages_n++;
+  }
+
+  if (!file->messages[0]) {
+    pthread_mutex_destroy(&file->lock);
+    dcfs_free_file(file);
+    free(file);
+    return 1;
+  }
+
+  dcfs_dir_add_remote_file(dir, file);
+  return 0;
+}
+
+/* returns the dirs saved by dcfs_snapshot_save, with the listings of those
+ * that had been loaded, or NULL if there's no usable snapshot */
+json_array *dcfs_snapshot_load(const char *path, const char *guild_id) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return NULL;
+
+  struct stat stbuf;
+  if (fstat(fd, &stbuf) != 0 ||
+      (size_t)stbuf.st_size < sizeof(struct dcfs_snapshot_header)) {
+    close(fd);
+    return NULL;
+  }
+
+  size_t size = stbuf.st_size;
+  char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  json_array *dirs = NULL;
+  const struct dcfs_snapshot_header *header = (void *)map;
+
+  if (memcmp(header->magic, DCFS_SNAPSHOT_MAGIC, sizeof(header->magic)) ||
+      header->version != DCFS_SNAPSHOT_VERSION ||
+      strncmp(header->guild_id, guild_id, sizeof(header->guild_id))) {
+    print_warn("ignoring snapshot %s: wrong version or guild\n", path);
+    goto out;
+  }
+
+  size_t dirs_off = sizeof(struct dcfs_snapshot_header);
+  size_t files_off =
+      dirs_off + header->dirs_n * sizeof(struct dcfs_snapshot_dir);
+  size_t parts_off =
+      files_off + header->files_n * sizeof(struct dcfs_snapshot_file);
+  size_t strings_off =
+      parts_off + header->parts_n * sizeof(struct dcfs_snapshot_part);
+
+  if (strings_off + header->strings_size != size) {
+    print_warn("ignoring snapshot %s: truncated\n", path);
+    goto out;
+  }
+
+  const struct dcfs_snapshot_dir *dir_records = (void *)(map + dirs_off);
+  const struct dcfs_snapshot_file *files = (void *)(map + files_off);
+  const struct dcfs_snapshot_part *parts = (void *)(map + parts_off);
+  const char *strings = map + strings_off;
+
+  dirs = json_array_new();
+  assert(dirs);
+
+  for (uint32_t i = 0; i < header->dirs_n; i++) {
+    const struct dcfs_snapshot_dir *record = &dir_records[i];
+
+    struct dcfs_channel channel;
+    memset(&channel, 0, sizeof(struct dcfs_channel));
+    snprintf(channel.id, sizeof(channel.id), "%.*s", (int)sizeof(record->id),
+             record->id);
+    snprintf(channel.name, sizeof(channel.name), "%.*s",
+             (int)sizeof(record->name), record->name);
+    snprintf(channel.last_message_id, sizeof(channel.last_message_id), "%.*s",
+             (int)sizeof(record->last_message_id), record->last_message_id);
+    channel.type = record->type;
+    channel.has_parent = record->has_parent;
+
+    struct dcfs_dir *dir = dcfs_new_dir(dirs, &channel);
+    if (!dir)
+      continue;
+
+    snprintf(dir->newest, sizeof(dir->newest), "%.*s",
+             (int)sizeof(record->newest), record->newest);
+    dir->mode = record->mode;
+    dir->uid = record->uid;
+    dir->gid = record->gid;
+
+    if (!record->loaded || record->files_start + record->files_n >
+                               header->files_n)
+      continue;
+
+    pthread_rwlock_wrlock(&dir->lock);
+    dir->files = json_array_new();
+    for (uint32_t j = 0; j < record->files_n; j++)
+      restore_file(dir, header, &files[record->files_start + j], parts,
+                   strings);
+    dir->loaded = 1;
+    dcfs_dir_unlock(dir);
+  }
+
+out:
+  munmap(map, size);
+  return dirs;
+}
+
+/* the caller holds file->lock */
+static int save_file(struct buffer *files, struct buffer *parts,
+                     struct buffer *strings, struct dcfs_file *file) {
+  struct dcfs_snapshot_file *record =
+      buffer_push(files, NULL, sizeof(struct dcfs_snapshot_file));
+  if (!record)
+    return 1;
+
+  snprintf(record->filename, sizeof(record->filename), "%s", file->filename);
+  record->parts_start = parts->size / sizeof(struct dcfs_snapshot_part);
+  record->size = file->size;
+  record->ctime = file->ctime;
+  record->hash = file->hash;
+  record->mode = file->mode;
+  record->uid = file->uid;
+  record->gid = file->gid;
+
+  for (size_t i = 0; i < DISCORD_MAX_PARTS; i++) {
+    struct dcfs_message *message = file->messages[i];
+    if (!message)
+      continue;
+
+    struct dcfs_snapshot_part *part =
+        buffer_push(parts, NULL, sizeof(struct dcfs_snapshot_part));
+    if (!part)
+      return 1;
+
+    snprintf(part->id, sizeof(part->id), "%s", message->id);
+    part->size = message->size;
+    part->part_n = i;
+    part->url = strings->size;
+    /* parts listed from a manifest may not have one yet */
+    part->url_len = message->url ? strlen(message->url) : 0;
+    if (part->url_len && !buffer_push(strings, message->url, part->url_len))
+      return 1;
+
+    record = (void *)(files->data + files->size - sizeof(*record));
+    record->parts_n++;
+  }
+
+  return 0;
+}
+
+static int save_dir(struct buffer *dir_records, struct buffer *files,
+                    struct buffer *parts, struct buffer *strings,
+                    struct dcfs_dir *dir) {
+  struct dcfs_snapshot_dir *record =
+      buffer_push(dir_records, NULL, sizeof(struct dcfs_snapshot_dir));
+  if (!record)
+    return 1;
+
+  size_t index = dir_records->size / sizeof(*record) - 1;
+
+  pthread_rwlock_rdlock(&dir->lock);
+
+  snprintf(record->id, sizeof(record->id), "%s", dir->channel.id);
+  snprintf(record->name, sizeof(record->name), "%s", dir->channel.name);
+  snprintf(record->last_message_id, sizeof(record->last_message_id), "%s",
+           dir->channel.last_message_id);
+  snprintf(record->newest, sizeof(record->newest), "%s", dir->newest);
+  record->type = dir->channel.type;
+  record->has_parent = dir->channel.has_parent;
+  record->mode = dir->mode;
+  record->uid = dir->uid;
+  record->gid = dir->gid;
+  record->loaded = dir->loaded;
+  record->files_start = files->size / sizeof(struct dcfs_snapshot_file);
+
+  int ret = 0;
+  size_t files_n = 0;
+
+  struct dcfs_file *file;
+  json_array_for_each(dir->loaded ? dir->files : NULL, file) {
+    pthread_mutex_lock(&file->lock);
+
+    /* only what's on the server, local files are gone after a restart */
+    if (file->messages[0] && !file->uploading && !file->unlinked) {
+      ret = save_file(files, parts, strings, file);
+      files_n++;
+    }
+
+    pthread_mutex_unlock(&file->lock);
+    if (ret != 0)
+      break;
+  }
+
+  dcfs_dir_unlock(dir);
+
+  record = (void *)(dir_records->data + index * sizeof(*record));
+  record->files_n = files_n;
+  return ret;
+}
+
+/* writes the snapshot next to path and renames it into place, so a crash
+ * never leaves a half written one. the caller holds the lock guarding
+ * dirs */
+int dcfs_snapshot_save(const char *path, const char *guild_id,
+                       json_array *dirs) {
+  struct buffer dir_records = {0}, files = {0}, parts = {0}, strings = {0};
+  int ret = 1;
+
+  struct dcfs_dir *dir;
+  json_array_for_each(dirs, dir) {
+    if (save_dir(&dir_records, &files, &parts, &strings, dir) != 0)
+      goto out;
+  }
+
+  struct dcfs_snapshot_header header;
+  memset(&header, 0, sizeof(struct dcfs_snapshot_header));
+  memcpy(header.magic, DCFS_SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = DCFS_SNAPSHOT_VERSION;
+  header.dirs_n = dir_records.size / sizeof(struct dcfs_snapshot_dir);
+  header.files_n = files.size / sizeof(struct dcfs_snapshot_file);
+  header.parts_n = parts.size / sizeof(struct dcfs_snapshot_part);
+  header.strings_size = strings.size;
+  snprintf(header.guild_id, sizeof(header.guild_id), "%s", guild_id);
+
+  char tmp_path[4096];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+  FILE *fp = fopen(tmp_path, "wb");
+  if (!fp) {
+    print_warn("failed to open %s: %s\n", tmp_path, strerror(errno));
+    goto out;
+  }
+
+  int failed = fwrite(&header, sizeof(header), 1, fp) != 1;
+  failed |= fwrite(dir_records.data, 1, dir_records.size, fp) !=
+            dir_records.size;
+  failed |= fwrite(files.data, 1, files.size, fp) != files.size;
+  failed |= fwrite(parts.data, 1, parts.size, fp) != parts.size;
+  failed |= fwrite(strings.data, 1, strings.size, fp) != strings.size;
+  failed |= fclose(fp) != 0;
+
+  if (failed || rename(tmp_path, path) != 0) {
+    print_warn("failed to write snapshot %s\n", path);
+    unlink(tmp_path);
+    goto out;
+  }
+
+  ret = 0;
+
+out:
+  free(dir_records.data);
+  free(files.data);
+  free(parts.data);
+  free(strings.data);
+  return ret;
+}
@@ -0,0 +1,64 @@
+#ifndef DCFS_SNAPSHOT_H
+#define DCFS_SNAPSHOT_H
+
+#include "fs.h"
+
+#define DCFS_SNAPSHOT_MAGIC "DCFSSNAP"
+#define DCFS_SNAPSHOT_VERSION 3
+
+/* the snapshot is a header followed by arrays of fixed-size dir, file and
+ * part records and a table of urls. it's mapped and read in place, records
+ * refer to each other by index */
+struct dcfs_snapshot_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t dirs_n;
+  uint64_t files_n;
+  uint64_t parts_n;
+  uint64_t strings_size;
+  char guild_id[64];
+};
+
+struct dcfs_snapshot_dir {
+  uint64_t files_start;
+  uint32_t files_n;
+  uint32_t type;
+  uint32_t mode;
+  uint32_t uid;
+  uint32_t gid;
+  uint8_t has_parent;
+  uint8_t loaded;
+  uint8_t padding[2];
+  char id[64];
+  char name[128];
+  char last_message_id[64];
+  char newest[64];
+};
+
+struct dcfs_snapshot_file {
+  uint64_t parts_start;
+  uint64_t size;
+  int64_t ctime;
+  uint64_t hash;
+  uint32_t parts_n;
+  uint32_t mode;
+  uint32_t uid;
+  uint32_t gid;
+  char filename[256];
+};
+
+struct dcfs_snapshot_part {
+  uint64_t size;
+  uint64_t url;
+  uint32_t url_len;
+  uint32_t part_n;
+  char id[64];
+};
+
+char *dcfs_cache_path(const char *guild_id, const char *suffix);
+char *dcfs_snapshot_path(const char *guild_id);
+json_array *dcfs_snapshot_load(const char *path, const char *guild_id);
+int dcfs_snapshot_save(const char *path, const char *guild_id,
+                       json_array *dirs);
+
+#endif
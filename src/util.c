@@ -1,6 +1,7 @@
 #include "util.h"
 
 #include <curl/curl.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -31,6 +32,13 @@ inline void id_to_ctime(time_t *dest, const char *id) {
   *dest = ((n >> 22) + 1420070400000) / 1000;
 }
 
+/* orders snowflakes, which is to say by time */
+int id_cmp(const char *a, const char *b) {
+  uint64_t x = strtoull(a, NULL, 10);
+  uint64_t y = strtoull(b, NULL, 10);
+  return (x > y) - (x < y);
+}
+
 char *get_auth_token() {
   char *value = getenv("DCFS_TOKEN");
   if (value != NULL && strlen(value) > 100) {
@@ -60,9 +68,13 @@ static int is_b64_valid(char c) {
 }
 
 int b64encode(char *out, const char *in, size_t out_len) {
+  return b64encode_n(out, in, strlen(in), out_len);
+}
+
+/* b64encode for data that may hold zeroes */
+int b64encode_n(char *out, const char *in, size_t in_len, size_t out_len) {
   size_t in_offset = 0;
   size_t out_offset = 0;
-  size_t in_len = strlen(in);
 
   for (; in_offset < in_len; in_offset += 3, out_offset += 4) {
     if (out_offset + 3 >= out_len)
@@ -141,6 +153,30 @@ dcfs_hash string_hash(const char *string) {
   return hash;
 }
 
+dcfs_hash string_hash_n(const char *string, size_t n) {
+  dcfs_hash hash = 5381;
+  for (size_t i = 0; i < n && string[i]; i++)
+    hash = ((hash << 5) + hash) + string[i];
+
+  return hash;
+}
+
+/* 64 bit fnv-1a, enough to tell a corrupt or truncated download from the
+ * content that was uploaded */
+uint64_t content_hash(const char *content, size_t size) {
+  return content_hash_more(0xcbf29ce484222325, content, size);
+}
+
+/* carries on the hash of content that comes a piece at a time */
+uint64_t content_hash_more(uint64_t hash, const char *content, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    hash ^= (unsigned char)content[i];
+    hash *= 0x100000001b3;
+  }
+
+  return hash;
+}
+
 void string_normalize(char *out, const char *in, size_t out_len) {
 #ifdef __APPLE__
   CFStringRef cfStringRef =
@@ -154,7 +190,7 @@ void string_normalize(char *out, const char *in, size_t out_len) {
   CFRelease(cfStringRef);
   CFRelease(cfMutable);
 #else
-  memcpy(out, in, out_len);
+  snprintf(out, out_len, "%s", in);
 #endif
 }
 
@@ -188,13 +224,13 @@ void print_warn(const char *format, ...) {
   va_end(list);
 }
 
-void print_op(const char *op, struct dcfs_path *path) {
-  if (!*path->dir && !*path->filename) {
+void print_op(const char *op, const char *dir, const char *filename) {
+  if (!dir) {
     printf("\033[35;1mOPERATION \033[37m%s\033[0m: /\n", op);
-  } else if (!*path->filename) {
-    printf("\033[35;1mOPERATION \033[37m%s\033[0m: /%s\n", op, path->dir);
+  } else if (!filename) {
+    printf("\033[35;1mOPERATION \033[37m%s\033[0m: /%s\n", op, dir);
   } else {
-    printf("\033[35;1mOPERATION \033[37m%s\033[0m: /%s/%s\n", op, path->dir,
-           path->filename);
+    printf("\033[35;1mOPERATION \033[37m%s\033[0m: /%s/%s\n", op, dir,
+           filename);
   }
 }
@@ -9,20 +9,25 @@
 #define STREQ(s1, s2) (strcmp((s1), (s2)) == 0)
 
 void id_to_ctime(time_t *ctime, const char *id);
+int id_cmp(const char *a, const char *b);
 char *get_auth_token();
 char *get_guild_id();
 
 int b64encode(char *out, const char *in, size_t out_len);
+int b64encode_n(char *out, const char *in, size_t in_len, size_t out_len);
 int b64decode(char *out, const char *in, size_t out_len);
 
 int count_char(const char *string, char c);
 int last_index(const char *string, char c);
 dcfs_hash string_hash(const char *string);
+dcfs_hash string_hash_n(const char *string, size_t n);
+uint64_t content_hash(const char *content, size_t size);
+uint64_t content_hash_more(uint64_t hash, const char *content, size_t size);
 void string_normalize(char *out, const char *in, size_t out_len);
 
 void print_err(const char *format, ...);
 void print_inf(const char *format, ...);
 void print_warn(const char *format, ...);
-void print_op(const char *op, struct dcfs_path *path);
+void print_op(const char *op, const char *dir, const char *filename);
 
 #endif